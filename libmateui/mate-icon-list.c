@@ -70,6 +70,12 @@ typedef MateIconListPrivate GilPrivate;
 /* Autoscroll timeout in milliseconds */
 #define SCROLL_TIMEOUT 30
 
+/* Vertical margin of the icon text items, as in mate-icon-item.c */
+#define TEXT_MARGIN_Y 2
+
+/* Number of images loaded from files that a virtual list keeps */
+#define PIXBUF_CACHE_SIZE 256
+
 
 /* Signals */
 enum {
@@ -117,6 +123,27 @@ typedef struct {
 	/* ID for the text item's event signal handler */
 	guint text_event_id;
 
+	/* In virtual lists, the items only exist while the icon is in view.
+	 * The icon keeps its image, its text and the height of the text.
+	 * Images given by icon_filename are loaded once the icon is shown;
+	 * until then their size is -1 and the icon gets a square cell.
+	 */
+	GdkPixbuf *pixbuf;
+	char *label;
+	int image_width, image_height, text_height;
+
+	/* Link in the cache of images loaded from icon_filename */
+	GList *cache_link;
+
+	/* ID for the image item's event signal handler */
+	guint image_event_id;
+
+	/* Last pass of gil_bind_visible() that found the icon in view */
+	guint bind_stamp;
+
+	/* Whether label needs to be freed */
+	guint label_allocated : 1;
+
 	/* Whether the icon is selected, and temporary storage for rubberband
          * selections.
 	 */
@@ -124,11 +151,11 @@ typedef struct {
 	guint tmp_selected : 1;
 } Icon;
 
-/* A row of icons */
+/* A row of icons: icon_list[first] to icon_list[first + n_icons - 1] */
 typedef struct {
-	GList *line_icons;
-	gint16 y;
-	gint16 icon_height, text_height;
+	int first, n_icons;
+	int y;
+	int icon_height, text_height;
 } IconLine;
 
 /* Private data of the MateIconList structure */
@@ -136,8 +163,9 @@ struct _MateIconListPrivate {
 	/* List of icons */
 	GArray *icon_list;
 
-	/* List of rows of icons */
-	GList *lines;
+	/* Array of IconLine rows, from the top, and their total height */
+	GArray *lines;
+	int lines_height;
 
 	Icon *editing_icon;
 
@@ -196,8 +224,28 @@ struct _MateIconListPrivate {
 	int sel_start_x;
 	int sel_start_y;
 
+	/* Range of icons in the rows of the last rubberband update */
+	int sel_first;
+	int sel_last;
+
+	/* Icons per row of the current layout */
 	int icons_per_row;
 
+	/* For virtual lists: the icons that have items, the items that are
+	 * not in use, the layout used to measure texts and the last pass of
+	 * gil_bind_visible() */
+	GPtrArray *bound_icons;
+	GSList *spare_images;
+	GSList *spare_texts;
+	PangoLayout *measure_layout;
+	guint bind_stamp;
+
+	/* For virtual lists: the icons holding an image loaded from their
+	 * file, most recently shown first, and the idle handler loading
+	 * the images of the icons in view */
+	GQueue pixbuf_cache;
+	guint load_idle_id;
+
 	/* Modifier state when the selection began */
 	guint sel_state;
 
@@ -210,6 +258,9 @@ struct _MateIconListPrivate {
 	/* Whether the icons need to be laid out */
 	guint dirty : 1;
 
+	/* Whether the icons only get canvas items while in view */
+	guint is_virtual : 1;
+
 	/* Whether the user is performing a rubberband selection */
 	guint selecting : 1;
 
@@ -237,10 +288,45 @@ icon_line_height (Gil *gil, IconLine *il)
 	return il->icon_height + il->text_height + priv->row_spacing + priv->text_spacing;
 }
 
+/* Height of a text as laid out by the icon text items */
+static int
+gil_measure_text (Gil *gil, const char *text)
+{
+	MateIconListPrivate *priv;
+	PangoRectangle bounds;
+
+	priv = gil->_priv;
+
+	if (priv->measure_layout == NULL) {
+		priv->measure_layout = gtk_widget_create_pango_layout (GTK_WIDGET (gil), NULL);
+		pango_layout_set_font_description (priv->measure_layout,
+						   GTK_WIDGET (gil)->style->font_desc);
+		pango_layout_set_alignment (priv->measure_layout, PANGO_ALIGN_CENTER);
+		pango_layout_set_wrap (priv->measure_layout, PANGO_WRAP_WORD_CHAR);
+	}
+
+	pango_layout_set_width (priv->measure_layout, priv->icon_width * PANGO_SCALE);
+	pango_layout_set_text (priv->measure_layout, text, -1);
+	pango_layout_get_pixel_extents (priv->measure_layout, NULL, &bounds);
+
+	return bounds.height + 2 * TEXT_MARGIN_Y;
+}
+
 static void
-icon_get_height (Icon *icon, int *icon_height, int *text_height)
+icon_get_height (Gil *gil, Icon *icon, int *icon_height, int *text_height)
 {
 	double d_icon_height, dy1, dy2;
+
+	if (gil->_priv->is_virtual) {
+		if (icon->text_height < 0)
+			icon->text_height = gil_measure_text (gil, icon->label);
+
+		*icon_height = icon->image_height >= 0 ? icon->image_height
+			: gil->_priv->icon_width;
+		*text_height = icon->text_height;
+		return;
+	}
+
 	if (icon->image != NULL)
 		g_object_get (G_OBJECT (icon->image), "height", &d_icon_height, NULL);
 	else
@@ -297,6 +383,10 @@ gil_place_icon (Gil *gil, Icon *icon, int x, int y, int icon_height)
 
 	priv = gil->_priv;
 
+	/* Icons of virtual lists get placed when they come into view */
+	if (icon->text == NULL)
+		return;
+
 	if (icon->image != NULL) {
 		g_object_get (G_OBJECT (icon->image), "height", &d_icon_image_height, NULL);
 		icon_image_height = d_icon_image_height;
@@ -329,14 +419,13 @@ static void
 gil_layout_line (Gil *gil, IconLine *il)
 {
 	MateIconListPrivate *priv;
-	GList *l;
-	int x;
+	int i, x;
 
 	priv = gil->_priv;
 
 	x = DEFAULT_COL_SPACING;
-	for (l = il->line_icons; l; l = l->next) {
-		Icon *icon = l->data;
+	for (i = il->first; i < il->first + il->n_icons; i++) {
+		Icon *icon = g_array_index (priv->icon_list, Icon *, i);
 
 		gil_place_icon (gil, icon, x, il->y, il->icon_height);
 		x += priv->icon_width + priv->col_spacing;
@@ -344,22 +433,24 @@ gil_layout_line (Gil *gil, IconLine *il)
 }
 
 static void
-gil_add_and_layout_line (Gil *gil, GList *line_icons, int y,
+gil_add_and_layout_line (Gil *gil, int first, int n_icons, int y,
 			 int icon_height, int text_height)
 {
 	MateIconListPrivate *priv;
-	IconLine *il;
+	IconLine il;
 
 	priv = gil->_priv;
 
-	il = g_new (IconLine, 1);
-	il->line_icons = line_icons;
-	il->y = y;
-	il->icon_height = icon_height;
-	il->text_height = text_height;
+	il.first = first;
+	il.n_icons = n_icons;
+	il.y = y;
+	il.icon_height = icon_height;
+	il.text_height = text_height;
 
-	gil_layout_line (gil, il);
-	priv->lines = g_list_append (priv->lines, il);
+	gil_layout_line (gil, &il);
+
+	g_array_append_val (priv->lines, il);
+	priv->lines_height += icon_line_height (gil, &il);
 }
 
 static void
@@ -367,24 +458,23 @@ gil_relayout_icons_at (Gil *gil, int pos, int y)
 {
 	MateIconListPrivate *priv;
 	int text_height, icon_height;
-	int items_per_line, n;
-	GList *line_icons;
+	int items_per_line, n, first;
 
 	priv = gil->_priv;
 	items_per_line = gil_get_items_per_line (gil);
 
 	text_height = icon_height = 0;
-	line_icons = NULL;
+	first = pos;
 
 	for (n = pos; n < priv->icon_list->len; n++) {
 		Icon *icon = g_array_index(priv->icon_list, Icon*, n);
 		int ih, th;
 
 		if (!(n % items_per_line)) {
-			if (line_icons) {
-				gil_add_and_layout_line (gil, line_icons, y,
+			if (n > first) {
+				gil_add_and_layout_line (gil, first, n - first, y,
 							 icon_height, text_height);
-				line_icons = NULL;
+				first = n;
 
 				y += (icon_height + text_height
 				      + priv->row_spacing + priv->text_spacing);
@@ -394,35 +484,26 @@ gil_relayout_icons_at (Gil *gil, int pos, int y)
 			text_height = 0;
 		}
 
-		icon_get_height (icon, &ih, &th);
+		icon_get_height (gil, icon, &ih, &th);
 
 		icon_height = MAX (ih, icon_height);
 		text_height = MAX (th, text_height);
-
-		line_icons = g_list_append (line_icons, icon);
 	}
 
-	if (line_icons)
-		gil_add_and_layout_line (gil, line_icons, y, icon_height, text_height);
+	if (n > first)
+		gil_add_and_layout_line (gil, first, n - first, y,
+					 icon_height, text_height);
 }
 
 static void
 gil_free_line_info (Gil *gil)
 {
 	MateIconListPrivate *priv;
-	GList *l;
 
 	priv = gil->_priv;
 
-	for (l = priv->lines; l; l = l->next) {
-		IconLine *il = l->data;
-
-		g_list_free (il->line_icons);
-		g_free (il);
-	}
-
-	g_list_free (priv->lines);
-	priv->lines = NULL;
+	g_array_set_size (priv->lines, 0);
+	priv->lines_height = 0;
 	priv->total_height = 0;
 }
 
@@ -430,47 +511,30 @@ static void
 gil_free_line_info_from (Gil *gil, int first_line)
 {
 	MateIconListPrivate *priv;
-	GList *l, *ll;
+	int i;
 
 	priv = gil->_priv;
-	ll = g_list_nth (priv->lines, first_line);
 
-	for (l = ll; l; l = l->next) {
-		IconLine *il = l->data;
+	for (i = first_line; i < priv->lines->len; i++)
+		priv->lines_height -= icon_line_height (gil, &g_array_index (priv->lines, IconLine, i));
 
-		g_list_free (il->line_icons);
-		g_free (il);
-	}
-
-	if (priv->lines) {
-		if (ll->prev)
-			ll->prev->next = NULL;
-		else
-			priv->lines = NULL;
-	}
-
-	g_list_free (ll);
+	if (first_line < priv->lines->len)
+		g_array_set_size (priv->lines, first_line);
 }
 
-static void G_GNUC_UNUSED
+/* Lays out the icons from the first one of @line on, keeping the lines
+ * above as they are */
+static void
 gil_layout_from_line (Gil *gil, int line)
 {
 	MateIconListPrivate *priv;
-	GList *l;
-	int height;
 
 	priv = gil->_priv;
 
 	gil_free_line_info_from (gil, line);
 
-	height = 0;
-	for (l = priv->lines; l; l = l->next) {
-		IconLine *il = l->data;
-
-		height += icon_line_height (gil, il);
-	}
-
-	gil_relayout_icons_at (gil, line * gil_get_items_per_line (gil), height);
+	gil_relayout_icons_at (gil, line * priv->icons_per_row,
+			       DEFAULT_ROW_SPACING + priv->lines_height);
 }
 
 static void
@@ -484,39 +548,119 @@ gil_layout_all_icons (Gil *gil)
 		return;
 
 	gil_free_line_info (gil);
+	priv->icons_per_row = gil_get_items_per_line (gil);
 	gil_relayout_icons_at (gil, 0, DEFAULT_ROW_SPACING);
 	priv->dirty = FALSE;
 }
 
+/* Whether the lines can be updated instead of laid out again */
+static gboolean
+gil_layout_is_current (Gil *gil)
+{
+	MateIconListPrivate *priv;
+
+	priv = gil->_priv;
+
+	return !priv->dirty && priv->icons_per_row == gil_get_items_per_line (gil);
+}
+
+/* Updates the layout after icons were inserted or removed at @pos */
+static void
+gil_layout_from_icon (Gil *gil, int pos)
+{
+	MateIconListPrivate *priv;
+
+	priv = gil->_priv;
+
+	if (!GTK_WIDGET_REALIZED (gil)) {
+		priv->dirty = TRUE;
+		return;
+	}
+
+	if (gil_layout_is_current (gil))
+		gil_layout_from_line (gil, pos / priv->icons_per_row);
+	else
+		gil_layout_all_icons (gil);
+}
+
+/* Updates the layout after an icon was appended: only the last line
+ * changes, or a new one starts */
+static void
+gil_layout_last_icon (Gil *gil)
+{
+	MateIconListPrivate *priv;
+	IconLine *il;
+	Icon *icon;
+	int pos, column, ih, th, old_height;
+
+	priv = gil->_priv;
+
+	if (!GTK_WIDGET_REALIZED (gil)) {
+		priv->dirty = TRUE;
+		return;
+	}
+
+	pos = priv->icons - 1;
+	if (!gil_layout_is_current (gil) ||
+	    (pos % priv->icons_per_row != 0 && priv->lines->len == 0)) {
+		gil_layout_all_icons (gil);
+		return;
+	}
+
+	column = pos % priv->icons_per_row;
+	if (column == 0) {
+		gil_relayout_icons_at (gil, pos, DEFAULT_ROW_SPACING + priv->lines_height);
+		return;
+	}
+
+	icon = g_array_index (priv->icon_list, Icon *, pos);
+	il = &g_array_index (priv->lines, IconLine, priv->lines->len - 1);
+	il->n_icons++;
+
+	icon_get_height (gil, icon, &ih, &th);
+
+	if (ih > il->icon_height || th > il->text_height) {
+		/* The line got taller; the other icons move down */
+		old_height = icon_line_height (gil, il);
+		il->icon_height = MAX (ih, il->icon_height);
+		il->text_height = MAX (th, il->text_height);
+		priv->lines_height += icon_line_height (gil, il) - old_height;
+		gil_layout_line (gil, il);
+	} else
+		gil_place_icon (gil, icon,
+				DEFAULT_COL_SPACING + column * (priv->icon_width + priv->col_spacing),
+				il->y, il->icon_height);
+}
+
 static void
 gil_scrollbar_adjust (Gil *gil)
 {
 	MateIconListPrivate *priv;
-	GList *l;
 	int height, step_increment;
-	double wx, wy;
+	double wx, wy, x1, y1, x2, y2;
 
 	priv = gil->_priv;
 
 	if (!GTK_WIDGET_REALIZED (gil))
 		return;
 
-	height = 0;
+	height = priv->lines_height;
 	step_increment = 0;
-	for (l = priv->lines; l; l = l->next) {
-		IconLine *il = l->data;
-
-		height += icon_line_height (gil, il);
-
-		if (l == priv->lines)
-			step_increment = height;
-	}
+	if (priv->lines->len > 0)
+		step_increment = icon_line_height (gil, &g_array_index (priv->lines, IconLine, 0));
 
 	if (!step_increment)
 		step_increment = 10;
 
 	priv->total_height = MAX (height, GTK_WIDGET (gil)->allocation.height);
 
+	/* The canvas doesn't scroll past its scroll region; grow it
+	 * with the icons, doubling it so that appending stays cheap */
+	mate_canvas_get_scroll_region (MATE_CANVAS (gil), &x1, &y1, &x2, &y2);
+	if (priv->total_height > y2)
+		mate_canvas_set_scroll_region (MATE_CANVAS (gil), x1, y1, x2,
+					       MAX (2 * y2, priv->total_height));
+
 	wx = wy = 0;
 	mate_canvas_window_to_world (MATE_CANVAS (gil), 0, 0, &wx, &wy);
 
@@ -898,7 +1042,8 @@ icon_event (MateCanvasItem *item, GdkEvent *event, gpointer data)
 		return FALSE;
 	}
 
-	if (priv->editing_icon && event->type == GDK_BUTTON_PRESS) {
+	if (priv->editing_icon && priv->editing_icon->text
+	    && event->type == GDK_BUTTON_PRESS) {
 		mate_icon_text_item_stop_editing (priv->editing_icon->text, FALSE);
 		priv->editing_icon = NULL;
 	}
@@ -1002,6 +1147,24 @@ icon_new_from_pixbuf (MateIconList *gil, GdkPixbuf *im,
 
 	icon->icon_filename = g_strdup (icon_filename);
 
+	if (priv->is_virtual) {
+		if (im != NULL) {
+			icon->pixbuf = g_object_ref (im);
+			icon->image_width = gdk_pixbuf_get_width (im);
+			icon->image_height = gdk_pixbuf_get_height (im);
+		}
+
+		if (priv->static_text)
+			icon->label = (char *) text;
+		else {
+			icon->label = g_strdup (text);
+			icon->label_allocated = TRUE;
+		}
+
+		icon->text_height = -1;
+		return icon;
+	}
+
 	if (im != NULL) {
 		icon->image = MATE_CANVAS_PIXBUF (mate_canvas_item_new (
 			MATE_CANVAS_GROUP (canvas->root),
@@ -1060,6 +1223,14 @@ icon_new (Gil *gil, const char *icon_filename, const char *text)
 	GdkPixbuf *im;
 	Icon *retval;
 
+	/* Virtual lists only load the image when the icon gets shown */
+	if (gil->_priv->is_virtual) {
+		retval = icon_new_from_pixbuf (gil, NULL, icon_filename, text);
+		if (icon_filename)
+			retval->image_width = retval->image_height = -1;
+		return retval;
+	}
+
 	if (icon_filename)
 		im = gdk_pixbuf_new_from_file (icon_filename, NULL);
 	else
@@ -1073,6 +1244,307 @@ icon_new (Gil *gil, const char *icon_filename, const char *text)
 	return retval;
 }
 
+/* Moves an icon to the front of the cache of loaded images, dropping
+ * the images that were not shown for the longest time.  Items keep
+ * their own reference, so this doesn't take images out of view. */
+static void
+gil_cache_pixbuf (Gil *gil, Icon *icon)
+{
+	MateIconListPrivate *priv;
+	Icon *old;
+
+	priv = gil->_priv;
+
+	if (icon->cache_link != NULL) {
+		g_queue_unlink (&priv->pixbuf_cache, icon->cache_link);
+		g_queue_push_head_link (&priv->pixbuf_cache, icon->cache_link);
+		return;
+	}
+
+	g_queue_push_head (&priv->pixbuf_cache, icon);
+	icon->cache_link = priv->pixbuf_cache.head;
+
+	while (priv->pixbuf_cache.length > PIXBUF_CACHE_SIZE) {
+		old = g_queue_pop_tail (&priv->pixbuf_cache);
+		old->cache_link = NULL;
+		g_object_unref (old->pixbuf);
+		old->pixbuf = NULL;
+	}
+}
+
+/* Whether a bound icon of a virtual list still waits for its image */
+static gboolean
+icon_needs_image (Icon *icon)
+{
+	return icon->text != NULL && icon->image == NULL
+		&& icon->icon_filename != NULL && icon->image_height != 0;
+}
+
+/* Gives a virtual list icon an image item showing @im */
+static void
+icon_bind_image (Gil *gil, Icon *icon, GdkPixbuf *im)
+{
+	MateIconListPrivate *priv;
+
+	priv = gil->_priv;
+
+	if (priv->spare_images != NULL) {
+		icon->image = priv->spare_images->data;
+		priv->spare_images = g_slist_delete_link (priv->spare_images,
+							  priv->spare_images);
+		mate_canvas_item_set (MATE_CANVAS_ITEM (icon->image),
+				       "width", (double) gdk_pixbuf_get_width (im),
+				       "height", (double) gdk_pixbuf_get_height (im),
+				       "pixbuf", im,
+				       NULL);
+		mate_canvas_item_show (MATE_CANVAS_ITEM (icon->image));
+	} else
+		icon->image = MATE_CANVAS_PIXBUF (mate_canvas_item_new (
+			MATE_CANVAS_GROUP (MATE_CANVAS (gil)->root),
+			MATE_TYPE_CANVAS_PIXBUF,
+			"x", 0.0,
+			"y", 0.0,
+			"width", (double) gdk_pixbuf_get_width (im),
+			"height", (double) gdk_pixbuf_get_height (im),
+			"pixbuf", im,
+			"anchor", GTK_ANCHOR_NW,
+			NULL));
+
+	icon->image_event_id = g_signal_connect (G_OBJECT (icon->image), "event",
+						 G_CALLBACK (icon_event),
+						 icon);
+}
+
+/* Gives a virtual list icon its canvas items, reusing spare ones.  An
+ * image that isn't loaded yet is left to gil_load_visible_image(). */
+static void
+icon_bind (Gil *gil, Icon *icon, int idx)
+{
+	MateIconListPrivate *priv;
+	MateCanvasGroup *root;
+	IconLine *il;
+	int column;
+
+	priv = gil->_priv;
+	root = MATE_CANVAS_GROUP (MATE_CANVAS (gil)->root);
+
+	if (icon->pixbuf != NULL) {
+		icon_bind_image (gil, icon, icon->pixbuf);
+		if (icon->cache_link != NULL)
+			gil_cache_pixbuf (gil, icon);
+	}
+
+	if (priv->spare_texts != NULL) {
+		icon->text = priv->spare_texts->data;
+		priv->spare_texts = g_slist_delete_link (priv->spare_texts,
+							 priv->spare_texts);
+		mate_canvas_item_show (MATE_CANVAS_ITEM (icon->text));
+	} else
+		icon->text = MATE_ICON_TEXT_ITEM (mate_canvas_item_new (
+			root,
+			MATE_TYPE_ICON_TEXT_ITEM,
+			NULL));
+
+	mate_icon_text_item_configure (icon->text,
+					0, 0, priv->icon_width, NULL,
+					icon->label, priv->is_editable, TRUE);
+	mate_icon_text_item_select (icon->text, icon->selected);
+	mate_icon_text_item_focus (icon->text, idx == priv->focus_icon);
+
+	icon->text_event_id = g_signal_connect (G_OBJECT (icon->text), "event",
+						G_CALLBACK (icon_event),
+						icon);
+
+	il = &g_array_index (priv->lines, IconLine, idx / priv->icons_per_row);
+	column = idx % priv->icons_per_row;
+	gil_place_icon (gil, icon,
+			DEFAULT_COL_SPACING + column * (priv->icon_width + priv->col_spacing),
+			il->y, il->icon_height);
+
+	g_ptr_array_add (priv->bound_icons, icon);
+}
+
+/* Takes the canvas items of a virtual list icon back for reuse.  The
+ * caller removes the icon from bound_icons. */
+static void
+icon_unbind (Gil *gil, Icon *icon)
+{
+	MateIconListPrivate *priv;
+
+	priv = gil->_priv;
+
+	if (priv->editing_icon == icon) {
+		mate_icon_text_item_stop_editing (icon->text, TRUE);
+		priv->editing_icon = NULL;
+	}
+
+	/* Keep the text if the user edited it */
+	if (strcmp (icon->text->text, icon->label) != 0) {
+		if (icon->label_allocated)
+			g_free (icon->label);
+		icon->label = g_strdup (icon->text->text);
+		icon->label_allocated = TRUE;
+		icon->text_height = -1;
+	}
+
+	if (icon->image != NULL) {
+		g_signal_handler_disconnect (icon->image, icon->image_event_id);
+		mate_canvas_item_set (MATE_CANVAS_ITEM (icon->image),
+				       "pixbuf", NULL,
+				       NULL);
+		mate_canvas_item_hide (MATE_CANVAS_ITEM (icon->image));
+		priv->spare_images = g_slist_prepend (priv->spare_images, icon->image);
+		icon->image = NULL;
+	}
+
+	g_signal_handler_disconnect (icon->text, icon->text_event_id);
+	mate_canvas_item_hide (MATE_CANVAS_ITEM (icon->text));
+	priv->spare_texts = g_slist_prepend (priv->spare_texts, icon->text);
+	icon->text = NULL;
+}
+
+/* Index of the first line that ends below @y, or the number of lines */
+static int
+gil_line_at_y (Gil *gil, int y)
+{
+	MateIconListPrivate *priv;
+	int low, high, mid;
+
+	priv = gil->_priv;
+
+	low = 0;
+	high = priv->lines->len;
+	while (low < high) {
+		IconLine *il;
+
+		mid = (low + high) / 2;
+		il = &g_array_index (priv->lines, IconLine, mid);
+
+		if (il->y + icon_line_height (gil, il) <= y)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Loads the image of one icon in view of a virtual list per call, so
+ * that scrolling never waits for image files */
+static gboolean
+gil_load_visible_image (gpointer data)
+{
+	Gil *gil;
+	MateIconListPrivate *priv;
+	IconLine *il;
+	Icon *icon;
+	GdkPixbuf *im;
+	int line, bottom, i;
+
+	GDK_THREADS_ENTER ();
+
+	gil = data;
+	priv = gil->_priv;
+
+	il = NULL;
+	icon = NULL;
+	i = 0;
+	if (!priv->frozen && !priv->dirty && gil->adj != NULL) {
+		bottom = gil->adj->value + GTK_WIDGET (gil)->allocation.height;
+		for (line = gil_line_at_y (gil, gil->adj->value);
+		     icon == NULL && line < priv->lines->len; line++) {
+			il = &g_array_index (priv->lines, IconLine, line);
+			if (il->y > bottom)
+				break;
+
+			for (i = il->first; i < il->first + il->n_icons; i++) {
+				icon = g_array_index (priv->icon_list, Icon *, i);
+				if (icon_needs_image (icon))
+					break;
+				icon = NULL;
+			}
+		}
+	}
+
+	if (icon == NULL) {
+		priv->load_idle_id = 0;
+		GDK_THREADS_LEAVE ();
+		return FALSE;
+	}
+
+	im = gdk_pixbuf_new_from_file (icon->icon_filename, NULL);
+	if (im == NULL) {
+		icon->image_width = icon->image_height = 0;
+		GDK_THREADS_LEAVE ();
+		return TRUE;
+	}
+
+	icon->pixbuf = im;
+	icon->image_width = gdk_pixbuf_get_width (im);
+	icon->image_height = gdk_pixbuf_get_height (im);
+	gil_cache_pixbuf (gil, icon);
+	icon_bind_image (gil, icon, im);
+
+	/* A taller image than the cell pushes the rows below down */
+	if (icon->image_height > il->icon_height) {
+		gil_layout_from_line (gil, il - &g_array_index (priv->lines, IconLine, 0));
+		gil_scrollbar_adjust (gil);
+	} else
+		gil_place_icon (gil, icon,
+				DEFAULT_COL_SPACING + (i % priv->icons_per_row)
+				* (priv->icon_width + priv->col_spacing),
+				il->y, il->icon_height);
+
+	GDK_THREADS_LEAVE ();
+
+	return TRUE;
+}
+
+/* Gives canvas items to the icons of a virtual list that are in view, and
+ * takes them from the others */
+static void
+gil_bind_visible (Gil *gil)
+{
+	MateIconListPrivate *priv;
+	int line, bottom, i;
+
+	priv = gil->_priv;
+
+	if (!priv->is_virtual || !GTK_WIDGET_REALIZED (gil) || priv->dirty
+	    || gil->adj == NULL)
+		return;
+
+	priv->bind_stamp++;
+
+	bottom = gil->adj->value + GTK_WIDGET (gil)->allocation.height;
+	for (line = gil_line_at_y (gil, gil->adj->value); line < priv->lines->len; line++) {
+		IconLine *il = &g_array_index (priv->lines, IconLine, line);
+
+		if (il->y > bottom)
+			break;
+
+		for (i = il->first; i < il->first + il->n_icons; i++) {
+			Icon *icon = g_array_index (priv->icon_list, Icon *, i);
+
+			icon->bind_stamp = priv->bind_stamp;
+			if (icon->text == NULL)
+				icon_bind (gil, icon, i);
+
+			if (priv->load_idle_id == 0 && icon_needs_image (icon))
+				priv->load_idle_id = g_idle_add (gil_load_visible_image, gil);
+		}
+	}
+
+	for (i = priv->bound_icons->len - 1; i >= 0; i--) {
+		Icon *icon = g_ptr_array_index (priv->bound_icons, i);
+
+		if (icon->bind_stamp != priv->bind_stamp) {
+			icon_unbind (gil, icon);
+			g_ptr_array_remove_index_fast (priv->bound_icons, i);
+		}
+	}
+}
+
 static int
 icon_list_append (Gil *gil, Icon *icon)
 {
@@ -1094,8 +1566,7 @@ icon_list_append (Gil *gil, Icon *icon)
 	}
 
 	if (!priv->frozen) {
-		/* FIXME: this should only layout the last line */
-		gil_layout_all_icons (gil);
+		gil_layout_last_icon (gil);
 		gil_scrollbar_adjust (gil);
 	} else
 		priv->dirty = TRUE;
@@ -1140,10 +1611,7 @@ icon_list_insert (Gil *gil, int pos, Icon *icon)
 	}
 
 	if (!priv->frozen) {
-		/* FIXME: this should only layout the lines from then one
-		 * containing the Icon to the end.
-		 */
-		gil_layout_all_icons (gil);
+		gil_layout_from_icon (gil, pos);
 		gil_scrollbar_adjust (gil);
 	} else
 		priv->dirty = TRUE;
@@ -1262,7 +1730,7 @@ mate_icon_list_append (MateIconList *gil, const char *icon_filename,
 }
 
 static void
-icon_destroy (Icon *icon)
+icon_destroy (Gil *gil, Icon *icon)
 {
 	if (icon->destroy)
 		(* icon->destroy) (icon->data);
@@ -1272,6 +1740,23 @@ icon_destroy (Icon *icon)
 	g_free (icon->icon_filename);
 	icon->icon_filename = NULL;
 
+	if (gil->_priv->is_virtual) {
+		if (icon->text != NULL) {
+			icon_unbind (gil, icon);
+			g_ptr_array_remove_fast (gil->_priv->bound_icons, icon);
+		}
+
+		if (icon->cache_link != NULL)
+			g_queue_delete_link (&gil->_priv->pixbuf_cache, icon->cache_link);
+		if (icon->pixbuf != NULL)
+			g_object_unref (icon->pixbuf);
+		if (icon->label_allocated)
+			g_free (icon->label);
+
+		g_free (icon);
+		return;
+	}
+
 	if (icon->image != NULL)
 		gtk_object_destroy (GTK_OBJECT (icon->image));
 	icon->image = NULL;
@@ -1352,11 +1837,10 @@ mate_icon_list_remove (MateIconList *gil, int pos)
 	if (priv->last_selected_icon == icon)
 		priv->last_selected_icon = NULL;
 
-	icon_destroy (icon);
+	icon_destroy (gil, icon);
 
 	if (!priv->frozen) {
-		/* FIXME: Optimize, only re-layout from pos to end */
-		gil_layout_all_icons (gil);
+		gil_layout_from_icon (gil, pos);
 		gil_scrollbar_adjust (gil);
 	} else
 		priv->dirty = TRUE;
@@ -1393,7 +1877,7 @@ mate_icon_list_clear (MateIconList *gil)
 	priv = gil->_priv;
 
 	for (i = 0; i < priv->icon_list->len; i++)
-		icon_destroy (g_array_index (priv->icon_list, Icon*, i));
+		icon_destroy (gil, g_array_index (priv->icon_list, Icon*, i));
 
 	gil_free_line_info (gil);
 
@@ -1441,6 +1925,11 @@ gil_destroy (GtkObject *object)
 		gil->_priv->timer_tag = 0;
 	}
 
+	if (gil->_priv->load_idle_id != 0) {
+		g_source_remove (gil->_priv->load_idle_id);
+		gil->_priv->load_idle_id = 0;
+	}
+
 	if (gil->adj) {
 		g_object_unref (G_OBJECT (gil->adj));
 		gil->adj = NULL;
@@ -1464,6 +1953,13 @@ gil_finalize (GObject *object)
 	g_free (gil->_priv->separators);
 	gil->_priv->separators = NULL;
 
+	g_array_free (gil->_priv->lines, TRUE);
+	g_ptr_array_free (gil->_priv->bound_icons, TRUE);
+	g_slist_free (gil->_priv->spare_images);
+	g_slist_free (gil->_priv->spare_texts);
+	if (gil->_priv->measure_layout != NULL)
+		g_object_unref (gil->_priv->measure_layout);
+
 	g_free (gil->_priv);
 	gil->_priv = NULL;
 
@@ -1747,7 +2243,8 @@ real_select_icon (Gil *gil, gint num, GdkEvent *event)
 		return;
 
 	icon->selected = TRUE;
-	mate_icon_text_item_select (icon->text, TRUE);
+	if (icon->text != NULL)
+		mate_icon_text_item_select (icon->text, TRUE);
 	if (g_list_find(priv->selection, GINT_TO_POINTER(num)) == NULL)
 		priv->selection = g_list_insert_sorted (priv->selection, GINT_TO_POINTER (num),
 							selection_list_compare_cb);
@@ -1771,7 +2268,8 @@ real_unselect_icon (Gil *gil, gint num, GdkEvent *event)
 		return;
 
 	icon->selected = FALSE;
-	mate_icon_text_item_select (icon->text, FALSE);
+	if (icon->text != NULL)
+		mate_icon_text_item_select (icon->text, FALSE);
 	priv->selection = g_list_remove (priv->selection, GINT_TO_POINTER (num));
 }
 
@@ -1788,11 +2286,13 @@ real_focus_icon (Gil *gil, gint num)
 
 	if (priv->focus_icon >= 0) {
 		icon = g_array_index (priv->icon_list, Icon*, priv->focus_icon);
-		mate_icon_text_item_focus (icon->text, FALSE);
+		if (icon->text != NULL)
+			mate_icon_text_item_focus (icon->text, FALSE);
 	}
 
 	icon = g_array_index (priv->icon_list, Icon*, num);
-	mate_icon_text_item_focus (icon->text, TRUE);
+	if (icon->text != NULL)
+		mate_icon_text_item_focus (icon->text, TRUE);
 
 	priv->focus_icon = num;
 }
@@ -1862,6 +2362,8 @@ gil_button_press (GtkWidget *widget, GdkEventButton *event)
 	priv->sel_start_y = ty;
 	priv->sel_state = event->state;
 	priv->selecting = TRUE;
+	priv->sel_first = 0;
+	priv->sel_last = -1;
 
 	store_temp_selection (gil);
 
@@ -1888,13 +2390,34 @@ gil_button_press (GtkWidget *widget, GdkEventButton *event)
  * rectangle.
  */
 static int
-icon_is_in_area (Icon *icon, int x1, int y1, int x2, int y2)
+icon_is_in_area (Gil *gil, Icon *icon, int idx, int x1, int y1, int x2, int y2)
 {
+	MateIconListPrivate *priv;
 	double ix1, iy1, ix2, iy2;
 
 	if (x1 == x2 && y1 == y2)
 		return FALSE;
 
+	priv = gil->_priv;
+
+	/* Icons of virtual lists that are out of view have no items; use
+	 * their cell */
+	if (icon->text == NULL) {
+		IconLine *il;
+
+		if (priv->dirty || idx / priv->icons_per_row >= priv->lines->len)
+			return FALSE;
+
+		il = &g_array_index (priv->lines, IconLine, idx / priv->icons_per_row);
+		ix1 = DEFAULT_COL_SPACING
+			+ (idx % priv->icons_per_row) * (priv->icon_width + priv->col_spacing);
+		iy1 = il->y;
+		ix2 = ix1 + priv->icon_width;
+		iy2 = iy1 + il->icon_height + priv->text_spacing + il->text_height;
+
+		return ix1 <= x2 && iy1 <= y2 && ix2 >= x1 && iy2 >= y1;
+	}
+
 	if (icon->image != NULL) {
 		mate_canvas_item_get_bounds (MATE_CANVAS_ITEM (icon->image),
 					      &ix1, &iy1, &ix2, &iy2);
@@ -1911,13 +2434,43 @@ icon_is_in_area (Icon *icon, int x1, int y1, int x2, int y2)
 	return FALSE;
 }
 
+/* Gets the range of icons in the rows between @y1 and @y2 */
+static void
+gil_icons_in_rows (Gil *gil, int y1, int y2, int *first, int *last)
+{
+	MateIconListPrivate *priv;
+	IconLine *il;
+	int line1, line2;
+
+	priv = gil->_priv;
+
+	if (priv->dirty) {
+		*first = 0;
+		*last = priv->icons - 1;
+		return;
+	}
+
+	line1 = gil_line_at_y (gil, y1);
+	line2 = MIN (gil_line_at_y (gil, y2), (int) priv->lines->len - 1);
+
+	if (line1 > line2) {
+		*first = 0;
+		*last = -1;
+		return;
+	}
+
+	il = &g_array_index (priv->lines, IconLine, line2);
+	*first = g_array_index (priv->lines, IconLine, line1).first;
+	*last = il->first + il->n_icons - 1;
+}
+
 /* Updates the rubberband selection to the specified point */
 static void
 update_drag_selection (Gil *gil, int x, int y)
 {
 	MateIconListPrivate *priv;
 	int x1, x2, y1, y2;
-	int i;
+	int i, first, last;
 	Icon *icon;
 	int additive, invert;
 
@@ -1965,10 +2518,31 @@ update_drag_selection (Gil *gil, int x, int y)
 	additive = priv->sel_state & GDK_SHIFT_MASK;
 	invert = priv->sel_state & GDK_CONTROL_MASK;
 
-	for (i = 0; i < priv->icon_list->len; i++) {
+	/* Only the icons in the rows of the rubberband, or in those of its
+	 * last update, can change */
+	gil_icons_in_rows (gil, y1, y2, &first, &last);
+	if (priv->sel_first <= priv->sel_last && first <= last) {
+		int tmp_first = first, tmp_last = last;
+
+		first = MIN (first, priv->sel_first);
+		last = MAX (last, priv->sel_last);
+		priv->sel_first = tmp_first;
+		priv->sel_last = tmp_last;
+	} else if (first <= last) {
+		priv->sel_first = first;
+		priv->sel_last = last;
+	} else {
+		first = priv->sel_first;
+		last = priv->sel_last;
+		priv->sel_first = 0;
+		priv->sel_last = -1;
+	}
+	last = MIN (last, (int) priv->icon_list->len - 1);
+
+	for (i = first; i <= last; i++) {
 		icon = g_array_index(priv->icon_list, Icon*, i);
 
-		if (icon_is_in_area (icon, x1, y1, x2, y2)) {
+		if (icon_is_in_area (gil, icon, i, x1, y1, x2, y2)) {
 			if (invert) {
 				if (icon->selected == icon->tmp_selected)
 					emit_select (gil, !icon->selected, i, NULL);
@@ -2234,11 +2808,23 @@ gil_style_set (GtkWidget *widget, GtkStyle *prev_style)
 	gil = GIL (widget);
 	priv = gil->_priv;
 
+	if (priv->is_virtual && prev_style != NULL && priv->measure_layout != NULL
+	    && !pango_font_description_equal (prev_style->font_desc, widget->style->font_desc)) {
+		g_object_unref (priv->measure_layout);
+		priv->measure_layout = NULL;
+
+		for (item_count = 0; item_count < priv->icons; item_count++)
+			g_array_index (priv->icon_list, Icon *, item_count)->text_height = -1;
+		priv->dirty = TRUE;
+	}
+
 	if (priv->icons) {
 		char *file_name;
 
 		for (item_count=0; item_count < priv->icons; item_count++) {
 			item = mate_icon_list_get_icon_text_item (gil, item_count);
+			if (item == NULL)
+				continue;
 			file_name = g_strdup (item->text);
 			mate_icon_text_item_configure (item, 0, 0,
 											priv->icon_width, NULL,
@@ -2387,6 +2973,8 @@ mate_icon_list_instance_init (Gil *gil)
 	gil->_priv = g_new0 (MateIconListPrivate, 1);
 
 	gil->_priv->icon_list = g_array_new(FALSE, FALSE, sizeof(gpointer));
+	gil->_priv->lines = g_array_new (FALSE, FALSE, sizeof (IconLine));
+	gil->_priv->bound_icons = g_ptr_array_new ();
 	gil->_priv->row_spacing = DEFAULT_ROW_SPACING;
 	gil->_priv->col_spacing = DEFAULT_COL_SPACING;
 	gil->_priv->text_spacing = DEFAULT_TEXT_SPACING;
@@ -2421,6 +3009,15 @@ mate_icon_list_set_icon_width (MateIconList *gil, int w)
 
 	priv->icon_width  = w;
 
+	/* The texts of virtual lists get measured again */
+	if (priv->is_virtual) {
+		int i;
+
+		for (i = 0; i < priv->icons; i++)
+			g_array_index (priv->icon_list, Icon *, i)->text_height = -1;
+		priv->dirty = TRUE;
+	}
+
 	if (priv->frozen) {
 		priv->dirty = TRUE;
 		return;
@@ -2434,6 +3031,7 @@ static void
 gil_adj_value_changed (GtkAdjustment *adj, Gil *gil)
 {
 	mate_canvas_scroll_to (MATE_CANVAS (gil), 0, adj->value);
+	gil_bind_visible (gil);
 }
 
 /**
@@ -2536,7 +3134,8 @@ mate_icon_list_set_vadjustment (MateIconList *gil, GtkAdjustment *vadj)
  * @gil: An icon list.
  * @icon_width: Width for the icon columns.
  * @adj:
- * @flags: A combination of %MATE_ICON_LIST_IS_EDITABLE and %MATE_ICON_LIST_STATIC_TEXT.
+ * @flags: A combination of %MATE_ICON_LIST_IS_EDITABLE, %MATE_ICON_LIST_STATIC_TEXT
+ * and %MATE_ICON_LIST_VIRTUAL.
  *
  * Constructor for the icon list, to be used by derived classes.
  **/
@@ -2554,6 +3153,10 @@ mate_icon_list_construct (MateIconList *gil, guint icon_width, GtkAdjustment *ad
 	priv->is_editable = (flags & MATE_ICON_LIST_IS_EDITABLE) != 0;
 	priv->static_text = (flags & MATE_ICON_LIST_STATIC_TEXT) != 0;
 
+	/* Icons added before keep their items */
+	if (priv->icons == 0)
+		priv->is_virtual = (flags & MATE_ICON_LIST_VIRTUAL) != 0;
+
 	if (!adj)
 		adj = GTK_ADJUSTMENT (gtk_adjustment_new (0, 0, 1, 0.1, 0.1, 0.1));
 
@@ -2565,8 +3168,8 @@ mate_icon_list_construct (MateIconList *gil, guint icon_width, GtkAdjustment *ad
  * mate_icon_list_new: [constructor]
  * @icon_width: Width for the icon columns.
  * @adj:
- * @flags: A combination of %MATE_ICON_LIST_IS_EDITABLE and
- * %MATE_ICON_LIST_STATIC_TEXT.
+ * @flags: A combination of %MATE_ICON_LIST_IS_EDITABLE,
+ * %MATE_ICON_LIST_STATIC_TEXT and %MATE_ICON_LIST_VIRTUAL.
  *
  * Creates a new icon list widget.  The icon columns are allocated a width of
  * @icon_width pixels.  Icon captions will be word-wrapped to this width as
@@ -2582,6 +3185,14 @@ mate_icon_list_construct (MateIconList *gil, guint icon_width, GtkAdjustment *ad
  * This is intended to save memory.  If this flag is not set, then the text
  * strings will be copied and managed internally.
  *
+ * If @flags has the %MATE_ICON_LIST_VIRTUAL flag set, then only the icons
+ * in view have canvas items, which are reused as the list scrolls, and
+ * images given by filename are loaded when idle once they come into view,
+ * keeping the most recently shown ones.  Until then their icons get a
+ * square cell.  Use this for lists of many thousands of icons.
+ * mate_icon_list_get_icon_text_item() and
+ * mate_icon_list_get_icon_pixbuf_item() return %NULL for the other icons.
+ *
  * Returns: a newly-created icon list widget
  */
 GtkWidget *
@@ -2919,8 +3530,7 @@ mate_icon_list_moveto (MateIconList *gil, int pos, double yalign)
 {
 	MateIconListPrivate *priv;
 	IconLine *il;
-	GList *l;
-	int i, y, uh, line;
+	int y, uh, line;
 
 	g_return_if_fail (gil != NULL);
 	g_return_if_fail (IS_GIL (gil));
@@ -2929,17 +3539,13 @@ mate_icon_list_moveto (MateIconList *gil, int pos, double yalign)
 
 	priv = gil->_priv;
 
-	g_return_if_fail (priv->lines != NULL);
+	g_return_if_fail (priv->lines->len > 0);
 
-	line = pos / gil_get_items_per_line (gil);
+	line = pos / priv->icons_per_row;
+	g_return_if_fail (line < priv->lines->len);
 
-	y = 0;
-	for (i = 0, l = priv->lines; l && i < line; l = l->next, i++) {
-		il = l->data;
-		y += icon_line_height (gil, il);
-	}
-
-	il = l->data;
+	il = &g_array_index (priv->lines, IconLine, line);
+	y = il->y - DEFAULT_ROW_SPACING;
 
 	uh = GTK_WIDGET (gil)->allocation.height - icon_line_height (gil,il);
 	gtk_adjustment_set_value (gil->adj, y - uh * yalign);
@@ -2960,8 +3566,7 @@ mate_icon_list_icon_is_visible (MateIconList *gil, int pos)
 {
 	MateIconListPrivate *priv;
 	IconLine *il;
-	GList *l;
-	int line, y1, y2, i;
+	int line, y1, y2;
 
 	g_return_val_if_fail (gil != NULL, GTK_VISIBILITY_NONE);
 	g_return_val_if_fail (IS_GIL (gil), GTK_VISIBILITY_NONE);
@@ -2970,16 +3575,16 @@ mate_icon_list_icon_is_visible (MateIconList *gil, int pos)
 
 	priv = gil->_priv;
 
-	if (priv->lines == NULL)
+	if (priv->lines->len == 0)
 		return GTK_VISIBILITY_NONE;
 
-	line = pos / gil_get_items_per_line (gil);
-	y1 = 0;
-	for (i = 0, l = priv->lines; l && i < line; l = l->next, i++) {
-		il = l->data;
-		y1 += icon_line_height (gil, il);
-	}
-	y2 = y1 + icon_line_height (gil, (IconLine *) l->data);
+	line = pos / priv->icons_per_row;
+	if (line >= priv->lines->len)
+		return GTK_VISIBILITY_NONE;
+
+	il = &g_array_index (priv->lines, IconLine, line);
+	y1 = il->y - DEFAULT_ROW_SPACING;
+	y2 = y1 + icon_line_height (gil, il);
 
 	if (y2 < gil->adj->value)
 		return GTK_VISIBILITY_NONE;
@@ -2994,6 +3599,48 @@ mate_icon_list_icon_is_visible (MateIconList *gil, int pos)
 	return GTK_VISIBILITY_PARTIAL;
 }
 
+/* Whether the point at world coordinates @wx, @wy, canvas pixel
+ * @cx, @cy is on the image or text of @icon */
+static gboolean
+icon_is_at (MateIconList *gil, Icon *icon, double wx, double wy, int cx, int cy)
+{
+	/* Note: these aren't the checking casts, because icon->image
+	 * could be NULL, and so could icon->text in virtual lists */
+	MateCanvasItem *image = (MateCanvasItem *) (icon->image);
+	MateCanvasItem *text = (MateCanvasItem *) (icon->text);
+	MateCanvasItem *item;
+	double dist;
+
+	if (text == NULL)
+		return FALSE;
+
+	if (image != NULL && wx >= image->x1 && wx <= image->x2 && wy >= image->y1 && wy <= image->y2) {
+		dist = (* MATE_CANVAS_ITEM_GET_CLASS (image)->point) (
+			image,
+			wx, wy,
+			cx, cy,
+			&item);
+
+		if ((int) (dist * MATE_CANVAS (gil)->pixels_per_unit + 0.5)
+		    <= MATE_CANVAS (gil)->close_enough)
+			return TRUE;
+	}
+
+	if (wx >= text->x1 && wx <= text->x2 && wy >= text->y1 && wy <= text->y2) {
+		dist = (* MATE_CANVAS_ITEM_GET_CLASS (text)->point) (
+			text,
+			wx, wy,
+			cx, cy,
+			&item);
+
+		if ((int) (dist * MATE_CANVAS (gil)->pixels_per_unit + 0.5)
+		    <= MATE_CANVAS (gil)->close_enough)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 /**
  * mate_icon_list_get_icon_at:
  * @gil: An icon list.
@@ -3008,12 +3655,11 @@ int
 mate_icon_list_get_icon_at (MateIconList *gil, int x, int y)
 {
 	MateIconListPrivate *priv;
+	IconLine *il;
 	double wx, wy;
 	double dx, dy;
 	int cx, cy;
-	int n;
-	MateCanvasItem *item;
-	double dist;
+	int n, line, column;
 
 	g_return_val_if_fail (gil != NULL, -1);
 	g_return_val_if_fail (IS_GIL (gil), -1);
@@ -3026,36 +3672,34 @@ mate_icon_list_get_icon_at (MateIconList *gil, int x, int y)
 	mate_canvas_window_to_world (MATE_CANVAS (gil), dx, dy, &wx, &wy);
 	mate_canvas_w2c (MATE_CANVAS (gil), wx, wy, &cx, &cy);
 
-	for (n = 0; n < priv->icon_list->len; n++) {
-		Icon *icon = g_array_index(priv->icon_list, Icon*, n);
-		/* Note: this isn't the checking cast, because icon->image
-		 * could be NULL */
-		MateCanvasItem *image = (MateCanvasItem *) (icon->image);
-		MateCanvasItem *text = MATE_CANVAS_ITEM (icon->text);
-
-		if (image != NULL && wx >= image->x1 && wx <= image->x2 && wy >= image->y1 && wy <= image->y2) {
-			dist = (* MATE_CANVAS_ITEM_GET_CLASS (image)->point) (
-				image,
-				wx, wy,
-				cx, cy,
-				&item);
-
-			if ((int) (dist * MATE_CANVAS (gil)->pixels_per_unit + 0.5)
-			    <= MATE_CANVAS (gil)->close_enough)
+	/* The rows of a frozen list don't match its icons yet; the
+	 * items are wherever they were put, so look at all of them */
+	if (priv->dirty) {
+		for (n = 0; n < priv->icon_list->len; n++) {
+			if (icon_is_at (gil, g_array_index (priv->icon_list, Icon*, n),
+					wx, wy, cx, cy))
 				return n;
 		}
 
-		if (wx >= text->x1 && wx <= text->x2 && wy >= text->y1 && wy <= text->y2) {
-			dist = (* MATE_CANVAS_ITEM_GET_CLASS (text)->point) (
-				text,
-				wx, wy,
-				cx, cy,
-				&item);
+		return -1;
+	}
 
-			if ((int) (dist * MATE_CANVAS (gil)->pixels_per_unit + 0.5)
-			    <= MATE_CANVAS (gil)->close_enough)
-				return n;
-		}
+	if (wy < 0 || wx < 0)
+		return -1;
+
+	/* Find the cell under the point in the grid; images wider than
+	 * the columns may reach into the next cells */
+	line = gil_line_at_y (gil, wy);
+	if (line >= priv->lines->len)
+		return -1;
+
+	il = &g_array_index (priv->lines, IconLine, line);
+	column = (wx - DEFAULT_COL_SPACING) / (priv->icon_width + priv->col_spacing);
+
+	for (n = MAX (column - 1, 0); n <= column + 1 && n < il->n_icons; n++) {
+		if (icon_is_at (gil, g_array_index (priv->icon_list, Icon*, il->first + n),
+				wx, wy, cx, cy))
+			return il->first + n;
 	}
 
 	return -1;
@@ -100,7 +100,8 @@ struct _MateIconListClass {
 
 enum {
 	MATE_ICON_LIST_IS_EDITABLE	= 1 << 0,
-	MATE_ICON_LIST_STATIC_TEXT	= 1 << 1
+	MATE_ICON_LIST_STATIC_TEXT	= 1 << 1,
+	MATE_ICON_LIST_VIRTUAL		= 1 << 2
 };
 
 GType          mate_icon_list_get_type            (void) G_GNUC_CONST;
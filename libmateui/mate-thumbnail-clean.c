@@ -0,0 +1,511 @@
+/*
+ * mate-thumbnail-clean.c: Removal of unneeded thumbnails
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* The directories are listed first, which is cheap, and the files are
+ * then checked by several threads since that means reading the header
+ * of every thumbnail and looking at its original file. Thumbnails are
+ * opened without updating their access time where the platform allows
+ * it, so that scanning the cache doesn't make everything look used. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_NOATIME */
+#endif
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
+
+#define CLEAN_BAND_SIZE 256
+#define MAX_CLEAN_THREADS 8
+
+/* Temporary files younger than this may still be written to */
+#define TEMP_FILE_AGE (60 * 60)
+
+/* "<32 hex digits>.png" */
+#define THUMBNAIL_NAME_LENGTH 36
+
+typedef enum {
+  CLEAN_KEEP,
+  CLEAN_GONE,        /* removed by someone else meanwhile */
+  CLEAN_ORPHANED,
+  CLEAN_STALE,
+  CLEAN_INVALID
+} CleanAction;
+
+typedef struct {
+  char *path;
+  MateThumbnailIndex *index;  /* of the directory, if there is one */
+  gboolean temporary;
+  CleanAction action;
+  time_t last_used;
+  goffset size;
+} CleanEntry;
+
+typedef struct {
+  GMutex *lock;
+  GCond *cond;
+  int pending;
+} CleanJob;
+
+typedef struct {
+  CleanJob *job;
+  CleanEntry *entries;
+  int start;
+  int end;
+  time_t now;
+} CleanBand;
+
+/* Matches what save_thumbnail_for_size() passes to g_mkstemp() */
+static gboolean
+is_temporary_name (const char *name)
+{
+  char thumbnail_name[THUMBNAIL_NAME_LENGTH + 1];
+  guint8 digest[16];
+
+  if (strlen (name) != THUMBNAIL_NAME_LENGTH + 7 ||
+      name[THUMBNAIL_NAME_LENGTH] != '.')
+    return FALSE;
+
+  memcpy (thumbnail_name, name, THUMBNAIL_NAME_LENGTH);
+  thumbnail_name[THUMBNAIL_NAME_LENGTH] = 0;
+
+  return _mate_thumbnail_parse_filename (thumbnail_name, digest);
+}
+
+/* Removed thumbnails must also go from the index of their directory,
+ * or it would keep returning them; only existing indexes are used */
+static MateThumbnailIndex *
+open_index (GPtrArray  *indexes,
+	    const char *base_dir,
+	    const char *dir,
+	    const char *name)
+{
+  MateThumbnailIndex *index;
+  char *path;
+
+  path = g_build_filename (base_dir, name, NULL);
+
+  index = NULL;
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    index = _mate_thumbnail_index_new (dir, path);
+  if (index != NULL)
+    g_ptr_array_add (indexes, index);
+
+  g_free (path);
+
+  return index;
+}
+
+static void
+list_dir (GArray             *entries,
+	  const char         *dir,
+	  MateThumbnailIndex *index)
+{
+  CleanEntry entry;
+  GDir *gdir;
+  const char *name;
+  guint8 digest[16];
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (gdir == NULL)
+    return;
+
+  memset (&entry, 0, sizeof (entry));
+  entry.index = index;
+  while ((name = g_dir_read_name (gdir)) != NULL)
+    {
+      if (_mate_thumbnail_parse_filename (name, digest))
+	entry.temporary = FALSE;
+      else if (is_temporary_name (name))
+	entry.temporary = TRUE;
+      else
+	continue;
+
+      entry.path = g_build_filename (dir, name, NULL);
+      g_array_append_val (entries, entry);
+    }
+
+  g_dir_close (gdir);
+}
+
+static FILE *
+open_noatime (const char  *path,
+	      struct stat *st)
+{
+  FILE *f;
+  int fd;
+
+#ifdef O_NOATIME
+  fd = open (path, O_RDONLY | O_NOATIME);
+  /* Only allowed for files we own */
+  if (fd == -1 && errno == EPERM)
+#endif
+    fd = open (path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat (fd, st) != 0 || (f = fdopen (fd, "rb")) == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  return f;
+}
+
+/* A file whose directory is missing too may be on a disk or share that
+ * isn't mounted right now; its thumbnail is left to the age and size
+ * limits rather than taken as orphaned */
+static gboolean
+source_dir_exists (const char *filename)
+{
+  struct stat st;
+  char *dirname;
+  gboolean res;
+
+  dirname = g_path_get_dirname (filename);
+  res = g_stat (dirname, &st) == 0 && S_ISDIR (st.st_mode);
+  g_free (dirname);
+
+  return res;
+}
+
+static void
+check_entry (CleanEntry *entry,
+	     time_t      now)
+{
+  static const char * const keys[] = { "Thumb::URI", "Thumb::MTime", NULL };
+  char *values[2], *filename;
+  struct stat st, source_st;
+  gboolean valid;
+  FILE *f;
+
+  entry->action = CLEAN_KEEP;
+
+  if (entry->temporary)
+    {
+      entry->action = CLEAN_GONE;
+      if (g_lstat (entry->path, &st) == 0 && S_ISREG (st.st_mode) &&
+	  now - st.st_mtime > TEMP_FILE_AGE)
+	{
+	  entry->action = CLEAN_INVALID;
+	  entry->size = st.st_size;
+	}
+      return;
+    }
+
+  f = open_noatime (entry->path, &st);
+  if (f == NULL)
+    {
+      entry->action = CLEAN_GONE;
+      return;
+    }
+
+  entry->size = st.st_size;
+  /* Where atime isn't updated, a thumbnail is at least as recent as
+   * the last time it was written */
+  entry->last_used = MAX (st.st_atime, st.st_mtime);
+
+  valid = S_ISREG (st.st_mode) &&
+    _mate_thumbnail_png_read_text_from_file (f, keys, values);
+  fclose (f);
+
+  if (!valid)
+    {
+      entry->action = CLEAN_INVALID;
+      return;
+    }
+
+  if (values[0] == NULL || values[1] == NULL)
+    entry->action = CLEAN_INVALID;
+  else
+    {
+      /* Only local files can be checked cheaply */
+      filename = g_filename_from_uri (values[0], NULL, NULL);
+      if (filename != NULL)
+	{
+	  if (g_stat (filename, &source_st) != 0)
+	    {
+	      if (errno == ENOENT && source_dir_exists (filename))
+		entry->action = CLEAN_ORPHANED;
+	    }
+	  else if (source_st.st_mtime != atol (values[1]))
+	    entry->action = CLEAN_STALE;
+	  g_free (filename);
+	}
+    }
+
+  g_free (values[0]);
+  g_free (values[1]);
+}
+
+static void
+clean_band_run (CleanBand *band)
+{
+  int i;
+
+  for (i = band->start; i < band->end; i++)
+    check_entry (&band->entries[i], band->now);
+}
+
+static void
+clean_band_thread_func (gpointer data,
+			gpointer user_data)
+{
+  CleanBand *band = data;
+  CleanJob *job = band->job;
+
+  clean_band_run (band);
+
+  g_mutex_lock (job->lock);
+  job->pending--;
+  if (job->pending == 0)
+    g_cond_signal (job->cond);
+  g_mutex_unlock (job->lock);
+}
+
+static void
+check_entries (CleanEntry *entries,
+	       int         n_entries,
+	       time_t      now)
+{
+  GThreadPool *pool;
+  CleanBand *bands;
+  CleanJob job;
+  int i, n_bands;
+
+  /* The threads mostly wait for the disk, so use more than there
+   * are processors */
+  n_bands = 1;
+  if (g_thread_supported ())
+    n_bands = CLAMP (n_entries / CLEAN_BAND_SIZE, 1,
+		     MIN (MAX_CLEAN_THREADS, 2 * _mate_thumbnail_get_n_processors ()));
+
+  bands = g_new (CleanBand, n_bands);
+  for (i = 0; i < n_bands; i++)
+    {
+      bands[i].job = &job;
+      bands[i].entries = entries;
+      bands[i].start = (gint64) n_entries * i / n_bands;
+      bands[i].end = (gint64) n_entries * (i + 1) / n_bands;
+      bands[i].now = now;
+    }
+
+  job.pending = n_bands - 1;
+  pool = NULL;
+  if (n_bands > 1)
+    {
+      job.lock = g_mutex_new ();
+      job.cond = g_cond_new ();
+
+      pool = g_thread_pool_new (clean_band_thread_func, NULL,
+				n_bands - 1, FALSE, NULL);
+      for (i = 1; i < n_bands; i++)
+	g_thread_pool_push (pool, &bands[i], NULL);
+    }
+
+  clean_band_run (&bands[0]);
+
+  if (n_bands > 1)
+    {
+      g_mutex_lock (job.lock);
+      while (job.pending > 0)
+	g_cond_wait (job.cond, job.lock);
+      g_mutex_unlock (job.lock);
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+      g_mutex_free (job.lock);
+      g_cond_free (job.cond);
+    }
+
+  g_free (bands);
+}
+
+static int
+compare_last_used (gconstpointer a,
+		   gconstpointer b)
+{
+  const CleanEntry *entry_a = *(CleanEntry * const *) a;
+  const CleanEntry *entry_b = *(CleanEntry * const *) b;
+
+  if (entry_a->last_used != entry_b->last_used)
+    return entry_a->last_used < entry_b->last_used ? -1 : 1;
+  /* Large files first among equals, fewer files need to go */
+  if (entry_a->size != entry_b->size)
+    return entry_a->size > entry_b->size ? -1 : 1;
+  return 0;
+}
+
+static void
+remove_entry (CleanEntry               *entry,
+	      gboolean                  dry_run,
+	      guint64                  *counter,
+	      MateThumbnailCleanResult *result)
+{
+  char *name;
+  guint8 digest[16];
+
+  if (!dry_run && g_unlink (entry->path) != 0 && errno != ENOENT)
+    return;
+
+  if (!dry_run && !entry->temporary && entry->index != NULL)
+    {
+      name = g_path_get_basename (entry->path);
+      if (_mate_thumbnail_parse_filename (name, digest))
+	_mate_thumbnail_index_remove (entry->index, digest);
+      g_free (name);
+    }
+
+  (*counter)++;
+  result->bytes_removed += entry->size;
+}
+
+void
+_mate_thumbnail_clean_cache (const char               *base_dir,
+			     guint64                   max_bytes,
+			     time_t                    max_age,
+			     gboolean                  dry_run,
+			     MateThumbnailCleanResult *result)
+{
+  GArray *entries;
+  GPtrArray *kept, *indexes;
+  CleanEntry *entry;
+  GDir *gdir;
+  const char *name;
+  char *dir, *index_name;
+  guint64 kept_bytes;
+  time_t now;
+  guint i;
+
+  memset (result, 0, sizeof (MateThumbnailCleanResult));
+
+  entries = g_array_new (FALSE, FALSE, sizeof (CleanEntry));
+  indexes = g_ptr_array_new ();
+
+  dir = g_build_filename (base_dir, "normal", NULL);
+  list_dir (entries, dir, open_index (indexes, base_dir, dir, "mate-index-normal"));
+  g_free (dir);
+
+  dir = g_build_filename (base_dir, "large", NULL);
+  list_dir (entries, dir, open_index (indexes, base_dir, dir, "mate-index-large"));
+  g_free (dir);
+
+  /* One directory per application */
+  dir = g_build_filename (base_dir, "fail", NULL);
+  gdir = g_dir_open (dir, 0, NULL);
+  if (gdir != NULL)
+    {
+      while ((name = g_dir_read_name (gdir)) != NULL)
+	{
+	  char *app_dir;
+
+	  app_dir = g_build_filename (dir, name, NULL);
+	  if (g_file_test (app_dir, G_FILE_TEST_IS_DIR))
+	    {
+	      index_name = g_strconcat ("mate-index-fail-", name, NULL);
+	      list_dir (entries, app_dir,
+			open_index (indexes, base_dir, app_dir, index_name));
+	      g_free (index_name);
+	    }
+	  g_free (app_dir);
+	}
+      g_dir_close (gdir);
+    }
+  g_free (dir);
+
+  now = time (NULL);
+  check_entries ((CleanEntry *) entries->data, entries->len, now);
+
+  kept = g_ptr_array_sized_new (entries->len);
+  kept_bytes = 0;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      entry = &g_array_index (entries, CleanEntry, i);
+
+      if (entry->action == CLEAN_GONE)
+	continue;
+
+      if (!entry->temporary)
+	{
+	  result->files++;
+	  result->bytes += entry->size;
+	}
+
+      switch (entry->action)
+	{
+	case CLEAN_ORPHANED:
+	  remove_entry (entry, dry_run, &result->orphaned, result);
+	  break;
+	case CLEAN_STALE:
+	  remove_entry (entry, dry_run, &result->stale, result);
+	  break;
+	case CLEAN_INVALID:
+	  remove_entry (entry, dry_run, &result->invalid, result);
+	  break;
+	default:
+	  if (max_age > 0 && now - entry->last_used > max_age)
+	    remove_entry (entry, dry_run, &result->expired, result);
+	  else
+	    {
+	      g_ptr_array_add (kept, entry);
+	      kept_bytes += entry->size;
+	    }
+	  break;
+	}
+    }
+
+  /* Least recently used first */
+  if (max_bytes > 0 && kept_bytes > max_bytes)
+    {
+      g_ptr_array_sort (kept, compare_last_used);
+
+      for (i = 0; i < kept->len && kept_bytes > max_bytes; i++)
+	{
+	  entry = g_ptr_array_index (kept, i);
+	  remove_entry (entry, dry_run, &result->evicted, result);
+	  kept_bytes -= entry->size;
+	}
+    }
+
+  g_ptr_array_free (kept, TRUE);
+
+  for (i = 0; i < entries->len; i++)
+    g_free (g_array_index (entries, CleanEntry, i).path);
+  g_array_free (entries, TRUE);
+
+  for (i = 0; i < indexes->len; i++)
+    _mate_thumbnail_index_free (g_ptr_array_index (indexes, i));
+  g_ptr_array_free (indexes, TRUE);
+}
@@ -0,0 +1,829 @@
+/*
+ * mate-thumbnail-index.c: Persistent index of valid thumbnails
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* The index is a file next to a thumbnail directory holding an open
+ * addressing hash table, keyed by the MD5 digest of the uri (which is
+ * also the thumbnail's file name), of the Thumb::MTime each thumbnail
+ * was written with. It is mapped shared, so all processes using it see
+ * each other's updates; writers serialize with a fcntl() lock.
+ *
+ * Thumbnails written by other programs are not in the index, so a
+ * missing entry only means "look at the file". Entries are trusted on
+ * their own as long as the directory mtime matches the one recorded by
+ * the last writer, which every lookup checks. Once something else
+ * touched the directory, hits are confirmed with a stat() of the
+ * thumbnail, comparing its size and mtime, until the index is verified
+ * again.
+ *
+ * Writers rename their thumbnail into place under the lock, and only
+ * record the new directory mtime if the one before the rename was the
+ * recorded one and trusted, so changes by others are never covered up;
+ * otherwise the index stays untrusted until it is verified. Times are
+ * kept in nanoseconds where the system has them. A recorded mtime is
+ * only trusted if its second was already over when it was recorded,
+ * since another change in the same clock tick would not show on file
+ * systems with one second timestamps. */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "mate-thumbnail-private.h"
+
+gboolean
+_mate_thumbnail_parse_filename (const char *name,
+				guint8     *digest)
+{
+  int i, hi, lo;
+
+  if (strlen (name) != 36 || strcmp (name + 32, ".png") != 0)
+    return FALSE;
+
+  for (i = 0; i < 16; i++)
+    {
+      hi = g_ascii_xdigit_value (name[2 * i]);
+      lo = g_ascii_xdigit_value (name[2 * i + 1]);
+      if (hi < 0 || lo < 0)
+	return FALSE;
+      digest[i] = (hi << 4) | lo;
+    }
+
+  return TRUE;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+
+#define INDEX_MAGIC "MTHIDX4"
+#define INDEX_BYTE_ORDER 0x01020304
+#define INDEX_MIN_BUCKETS 4096
+
+typedef struct {
+  char magic[8];
+  guint32 byte_order;
+  guint32 n_buckets;          /* a power of two */
+  guint32 n_used;             /* valid and removed entries */
+  guint32 obsolete;           /* the file was replaced by a bigger one */
+  gint64 dir_mtime;           /* directory mtime after the last write, in ns */
+  gint64 dir_mtime_recorded;  /* wall time dir_mtime was taken at, in s */
+  guint8 padding[24];
+} IndexHeader;
+
+enum {
+  ENTRY_EMPTY,
+  ENTRY_VALID,
+  ENTRY_REMOVED
+};
+
+typedef struct {
+  guint8 digest[16];
+  gint64 mtime;
+  gint64 file_mtime;          /* of the thumbnail file, in ns */
+  guint32 size;               /* of the thumbnail file */
+  guint32 status;
+} IndexEntry;
+
+struct _MateThumbnailIndex {
+  GMutex *lock;
+  char *dir;
+  char *path;
+
+  int fd;
+  gsize map_size;
+  IndexHeader *header;
+  IndexEntry *entries;
+};
+
+#define NSEC_PER_SEC G_GINT64_CONSTANT (1000000000)
+
+static gint64
+stat_get_mtime (const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return (gint64) st->st_mtime * NSEC_PER_SEC + st->st_mtim.tv_nsec;
+#else
+  return (gint64) st->st_mtime * NSEC_PER_SEC;
+#endif
+}
+
+static gint64
+get_dir_mtime (MateThumbnailIndex *index)
+{
+  struct stat st;
+
+  if (g_stat (index->dir, &st) != 0)
+    return -1;
+
+  return stat_get_mtime (&st);
+}
+
+/* Whether the directory is unchanged since @dir_mtime was recorded */
+static gboolean
+dir_mtime_is_trusted (MateThumbnailIndex *index,
+		      gint64              dir_mtime)
+{
+  return dir_mtime >= 0 &&
+    dir_mtime == index->header->dir_mtime &&
+    dir_mtime / NSEC_PER_SEC < index->header->dir_mtime_recorded;
+}
+
+/* Called with the file locked */
+static void
+record_dir_mtime (MateThumbnailIndex *index,
+		  gint64              dir_mtime)
+{
+  index->header->dir_mtime = dir_mtime;
+  index->header->dir_mtime_recorded = time (NULL);
+}
+
+static gboolean
+lock_file (int fd, short type)
+{
+  struct flock fl;
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;
+
+  while (fcntl (fd, F_SETLKW, &fl) == -1)
+    {
+      if (errno != EINTR)
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gsize
+index_file_size (guint32 n_buckets)
+{
+  return sizeof (IndexHeader) + (gsize) n_buckets * sizeof (IndexEntry);
+}
+
+static gboolean
+header_is_valid (const IndexHeader *header, gsize size)
+{
+  return memcmp (header->magic, INDEX_MAGIC, sizeof (header->magic)) == 0 &&
+    header->byte_order == INDEX_BYTE_ORDER &&
+    header->n_buckets >= INDEX_MIN_BUCKETS &&
+    (header->n_buckets & (header->n_buckets - 1)) == 0 &&
+    index_file_size (header->n_buckets) == size;
+}
+
+static void
+index_unmap (MateThumbnailIndex *index)
+{
+  if (index->header != NULL)
+    munmap (index->header, index->map_size);
+  if (index->fd != -1)
+    close (index->fd);
+
+  index->header = NULL;
+  index->entries = NULL;
+  index->map_size = 0;
+  index->fd = -1;
+}
+
+/* Writes an empty table to fd, which must be locked */
+static gboolean
+index_initialize (MateThumbnailIndex *index, int fd)
+{
+  IndexHeader header;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, INDEX_MAGIC, sizeof (header.magic));
+  header.byte_order = INDEX_BYTE_ORDER;
+  header.n_buckets = INDEX_MIN_BUCKETS;
+  header.dir_mtime = get_dir_mtime (index);
+  header.dir_mtime_recorded = time (NULL);
+
+  if (ftruncate (fd, 0) != 0 ||
+      ftruncate (fd, index_file_size (header.n_buckets)) != 0)
+    return FALSE;
+
+  return pwrite (fd, &header, sizeof (header), 0) == sizeof (header);
+}
+
+static gboolean
+index_map (MateThumbnailIndex *index)
+{
+  struct stat st;
+  IndexHeader header;
+  void *map;
+  int fd;
+
+  fd = g_open (index->path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1)
+    return FALSE;
+
+  if (fstat (fd, &st) != 0 ||
+      (gsize) st.st_size < sizeof (header) ||
+      pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+      !header_is_valid (&header, st.st_size))
+    {
+      /* New or damaged; check again under the lock since another
+       * process may be creating it right now */
+      if (!lock_file (fd, F_WRLCK))
+	{
+	  close (fd);
+	  return FALSE;
+	}
+
+      if (fstat (fd, &st) != 0 ||
+	  (gsize) st.st_size < sizeof (header) ||
+	  pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+	  !header_is_valid (&header, st.st_size))
+	{
+	  if (!index_initialize (index, fd) ||
+	      fstat (fd, &st) != 0)
+	    {
+	      close (fd);
+	      return FALSE;
+	    }
+	}
+
+      lock_file (fd, F_UNLCK);
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  index->fd = fd;
+  index->map_size = st.st_size;
+  index->header = map;
+  index->entries = (IndexEntry *) (index->header + 1);
+
+  return TRUE;
+}
+
+/* Called with the mutex held, makes sure the current file is mapped */
+static gboolean
+index_ensure_mapped (MateThumbnailIndex *index)
+{
+  if (index->header != NULL && index->header->obsolete)
+    index_unmap (index);
+
+  if (index->header == NULL)
+    return index_map (index);
+
+  return TRUE;
+}
+
+/* Called with the mutex held; takes the file lock on the current file */
+static gboolean
+index_lock (MateThumbnailIndex *index)
+{
+  while (index_ensure_mapped (index))
+    {
+      if (!lock_file (index->fd, F_WRLCK))
+	return FALSE;
+
+      if (!index->header->obsolete)
+	return TRUE;
+
+      lock_file (index->fd, F_UNLCK);
+    }
+
+  return FALSE;
+}
+
+static void
+index_unlock (MateThumbnailIndex *index)
+{
+  lock_file (index->fd, F_UNLCK);
+}
+
+static IndexEntry *
+find_entry (IndexEntry *entries,
+	    guint32 n_buckets,
+	    const guint8 *digest,
+	    gboolean for_insert)
+{
+  IndexEntry *entry, *first_removed;
+  guint32 i, n, hash;
+
+  /* MD5 is evenly distributed already */
+  memcpy (&hash, digest, sizeof (hash));
+
+  first_removed = NULL;
+  for (n = 0, i = hash & (n_buckets - 1);
+       n < n_buckets;
+       n++, i = (i + 1) & (n_buckets - 1))
+    {
+      entry = &entries[i];
+
+      if (entry->status == ENTRY_EMPTY)
+	{
+	  if (!for_insert)
+	    return NULL;
+	  return first_removed != NULL ? first_removed : entry;
+	}
+
+      if (entry->status == ENTRY_REMOVED)
+	{
+	  if (first_removed == NULL)
+	    first_removed = entry;
+	  continue;
+	}
+
+      if (memcmp (entry->digest, digest, 16) == 0)
+	return entry;
+    }
+
+  return for_insert ? first_removed : NULL;
+}
+
+/* Replaces the file with one sized for the valid entries. Called with
+ * the file locked; on return the new file is mapped and locked. */
+static gboolean
+index_resize (MateThumbnailIndex *index)
+{
+  IndexHeader *header;
+  IndexEntry *entries, *entry;
+  char *tmp_path;
+  guint32 i, n_valid, n_buckets;
+  gsize size;
+  void *map;
+  int fd;
+
+  n_valid = 0;
+  for (i = 0; i < index->header->n_buckets; i++)
+    {
+      if (index->entries[i].status == ENTRY_VALID)
+	n_valid++;
+    }
+
+  /* Keep the load factor at or below a quarter after resizing */
+  n_buckets = INDEX_MIN_BUCKETS;
+  while (n_buckets < n_valid * 4)
+    n_buckets *= 2;
+  size = index_file_size (n_buckets);
+
+  tmp_path = g_strconcat (index->path, ".XXXXXX", NULL);
+  fd = g_mkstemp (tmp_path);
+  if (fd == -1)
+    {
+      g_free (tmp_path);
+      return FALSE;
+    }
+
+  if (ftruncate (fd, size) != 0 ||
+      (map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      close (fd);
+      g_unlink (tmp_path);
+      g_free (tmp_path);
+      return FALSE;
+    }
+
+  header = map;
+  entries = (IndexEntry *) (header + 1);
+  memcpy (header, index->header, sizeof (IndexHeader));
+  header->n_buckets = n_buckets;
+  header->n_used = n_valid;
+  header->obsolete = 0;
+
+  for (i = 0; i < index->header->n_buckets; i++)
+    {
+      if (index->entries[i].status != ENTRY_VALID)
+	continue;
+      entry = find_entry (entries, n_buckets, index->entries[i].digest, TRUE);
+      *entry = index->entries[i];
+    }
+
+  /* Lock the new file before anybody can see it */
+  if (!lock_file (fd, F_WRLCK) ||
+      g_rename (tmp_path, index->path) != 0)
+    {
+      munmap (map, size);
+      close (fd);
+      g_unlink (tmp_path);
+      g_free (tmp_path);
+      return FALSE;
+    }
+  g_free (tmp_path);
+
+  /* Processes waiting for the old file will move on to the new one */
+  index->header->obsolete = 1;
+  index_unlock (index);
+  index_unmap (index);
+
+  index->fd = fd;
+  index->map_size = size;
+  index->header = header;
+  index->entries = entries;
+
+  return TRUE;
+}
+
+/* Called with the file locked */
+static void
+index_insert_locked (MateThumbnailIndex *index,
+		     const guint8 *digest,
+		     time_t mtime,
+		     const struct stat *st)
+{
+  IndexEntry *entry;
+
+  if ((index->header->n_used + 1) * 2 > index->header->n_buckets &&
+      !index_resize (index))
+    return;
+
+  entry = find_entry (index->entries, index->header->n_buckets, digest, TRUE);
+  if (entry == NULL)
+    return;
+
+  if (entry->status == ENTRY_EMPTY)
+    index->header->n_used++;
+
+  /* Readers don't lock, so publish the entry last */
+  entry->status = ENTRY_REMOVED;
+  memcpy (entry->digest, digest, 16);
+  entry->mtime = mtime;
+  entry->file_mtime = stat_get_mtime (st);
+  entry->size = st->st_size;
+  entry->status = ENTRY_VALID;
+}
+
+MateThumbnailIndex *
+_mate_thumbnail_index_new (const char *dir,
+			   const char *path)
+{
+  MateThumbnailIndex *index;
+
+  index = g_new0 (MateThumbnailIndex, 1);
+  index->lock = g_mutex_new ();
+  index->dir = g_strdup (dir);
+  index->path = g_strdup (path);
+  index->fd = -1;
+
+  return index;
+}
+
+void
+_mate_thumbnail_index_free (MateThumbnailIndex *index)
+{
+  index_unmap (index);
+  g_mutex_free (index->lock);
+  g_free (index->dir);
+  g_free (index->path);
+  g_free (index);
+}
+
+MateThumbnailIndexResult
+_mate_thumbnail_index_lookup (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *thumbnail_path)
+{
+  IndexEntry *found, entry;
+  gboolean trusted;
+  struct stat st;
+  gint64 dir_mtime;
+
+  /* One stat() of the directory is still much cheaper than reading
+   * the thumbnail, and notices changes by others right away */
+  dir_mtime = get_dir_mtime (index);
+
+  g_mutex_lock (index->lock);
+
+  if (!index_ensure_mapped (index))
+    {
+      g_mutex_unlock (index->lock);
+      return MATE_THUMBNAIL_INDEX_UNKNOWN;
+    }
+
+  trusted = dir_mtime_is_trusted (index, dir_mtime);
+
+  found = find_entry (index->entries, index->header->n_buckets, digest, FALSE);
+  if (found != NULL)
+    entry = *found;
+
+  g_mutex_unlock (index->lock);
+
+  if (found == NULL || entry.status != ENTRY_VALID)
+    return MATE_THUMBNAIL_INDEX_UNKNOWN;
+
+  if (!trusted)
+    {
+      /* Somebody else changed the directory; the file might be gone
+       * or have been replaced by a thumbnail for a newer mtime. */
+      if (g_stat (thumbnail_path, &st) != 0)
+	{
+	  _mate_thumbnail_index_remove (index, digest);
+	  return MATE_THUMBNAIL_INDEX_UNKNOWN;
+	}
+      if ((guint32) st.st_size != entry.size ||
+	  stat_get_mtime (&st) != entry.file_mtime)
+	return MATE_THUMBNAIL_INDEX_UNKNOWN;
+    }
+
+  if (entry.mtime != mtime)
+    return MATE_THUMBNAIL_INDEX_STALE;
+
+  return MATE_THUMBNAIL_INDEX_VALID;
+}
+
+void
+_mate_thumbnail_index_insert (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *thumbnail_path)
+{
+  struct stat st;
+
+  if (g_stat (thumbnail_path, &st) != 0)
+    return;
+
+  g_mutex_lock (index->lock);
+
+  if (index_lock (index))
+    {
+      index_insert_locked (index, digest, mtime, &st);
+      index_unlock (index);
+    }
+
+  g_mutex_unlock (index->lock);
+}
+
+int
+_mate_thumbnail_index_rename (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *tmp_path,
+			      const char         *thumbnail_path)
+{
+  struct stat st;
+  gint64 before;
+  int res;
+
+  g_mutex_lock (index->lock);
+
+  if (!index_lock (index))
+    {
+      g_mutex_unlock (index->lock);
+      return g_rename (tmp_path, thumbnail_path);
+    }
+
+  before = get_dir_mtime (index);
+
+  res = g_rename (tmp_path, thumbnail_path);
+  if (res == 0 && g_stat (thumbnail_path, &st) == 0)
+    {
+      index_insert_locked (index, digest, mtime, &st);
+
+      /* Our own write doesn't make the index any less complete, but
+       * only if nobody else changed the directory before it */
+      if (dir_mtime_is_trusted (index, before))
+	record_dir_mtime (index, get_dir_mtime (index));
+      else
+	index->header->dir_mtime = -1;
+    }
+
+  index_unlock (index);
+  g_mutex_unlock (index->lock);
+
+  return res;
+}
+
+void
+_mate_thumbnail_index_invalidate (MateThumbnailIndex *index)
+{
+  g_mutex_lock (index->lock);
+
+  if (index_lock (index))
+    {
+      index->header->dir_mtime = -1;
+      index_unlock (index);
+    }
+
+  g_mutex_unlock (index->lock);
+}
+
+void
+_mate_thumbnail_index_remove (MateThumbnailIndex *index,
+			      const guint8       *digest)
+{
+  IndexEntry *entry;
+
+  g_mutex_lock (index->lock);
+
+  if (index_lock (index))
+    {
+      entry = find_entry (index->entries, index->header->n_buckets, digest, FALSE);
+      if (entry != NULL)
+	entry->status = ENTRY_REMOVED;
+
+      index_unlock (index);
+    }
+
+  g_mutex_unlock (index->lock);
+}
+
+/* Reads the thumbnail and checks that it is the one for its file name */
+static gboolean
+read_thumbnail (const char *path,
+		const guint8 *digest,
+		time_t *mtime,
+		struct stat *st)
+{
+  static const char * const keys[] = { "Thumb::URI", "Thumb::MTime", NULL };
+  char *values[2];
+  guint8 uri_digest[16];
+  gboolean res;
+
+  if (g_stat (path, st) != 0 ||
+      !_mate_thumbnail_png_read_text (path, keys, values))
+    return FALSE;
+
+  res = FALSE;
+  if (values[0] != NULL && values[1] != NULL)
+    {
+      _mate_thumbnail_md5_digest (values[0], strlen (values[0]), uri_digest);
+
+      res = memcmp (uri_digest, digest, 16) == 0;
+      *mtime = atol (values[1]);
+    }
+
+  g_free (values[0]);
+  g_free (values[1]);
+
+  return res;
+}
+
+gboolean
+_mate_thumbnail_index_verify (MateThumbnailIndex *index,
+			      gboolean            rebuild)
+{
+  IndexEntry *entry;
+  GDir *dir;
+  const char *name;
+  char *path;
+  char filename[37];
+  guint8 digest[16];
+  struct stat st;
+  time_t mtime;
+  guint32 i;
+  int j;
+
+  g_mutex_lock (index->lock);
+
+  if (!index_lock (index))
+    {
+      g_mutex_unlock (index->lock);
+      return FALSE;
+    }
+
+  if (rebuild)
+    {
+      memset (index->entries, 0,
+	      (gsize) index->header->n_buckets * sizeof (IndexEntry));
+      index->header->n_used = 0;
+
+      dir = g_dir_open (index->dir, 0, NULL);
+      if (dir != NULL)
+	{
+	  while ((name = g_dir_read_name (dir)) != NULL)
+	    {
+	      if (!_mate_thumbnail_parse_filename (name, digest))
+		continue;
+
+	      path = g_build_filename (index->dir, name, NULL);
+	      if (read_thumbnail (path, digest, &mtime, &st))
+		index_insert_locked (index, digest, mtime, &st);
+	      g_free (path);
+	    }
+	  g_dir_close (dir);
+	}
+    }
+  else
+    {
+      for (i = 0; i < index->header->n_buckets; i++)
+	{
+	  entry = &index->entries[i];
+	  if (entry->status != ENTRY_VALID)
+	    continue;
+
+	  for (j = 0; j < 16; j++)
+	    g_snprintf (filename + 2 * j, 3, "%02x", entry->digest[j]);
+	  strcpy (filename + 32, ".png");
+
+	  path = g_build_filename (index->dir, filename, NULL);
+	  if (read_thumbnail (path, entry->digest, &mtime, &st))
+	    {
+	      entry->mtime = mtime;
+	      entry->file_mtime = stat_get_mtime (&st);
+	      entry->size = st.st_size;
+	    }
+	  else
+	    entry->status = ENTRY_REMOVED;
+	  g_free (path);
+	}
+    }
+
+  record_dir_mtime (index, get_dir_mtime (index));
+
+  index_unlock (index);
+  g_mutex_unlock (index->lock);
+
+  return TRUE;
+}
+
+#else /* !HAVE_SYS_MMAN_H */
+
+/* Without mmap() the index is never consulted */
+
+MateThumbnailIndex *
+_mate_thumbnail_index_new (const char *dir,
+			   const char *path)
+{
+  return NULL;
+}
+
+void
+_mate_thumbnail_index_free (MateThumbnailIndex *index)
+{
+}
+
+MateThumbnailIndexResult
+_mate_thumbnail_index_lookup (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *thumbnail_path)
+{
+  return MATE_THUMBNAIL_INDEX_UNKNOWN;
+}
+
+void
+_mate_thumbnail_index_insert (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *thumbnail_path)
+{
+}
+
+int
+_mate_thumbnail_index_rename (MateThumbnailIndex *index,
+			      const guint8       *digest,
+			      time_t              mtime,
+			      const char         *tmp_path,
+			      const char         *thumbnail_path)
+{
+  return g_rename (tmp_path, thumbnail_path);
+}
+
+void
+_mate_thumbnail_index_remove (MateThumbnailIndex *index,
+			      const guint8       *digest)
+{
+}
+
+void
+_mate_thumbnail_index_invalidate (MateThumbnailIndex *index)
+{
+}
+
+gboolean
+_mate_thumbnail_index_verify (MateThumbnailIndex *index,
+			      gboolean            rebuild)
+{
+  return FALSE;
+}
+
+#endif /* HAVE_SYS_MMAN_H */
@@ -0,0 +1,636 @@
+/*
+ * mate-thumbnail-jpeg.c: Fast paths for thumbnailing camera pictures
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Most camera JPEG and TIFF based raw files carry a small JPEG preview
+ * in their Exif data. When it is big enough for the thumbnail it is
+ * used instead of the picture, which only needs the first few KB of
+ * the file.
+ *
+ * Otherwise libjpeg can skip most of the IDCT work by decoding at 1/2,
+ * 1/4 or 1/8 of the image size. gdk-pixbuf only uses that to get close
+ * to the size it is asked for and then scales bilinearly; here the
+ * smallest reduction that is still at least as large as the thumbnail
+ * is decoded and box filtered down a row at a time, so a camera
+ * picture never exists in memory at more than an eighth of its size. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "mate-thumbnail-private.h"
+
+gboolean
+_mate_thumbnail_is_jpeg (const guchar *data,
+			 gsize         length)
+{
+  return length > 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff;
+}
+
+#define EXIF_TAG_IMAGE_WIDTH        0x0100
+#define EXIF_TAG_IMAGE_LENGTH       0x0101
+#define EXIF_TAG_ORIENTATION        0x0112
+#define EXIF_TAG_JPEG_OFFSET        0x0201
+#define EXIF_TAG_JPEG_LENGTH        0x0202
+
+#define EXIF_TYPE_SHORT 3
+#define EXIF_TYPE_LONG  4
+
+typedef struct {
+  int orientation;            /* 0 if not given */
+  int width;                  /* of the main image, 0 if not given */
+  int height;
+  const guchar *thumbnail;    /* the JPEG preview in IFD1, or NULL */
+  gsize thumbnail_length;
+} ExifInfo;
+
+static guint
+exif_get16 (const guchar *p,
+	    gboolean      big_endian)
+{
+  return big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static guint32
+exif_get32 (const guchar *p,
+	    gboolean      big_endian)
+{
+  return big_endian ?
+    ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+    p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+/* A single SHORT or LONG, stored in the value field of the entry */
+static guint32
+exif_get_uint (const guchar *entry,
+	       gboolean      big_endian)
+{
+  if (exif_get32 (entry + 4, big_endian) != 1)
+    return 0;
+
+  switch (exif_get16 (entry + 2, big_endian))
+    {
+    case EXIF_TYPE_SHORT:
+      return exif_get16 (entry + 8, big_endian);
+    case EXIF_TYPE_LONG:
+      return exif_get32 (entry + 8, big_endian);
+    default:
+      return 0;
+    }
+}
+
+/* Returns the number of entries of the IFD at @offset, 0 if it doesn't
+ * fit in @length */
+static guint
+exif_get_ifd (const guchar *tiff,
+	      gsize         length,
+	      guint32       offset,
+	      gboolean      big_endian)
+{
+  guint n_entries;
+
+  if (offset < 8 || length < 2 + 4 || offset > length - 2 - 4)
+    return 0;
+
+  n_entries = exif_get16 (tiff + offset, big_endian);
+  if (n_entries > (length - offset - 2 - 4) / 12)
+    return 0;
+
+  return n_entries;
+}
+
+/* Reads IFD0 and IFD1 of a TIFF structure, which is what Exif data is
+ * and what TIFF based files start with. Only the IFDs themselves are
+ * read, normally a few hundred bytes at the start. */
+static gboolean
+exif_parse (const guchar *tiff,
+	    gsize         length,
+	    ExifInfo     *info)
+{
+  const guchar *entry;
+  gboolean big_endian;
+  guint32 offset, jpeg_offset, jpeg_length;
+  guint n_entries, i;
+
+  memset (info, 0, sizeof (ExifInfo));
+
+  if (length < 8)
+    return FALSE;
+
+  if (memcmp (tiff, "MM\0\52", 4) == 0)
+    big_endian = TRUE;
+  else if (memcmp (tiff, "II\52\0", 4) == 0)
+    big_endian = FALSE;
+  else
+    return FALSE;
+
+  offset = exif_get32 (tiff + 4, big_endian);
+  n_entries = exif_get_ifd (tiff, length, offset, big_endian);
+  if (n_entries == 0)
+    return FALSE;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      entry = tiff + offset + 2 + 12 * i;
+      switch (exif_get16 (entry, big_endian))
+	{
+	case EXIF_TAG_ORIENTATION:
+	  info->orientation = exif_get_uint (entry, big_endian);
+	  break;
+	case EXIF_TAG_IMAGE_WIDTH:
+	  info->width = exif_get_uint (entry, big_endian);
+	  break;
+	case EXIF_TAG_IMAGE_LENGTH:
+	  info->height = exif_get_uint (entry, big_endian);
+	  break;
+	}
+    }
+
+  /* IFD1 follows IFD0 and describes the preview */
+  offset = exif_get32 (tiff + offset + 2 + 12 * n_entries, big_endian);
+  n_entries = exif_get_ifd (tiff, length, offset, big_endian);
+
+  jpeg_offset = jpeg_length = 0;
+  for (i = 0; i < n_entries; i++)
+    {
+      entry = tiff + offset + 2 + 12 * i;
+      switch (exif_get16 (entry, big_endian))
+	{
+	case EXIF_TAG_JPEG_OFFSET:
+	  jpeg_offset = exif_get_uint (entry, big_endian);
+	  break;
+	case EXIF_TAG_JPEG_LENGTH:
+	  jpeg_length = exif_get_uint (entry, big_endian);
+	  break;
+	}
+    }
+
+  if (jpeg_offset > 0 && jpeg_length > 0 &&
+      jpeg_offset <= length && jpeg_length <= length - jpeg_offset &&
+      _mate_thumbnail_is_jpeg (tiff + jpeg_offset, jpeg_length))
+    {
+      info->thumbnail = tiff + jpeg_offset;
+      info->thumbnail_length = jpeg_length;
+    }
+
+  return TRUE;
+}
+
+int
+_mate_thumbnail_exif_get_orientation (const guchar *data,
+				      gsize         length)
+{
+  ExifInfo info;
+
+  if (length < 6 || memcmp (data, "Exif\0\0", 6) != 0 ||
+      !exif_parse (data + 6, length - 6, &info))
+    return 0;
+
+  return info.orientation;
+}
+
+/* Finds the Exif data and the image size in the markers in front of
+ * the compressed data of a JPEG file */
+static gboolean
+jpeg_parse_header (const guchar *data,
+		   gsize         length,
+		   ExifInfo     *info)
+{
+  gsize pos, segment_length;
+  gboolean have_exif;
+  int width, height;
+  guchar marker;
+
+  have_exif = FALSE;
+  width = height = 0;
+
+  pos = 2;
+  while (pos + 4 <= length && data[pos] == 0xff)
+    {
+      marker = data[pos + 1];
+      if (marker == 0xff)
+	{
+	  /* Fill byte */
+	  pos++;
+	  continue;
+	}
+      if (marker == 0xda || marker == 0xd9)  /* SOS, EOI */
+	break;
+
+      segment_length = (data[pos + 2] << 8) | data[pos + 3];
+      if (segment_length < 2 || segment_length > length - pos - 2)
+	break;
+
+      if (marker == 0xe1 && !have_exif &&
+	  segment_length >= 2 + 6 &&
+	  memcmp (data + pos + 4, "Exif\0\0", 6) == 0)
+	have_exif = exif_parse (data + pos + 4 + 6, segment_length - 2 - 6, info);
+
+      /* SOFn, except DHT, JPG and DAC which share the range */
+      if (marker >= 0xc0 && marker <= 0xcf &&
+	  marker != 0xc4 && marker != 0xc8 && marker != 0xcc &&
+	  segment_length >= 2 + 5)
+	{
+	  height = (data[pos + 5] << 8) | data[pos + 6];
+	  width = (data[pos + 7] << 8) | data[pos + 8];
+	  break;
+	}
+
+      pos += 2 + segment_length;
+    }
+
+  if (!have_exif)
+    return FALSE;
+
+  /* The frame is authoritative, Exif sizes are often left out */
+  if (width > 0 && height > 0)
+    {
+      info->width = width;
+      info->height = height;
+    }
+
+  return TRUE;
+}
+
+/* The size gdk-pixbuf would scale the image to, see size_prepared_cb()
+ * in mate-thumbnail.c */
+static void
+get_dest_size (int  width,
+	       int  height,
+	       int  max_width,
+	       int  max_height,
+	       int *dest_width,
+	       int *dest_height)
+{
+  if (width < max_width && height < max_height)
+    {
+      *dest_width = width;
+      *dest_height = height;
+    }
+  else if ((double) height * max_width > (double) width * max_height)
+    {
+      *dest_width = 0.5 + (double) width * max_height / height;
+      *dest_height = max_height;
+    }
+  else
+    {
+      *dest_width = max_width;
+      *dest_height = 0.5 + (double) height * max_width / width;
+    }
+
+  *dest_width = MAX (*dest_width, 1);
+  *dest_height = MAX (*dest_height, 1);
+}
+
+GdkPixbuf *
+_mate_thumbnail_load_embedded (const guchar *data,
+			       gsize         length,
+			       int           max_width,
+			       int           max_height,
+			       int          *original_width,
+			       int          *original_height)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *preview, *pixbuf;
+  ExifInfo info;
+  int width, height, dest_width, dest_height;
+  char orientation[2];
+  gboolean res;
+
+  g_return_val_if_fail (max_width > 0 && max_height > 0, NULL);
+
+  if (_mate_thumbnail_is_jpeg (data, length))
+    res = jpeg_parse_header (data, length, &info);
+  else
+    res = exif_parse (data, length, &info);
+
+  if (!res || info.thumbnail == NULL || info.width <= 0 || info.height <= 0)
+    return NULL;
+
+  /* Small enough to be used as it is */
+  if (info.width <= max_width && info.height <= max_height)
+    return NULL;
+
+  get_dest_size (info.width, info.height, max_width, max_height,
+		 &dest_width, &dest_height);
+
+  loader = gdk_pixbuf_loader_new ();
+  res = gdk_pixbuf_loader_write (loader, info.thumbnail, info.thumbnail_length, NULL);
+  res = gdk_pixbuf_loader_close (loader, NULL) && res;
+  preview = res ? gdk_pixbuf_loader_get_pixbuf (loader) : NULL;
+  if (preview != NULL)
+    g_object_ref (preview);
+  g_object_unref (loader);
+
+  if (preview == NULL)
+    return NULL;
+
+  width = gdk_pixbuf_get_width (preview);
+  height = gdk_pixbuf_get_height (preview);
+
+  /* Too small, or letterboxed to a different aspect ratio, as many
+   * cameras do with their 160x120 previews */
+  if (width < dest_width || height < dest_height ||
+      ABS ((double) width * info.height - (double) height * info.width) >
+      0.02 * (double) width * info.height)
+    {
+      g_object_unref (preview);
+      return NULL;
+    }
+
+  if (width > dest_width || height > dest_height)
+    {
+      pixbuf = mate_thumbnail_scale_down_pixbuf (preview, dest_width, dest_height);
+      g_object_unref (preview);
+    }
+  else
+    pixbuf = preview;
+
+  /* The preview has no Exif data of its own, so pass the orientation
+   * of the image on for gdk_pixbuf_apply_embedded_orientation() */
+  if (info.orientation >= 1 && info.orientation <= 8)
+    {
+      orientation[0] = '0' + info.orientation;
+      orientation[1] = 0;
+      gdk_pixbuf_set_option (pixbuf, "orientation", orientation);
+    }
+
+  *original_width = info.width;
+  *original_height = info.height;
+
+  return pixbuf;
+}
+
+#ifdef HAVE_LIBJPEG
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} ErrorManager;
+
+static void
+fatal_error_handler (j_common_ptr cinfo)
+{
+  ErrorManager *errmgr = (ErrorManager *) cinfo->err;
+
+  longjmp (errmgr->setjmp_buffer, 1);
+}
+
+static void
+output_message_handler (j_common_ptr cinfo)
+{
+  /* Corrupt data warnings are not worth printing for a thumbnail */
+}
+
+/* libjpeg before version 8 can't read from memory itself */
+static void
+init_source (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+fill_input_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+  /* Truncated file: end it so what was decoded can be used */
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+
+  return TRUE;
+}
+
+static void
+skip_input_data (j_decompress_ptr cinfo,
+		 long             num_bytes)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  if ((gsize) num_bytes > src->bytes_in_buffer)
+    {
+      fill_input_buffer (cinfo);
+      return;
+    }
+
+  src->next_input_byte += num_bytes;
+  src->bytes_in_buffer -= num_bytes;
+}
+
+static void
+term_source (j_decompress_ptr cinfo)
+{
+}
+
+static void
+gray_to_rgb (guchar *row,
+	     int     width)
+{
+  int x;
+
+  /* Backwards, the gray pixels are at the start of the row */
+  for (x = width - 1; x >= 0; x--)
+    row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = row[x];
+}
+
+GdkPixbuf *
+_mate_thumbnail_jpeg_load (const guchar *data,
+			   gsize         length,
+			   int           max_width,
+			   int           max_height,
+			   int          *original_width,
+			   int          *original_height)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  ErrorManager jerr;
+  jpeg_saved_marker_ptr marker;
+  MateThumbnailScaler *volatile scaler;
+  GdkPixbuf *volatile pixbuf;
+  guchar *volatile row;
+  guchar *pixels;
+  JSAMPROW rows[1];
+  int dest_width, dest_height, denom, rowstride, orientation;
+  char orientation_str[2];
+
+  g_return_val_if_fail (max_width > 0 && max_height > 0, NULL);
+
+  scaler = NULL;
+  pixbuf = NULL;
+  row = NULL;
+
+  cinfo.err = jpeg_std_error (&jerr.pub);
+  jerr.pub.error_exit = fatal_error_handler;
+  jerr.pub.output_message = output_message_handler;
+
+  if (setjmp (jerr.setjmp_buffer))
+    {
+      if (scaler != NULL)
+	_mate_thumbnail_scaler_free (scaler);
+      if (pixbuf != NULL)
+	g_object_unref (pixbuf);
+      g_free (row);
+      jpeg_destroy_decompress (&cinfo);
+      return NULL;
+    }
+
+  jpeg_create_decompress (&cinfo);
+
+  src.next_input_byte = data;
+  src.bytes_in_buffer = length;
+  src.init_source = init_source;
+  src.fill_input_buffer = fill_input_buffer;
+  src.skip_input_data = skip_input_data;
+  src.resync_to_restart = jpeg_resync_to_restart;
+  src.term_source = term_source;
+  cinfo.src = &src;
+
+  jpeg_save_markers (&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header (&cinfo, TRUE);
+
+  /* Inverted CMYK and the like are left to gdk-pixbuf */
+  if (cinfo.jpeg_color_space == JCS_GRAYSCALE)
+    cinfo.out_color_space = JCS_GRAYSCALE;
+  else if (cinfo.jpeg_color_space == JCS_YCbCr ||
+	   cinfo.jpeg_color_space == JCS_RGB)
+    cinfo.out_color_space = JCS_RGB;
+  else
+    {
+      jpeg_destroy_decompress (&cinfo);
+      return NULL;
+    }
+
+  get_dest_size (cinfo.image_width, cinfo.image_height,
+		 max_width, max_height, &dest_width, &dest_height);
+
+  /* The output size is rounded up, so this never goes below the
+   * thumbnail */
+  for (denom = 8; denom > 1; denom /= 2)
+    if ((int) ((cinfo.image_width + denom - 1) / denom) >= dest_width &&
+	(int) ((cinfo.image_height + denom - 1) / denom) >= dest_height)
+      break;
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.dct_method = JDCT_IFAST;
+
+  jpeg_start_decompress (&cinfo);
+
+  if ((int) cinfo.output_width < dest_width ||
+      (int) cinfo.output_height < dest_height)
+    {
+      jpeg_abort_decompress (&cinfo);
+      jpeg_destroy_decompress (&cinfo);
+      return NULL;
+    }
+
+  if ((int) cinfo.output_width == dest_width &&
+      (int) cinfo.output_height == dest_height)
+    {
+      /* Decode straight into the thumbnail */
+      pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+			       dest_width, dest_height);
+      pixels = gdk_pixbuf_get_pixels (pixbuf);
+      rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+      while (cinfo.output_scanline < cinfo.output_height)
+	{
+	  rows[0] = pixels + cinfo.output_scanline * rowstride;
+	  jpeg_read_scanlines (&cinfo, rows, 1);
+	  if (cinfo.out_color_space == JCS_GRAYSCALE)
+	    gray_to_rgb (rows[0], cinfo.output_width);
+	}
+    }
+  else
+    {
+      scaler = _mate_thumbnail_scaler_new (cinfo.output_width,
+					   cinfo.output_height,
+					   FALSE,
+					   dest_width, dest_height);
+      row = g_malloc (cinfo.output_width * 3);
+      rows[0] = row;
+
+      while (cinfo.output_scanline < cinfo.output_height)
+	{
+	  jpeg_read_scanlines (&cinfo, rows, 1);
+	  if (cinfo.out_color_space == JCS_GRAYSCALE)
+	    gray_to_rgb (row, cinfo.output_width);
+	  _mate_thumbnail_scaler_push_row (scaler, row);
+	}
+
+      pixbuf = _mate_thumbnail_scaler_finish (scaler);
+      _mate_thumbnail_scaler_free (scaler);
+      scaler = NULL;
+      g_free (row);
+      row = NULL;
+    }
+
+  /* Keep the orientation like the gdk-pixbuf loader does, so that
+   * gdk_pixbuf_apply_embedded_orientation() works */
+  for (marker = cinfo.marker_list; marker != NULL; marker = marker->next)
+    {
+      if (marker->marker != JPEG_APP0 + 1)
+	continue;
+
+      orientation = _mate_thumbnail_exif_get_orientation (marker->data,
+							  marker->data_length);
+      if (orientation >= 1 && orientation <= 8 && pixbuf != NULL)
+	{
+	  orientation_str[0] = '0' + orientation;
+	  orientation_str[1] = 0;
+	  gdk_pixbuf_set_option (pixbuf, "orientation", orientation_str);
+	  break;
+	}
+    }
+
+  *original_width = cinfo.image_width;
+  *original_height = cinfo.image_height;
+
+  jpeg_finish_decompress (&cinfo);
+  jpeg_destroy_decompress (&cinfo);
+
+  return pixbuf;
+}
+
+#else /* !HAVE_LIBJPEG */
+
+GdkPixbuf *
+_mate_thumbnail_jpeg_load (const guchar *data,
+			   gsize         length,
+			   int           max_width,
+			   int           max_height,
+			   int          *original_width,
+			   int          *original_height)
+{
+  return NULL;
+}
+
+#endif /* HAVE_LIBJPEG */
@@ -0,0 +1,265 @@
+/*
+ * mate-thumbnail-md5.c: Thumbnail file names without allocations
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Thumbnail names are the MD5 of the uri. GChecksum allocates its state
+ * and the hex string on every use, which shows up when checking many
+ * thumbnails, so this is a plain RFC 1321 implementation working on the
+ * stack. */
+
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+
+#include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+  (a) += f ((b), (c), (d)) + (x) + (t); \
+  (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+  (a) += (b);
+
+static guint32
+load_le32 (const guchar *p)
+{
+  return (guint32) p[0] | ((guint32) p[1] << 8) |
+    ((guint32) p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static void
+store_le32 (guchar *p, guint32 v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void
+md5_transform (guint32 state[4], const guchar *block)
+{
+  guint32 a, b, c, d, x[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    x[i] = load_le32 (block + 4 * i);
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+
+  STEP (F, a, b, c, d, x[0], 0xd76aa478, 7)
+  STEP (F, d, a, b, c, x[1], 0xe8c7b756, 12)
+  STEP (F, c, d, a, b, x[2], 0x242070db, 17)
+  STEP (F, b, c, d, a, x[3], 0xc1bdceee, 22)
+  STEP (F, a, b, c, d, x[4], 0xf57c0faf, 7)
+  STEP (F, d, a, b, c, x[5], 0x4787c62a, 12)
+  STEP (F, c, d, a, b, x[6], 0xa8304613, 17)
+  STEP (F, b, c, d, a, x[7], 0xfd469501, 22)
+  STEP (F, a, b, c, d, x[8], 0x698098d8, 7)
+  STEP (F, d, a, b, c, x[9], 0x8b44f7af, 12)
+  STEP (F, c, d, a, b, x[10], 0xffff5bb1, 17)
+  STEP (F, b, c, d, a, x[11], 0x895cd7be, 22)
+  STEP (F, a, b, c, d, x[12], 0x6b901122, 7)
+  STEP (F, d, a, b, c, x[13], 0xfd987193, 12)
+  STEP (F, c, d, a, b, x[14], 0xa679438e, 17)
+  STEP (F, b, c, d, a, x[15], 0x49b40821, 22)
+
+  STEP (G, a, b, c, d, x[1], 0xf61e2562, 5)
+  STEP (G, d, a, b, c, x[6], 0xc040b340, 9)
+  STEP (G, c, d, a, b, x[11], 0x265e5a51, 14)
+  STEP (G, b, c, d, a, x[0], 0xe9b6c7aa, 20)
+  STEP (G, a, b, c, d, x[5], 0xd62f105d, 5)
+  STEP (G, d, a, b, c, x[10], 0x02441453, 9)
+  STEP (G, c, d, a, b, x[15], 0xd8a1e681, 14)
+  STEP (G, b, c, d, a, x[4], 0xe7d3fbc8, 20)
+  STEP (G, a, b, c, d, x[9], 0x21e1cde6, 5)
+  STEP (G, d, a, b, c, x[14], 0xc33707d6, 9)
+  STEP (G, c, d, a, b, x[3], 0xf4d50d87, 14)
+  STEP (G, b, c, d, a, x[8], 0x455a14ed, 20)
+  STEP (G, a, b, c, d, x[13], 0xa9e3e905, 5)
+  STEP (G, d, a, b, c, x[2], 0xfcefa3f8, 9)
+  STEP (G, c, d, a, b, x[7], 0x676f02d9, 14)
+  STEP (G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+  STEP (H, a, b, c, d, x[5], 0xfffa3942, 4)
+  STEP (H, d, a, b, c, x[8], 0x8771f681, 11)
+  STEP (H, c, d, a, b, x[11], 0x6d9d6122, 16)
+  STEP (H, b, c, d, a, x[14], 0xfde5380c, 23)
+  STEP (H, a, b, c, d, x[1], 0xa4beea44, 4)
+  STEP (H, d, a, b, c, x[4], 0x4bdecfa9, 11)
+  STEP (H, c, d, a, b, x[7], 0xf6bb4b60, 16)
+  STEP (H, b, c, d, a, x[10], 0xbebfbc70, 23)
+  STEP (H, a, b, c, d, x[13], 0x289b7ec6, 4)
+  STEP (H, d, a, b, c, x[0], 0xeaa127fa, 11)
+  STEP (H, c, d, a, b, x[3], 0xd4ef3085, 16)
+  STEP (H, b, c, d, a, x[6], 0x04881d05, 23)
+  STEP (H, a, b, c, d, x[9], 0xd9d4d039, 4)
+  STEP (H, d, a, b, c, x[12], 0xe6db99e5, 11)
+  STEP (H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+  STEP (H, b, c, d, a, x[2], 0xc4ac5665, 23)
+
+  STEP (I, a, b, c, d, x[0], 0xf4292244, 6)
+  STEP (I, d, a, b, c, x[7], 0x432aff97, 10)
+  STEP (I, c, d, a, b, x[14], 0xab9423a7, 15)
+  STEP (I, b, c, d, a, x[5], 0xfc93a039, 21)
+  STEP (I, a, b, c, d, x[12], 0x655b59c3, 6)
+  STEP (I, d, a, b, c, x[3], 0x8f0ccc92, 10)
+  STEP (I, c, d, a, b, x[10], 0xffeff47d, 15)
+  STEP (I, b, c, d, a, x[1], 0x85845dd1, 21)
+  STEP (I, a, b, c, d, x[8], 0x6fa87e4f, 6)
+  STEP (I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+  STEP (I, c, d, a, b, x[6], 0xa3014314, 15)
+  STEP (I, b, c, d, a, x[13], 0x4e0811a1, 21)
+  STEP (I, a, b, c, d, x[4], 0xf7537e82, 6)
+  STEP (I, d, a, b, c, x[11], 0xbd3af235, 10)
+  STEP (I, c, d, a, b, x[2], 0x2ad7d2bb, 15)
+  STEP (I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+void
+_mate_thumbnail_md5_digest (const char *data,
+			    gsize       len,
+			    guint8     *digest)
+{
+  guint32 state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  guchar block[64];
+  guint64 bits;
+  gsize rest;
+  int i;
+
+  bits = (guint64) len << 3;
+
+  for (; len >= 64; data += 64, len -= 64)
+    md5_transform (state, (const guchar *) data);
+
+  /* The tail, a 1 bit, zeros and the length in bits fill one or two
+   * more blocks */
+  rest = len;
+  memcpy (block, data, rest);
+  block[rest++] = 0x80;
+  if (rest > 56)
+    {
+      memset (block + rest, 0, 64 - rest);
+      md5_transform (state, block);
+      rest = 0;
+    }
+  memset (block + rest, 0, 56 - rest);
+  store_le32 (block + 56, (guint32) bits);
+  store_le32 (block + 60, (guint32) (bits >> 32));
+  md5_transform (state, block);
+
+  for (i = 0; i < 4; i++)
+    store_le32 (digest + 4 * i, state[i]);
+}
+
+gsize
+_mate_thumbnail_format_path (const char   *dir,
+			     const guint8 *digest,
+			     char         *buffer,
+			     gsize         buffer_size)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+  gsize dir_len, len;
+  char *p;
+  int i;
+
+  dir_len = strlen (dir);
+  len = dir_len + 1 + 32 + 4;
+  if (len >= buffer_size)
+    return len;
+
+  memcpy (buffer, dir, dir_len);
+  p = buffer + dir_len;
+  *p++ = G_DIR_SEPARATOR;
+  for (i = 0; i < 16; i++)
+    {
+      *p++ = hex_digits[digest[i] >> 4];
+      *p++ = hex_digits[digest[i] & 0xf];
+    }
+  memcpy (p, ".png", 5);
+
+  return len;
+}
+
+/**
+ * mate_thumbnail_path_for_uri_into:
+ * @uri: an uri
+ * @size: a thumbnail size
+ * @buffer: where to store the path
+ * @buffer_size: the size of @buffer in bytes
+ *
+ * Like mate_thumbnail_path_for_uri(), but stores the path in @buffer
+ * without allocating any memory. As with snprintf(), nothing is
+ * written if the path and its terminating nul byte don't fit. All
+ * paths for a given size have the same length, so a buffer of the
+ * size returned for one uri fits all others.
+ *
+ * Return value: the length of the path, not counting the nul byte.
+ *
+ * Since: 1.5
+ **/
+gsize
+mate_thumbnail_path_for_uri_into (const char        *uri,
+				  MateThumbnailSize  size,
+				  char              *buffer,
+				  gsize              buffer_size)
+{
+  const char *home_dir;
+  guint8 digest[16];
+  char dir[4096];
+  gsize home_len, dir_len;
+
+  g_return_val_if_fail (uri != NULL, 0);
+  g_return_val_if_fail (buffer != NULL || buffer_size == 0, 0);
+
+  home_dir = g_get_home_dir ();
+  home_len = strlen (home_dir);
+  /* g_build_filename() wouldn't double the separator either */
+  while (home_len > 0 && G_IS_DIR_SEPARATOR (home_dir[home_len - 1]))
+    home_len--;
+
+  /* "<home>/.thumbnails/normal" or ".../large" */
+  dir_len = home_len + strlen ("/.thumbnails/") +
+    (size == MATE_THUMBNAIL_SIZE_NORMAL ? 6 : 5);
+  if (dir_len >= sizeof (dir))
+    return dir_len + 1 + 32 + 4;
+
+  memcpy (dir, home_dir, home_len);
+  g_snprintf (dir + home_len, sizeof (dir) - home_len,
+	      G_DIR_SEPARATOR_S ".thumbnails" G_DIR_SEPARATOR_S "%s",
+	      size == MATE_THUMBNAIL_SIZE_NORMAL ? "normal" : "large");
+
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
+
+  return _mate_thumbnail_format_path (dir, digest, buffer, buffer_size);
+}
@@ -0,0 +1,485 @@
+/*
+ * mate-thumbnail-metrics.c: Counters and latency histograms
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
+
+struct _MateThumbnailStats {
+  /* Read without the lock, a stale value only loses or adds a sample */
+  volatile gboolean enabled;
+
+  GMutex *lock;
+  MateThumbnailMetrics metrics;   /* without the mime types */
+  GHashTable *mime_types;         /* mime type -> guint64 generations */
+};
+
+static const gsize counter_offsets[MATE_THUMBNAIL_N_COUNTERS] = {
+  G_STRUCT_OFFSET (MateThumbnailMetrics, lookups),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, hits),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, misses),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, stale),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, failed_hits),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, generations),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, generation_failures),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, script_spawns),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, server_requests),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, bytes_read),
+  G_STRUCT_OFFSET (MateThumbnailMetrics, bytes_written)
+};
+
+static const char *timer_names[MATE_THUMBNAIL_N_TIMERS] = {
+  "lookup", "decode", "scale", "save", "external"
+};
+
+MateThumbnailStats *
+_mate_thumbnail_stats_new (void)
+{
+  MateThumbnailStats *stats;
+
+  stats = g_new0 (MateThumbnailStats, 1);
+  stats->lock = g_mutex_new ();
+  stats->mime_types = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, g_free);
+
+  return stats;
+}
+
+void
+_mate_thumbnail_stats_free (MateThumbnailStats *stats)
+{
+  _mate_thumbnail_stats_dump_on_signal (stats, NULL, 0);
+
+  g_hash_table_destroy (stats->mime_types);
+  g_mutex_free (stats->lock);
+  g_free (stats);
+}
+
+void
+_mate_thumbnail_stats_set_enabled (MateThumbnailStats *stats,
+				   gboolean            enabled)
+{
+  stats->enabled = enabled;
+}
+
+void
+_mate_thumbnail_stats_add (MateThumbnailStats   *stats,
+			   MateThumbnailCounter  counter,
+			   guint64               n)
+{
+  if (!stats->enabled)
+    return;
+
+  g_mutex_lock (stats->lock);
+  *(guint64 *) G_STRUCT_MEMBER_P (&stats->metrics, counter_offsets[counter]) += n;
+  g_mutex_unlock (stats->lock);
+}
+
+void
+_mate_thumbnail_stats_add_mime_type (MateThumbnailStats *stats,
+				     const char         *mime_type)
+{
+  guint64 *count;
+
+  if (!stats->enabled)
+    return;
+
+  g_mutex_lock (stats->lock);
+  count = g_hash_table_lookup (stats->mime_types, mime_type);
+  if (count == NULL)
+    {
+      count = g_new0 (guint64, 1);
+      g_hash_table_insert (stats->mime_types, g_strdup (mime_type), count);
+    }
+  (*count)++;
+  g_mutex_unlock (stats->lock);
+}
+
+static guint64
+now_usec (void)
+{
+  GTimeVal now;
+
+  g_get_current_time (&now);
+
+  return (guint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+guint64
+_mate_thumbnail_stats_start (MateThumbnailStats *stats)
+{
+  if (!stats->enabled)
+    return 0;
+
+  return now_usec ();
+}
+
+void
+_mate_thumbnail_stats_stop (MateThumbnailStats *stats,
+			    MateThumbnailTimer  timer,
+			    guint64             start)
+{
+  MateThumbnailHistogram *histogram;
+  guint64 now, usec;
+  int bucket;
+
+  if (start == 0 || !stats->enabled)
+    return;
+
+  /* The clock may have been set back */
+  now = now_usec ();
+  usec = now > start ? now - start : 0;
+
+  /* Bucket i holds durations below 2^i microseconds */
+  for (bucket = 0;
+       bucket < MATE_THUMBNAIL_HISTOGRAM_BUCKETS - 1 && usec >= ((guint64) 1 << bucket);
+       bucket++)
+    ;
+
+  g_mutex_lock (stats->lock);
+  histogram = &stats->metrics.timers[timer];
+  histogram->count++;
+  histogram->total_usec += usec;
+  histogram->max_usec = MAX (histogram->max_usec, usec);
+  histogram->buckets[bucket]++;
+  g_mutex_unlock (stats->lock);
+}
+
+typedef struct {
+  MateThumbnailMetrics *metrics;
+  int i;
+} CopyMimeTypes;
+
+static void
+copy_mime_type (gpointer key,
+		gpointer value,
+		gpointer user_data)
+{
+  CopyMimeTypes *copy = user_data;
+
+  copy->metrics->mime_types[copy->i] = g_strdup (key);
+  copy->metrics->mime_type_generations[copy->i] = *(guint64 *) value;
+  copy->i++;
+}
+
+void
+_mate_thumbnail_stats_get (MateThumbnailStats   *stats,
+			   MateThumbnailMetrics *metrics)
+{
+  CopyMimeTypes copy;
+
+  g_mutex_lock (stats->lock);
+
+  *metrics = stats->metrics;
+
+  metrics->n_mime_types = g_hash_table_size (stats->mime_types);
+  metrics->mime_types = g_new0 (char *, metrics->n_mime_types + 1);
+  metrics->mime_type_generations = g_new0 (guint64, metrics->n_mime_types);
+
+  copy.metrics = metrics;
+  copy.i = 0;
+  g_hash_table_foreach (stats->mime_types, copy_mime_type, &copy);
+
+  g_mutex_unlock (stats->lock);
+}
+
+void
+_mate_thumbnail_stats_reset (MateThumbnailStats *stats)
+{
+  g_mutex_lock (stats->lock);
+  memset (&stats->metrics, 0, sizeof (MateThumbnailMetrics));
+  g_hash_table_remove_all (stats->mime_types);
+  g_mutex_unlock (stats->lock);
+}
+
+/**
+ * mate_thumbnail_metrics_clear:
+ * @metrics: metrics filled in by mate_thumbnail_factory_get_metrics()
+ *
+ * Frees the memory held by @metrics, but not @metrics itself.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_metrics_clear (MateThumbnailMetrics *metrics)
+{
+  g_return_if_fail (metrics != NULL);
+
+  g_strfreev (metrics->mime_types);
+  g_free (metrics->mime_type_generations);
+  metrics->mime_types = NULL;
+  metrics->mime_type_generations = NULL;
+  metrics->n_mime_types = 0;
+}
+
+/**
+ * mate_thumbnail_metrics_to_string:
+ * @metrics: metrics filled in by mate_thumbnail_factory_get_metrics()
+ *
+ * Formats @metrics as a few lines of text meant for people, e.g. for
+ * a log file.
+ *
+ * Return value: a newly allocated string.
+ *
+ * Since: 1.5
+ **/
+char *
+mate_thumbnail_metrics_to_string (const MateThumbnailMetrics *metrics)
+{
+  const MateThumbnailHistogram *histogram;
+  GString *str;
+  int i, bucket;
+
+  g_return_val_if_fail (metrics != NULL, NULL);
+
+  str = g_string_new (NULL);
+
+  g_string_append_printf (str,
+			  "lookups %" G_GUINT64_FORMAT ": %" G_GUINT64_FORMAT " hits, %"
+			  G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " stale; %"
+			  G_GUINT64_FORMAT " failed thumbnail hits\n",
+			  metrics->lookups, metrics->hits, metrics->misses,
+			  metrics->stale, metrics->failed_hits);
+  g_string_append_printf (str,
+			  "generations %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+			  " failed; %" G_GUINT64_FORMAT " script runs, %" G_GUINT64_FORMAT
+			  " server requests\n",
+			  metrics->generations, metrics->generation_failures,
+			  metrics->script_spawns, metrics->server_requests);
+  for (i = 0; i < metrics->n_mime_types; i++)
+    g_string_append_printf (str, "  %s: %" G_GUINT64_FORMAT "\n",
+			    metrics->mime_types[i], metrics->mime_type_generations[i]);
+  g_string_append_printf (str,
+			  "bytes read %" G_GUINT64_FORMAT ", written %" G_GUINT64_FORMAT "\n",
+			  metrics->bytes_read, metrics->bytes_written);
+
+  for (i = 0; i < MATE_THUMBNAIL_N_TIMERS; i++)
+    {
+      histogram = &metrics->timers[i];
+      if (histogram->count == 0)
+	continue;
+
+      g_string_append_printf (str,
+			      "%s: %" G_GUINT64_FORMAT " times, average %" G_GUINT64_FORMAT
+			      " us, max %" G_GUINT64_FORMAT " us\n",
+			      timer_names[i], histogram->count,
+			      histogram->total_usec / histogram->count,
+			      histogram->max_usec);
+
+      for (bucket = 0; bucket < MATE_THUMBNAIL_HISTOGRAM_BUCKETS; bucket++)
+	{
+	  if (histogram->buckets[bucket] == 0)
+	    continue;
+
+	  if (bucket == MATE_THUMBNAIL_HISTOGRAM_BUCKETS - 1)
+	    g_string_append_printf (str, "  >= %" G_GUINT64_FORMAT " us",
+				    (guint64) 1 << (bucket - 1));
+	  else
+	    g_string_append_printf (str, "  < %" G_GUINT64_FORMAT " us",
+				    (guint64) 1 << bucket);
+	  g_string_append_printf (str, ": %" G_GUINT64_FORMAT "\n",
+				  histogram->buckets[bucket]);
+	}
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/* Signals only write their number to a pipe; the dump happens in the
+ * main loop, where it is safe to take locks and allocate */
+
+typedef struct {
+  MateThumbnailStats *stats;
+  char *name;
+  int signum;
+} DumpRequest;
+
+typedef struct {
+  int signum;
+  struct sigaction old_action;
+} InstalledSignal;
+
+G_LOCK_DEFINE_STATIC (dump);
+static GSList *dump_requests = NULL;     /* DumpRequest */
+static GSList *installed_signals = NULL; /* InstalledSignal */
+static int dump_pipe[2] = { -1, -1 };
+
+static void
+dump_signal_handler (int signum)
+{
+  guchar byte = signum;
+  int saved_errno = errno;
+
+  if (write (dump_pipe[1], &byte, 1) == -1)
+    ; /* Nothing to do, the pipe is full of requests already */
+
+  errno = saved_errno;
+}
+
+static gboolean
+dump_pipe_readable (GIOChannel   *source,
+		    GIOCondition  condition,
+		    gpointer      data)
+{
+  MateThumbnailMetrics metrics;
+  DumpRequest *request;
+  guchar byte;
+  GSList *l;
+  char *str;
+
+  while (read (dump_pipe[0], &byte, 1) == 1)
+    {
+      G_LOCK (dump);
+      for (l = dump_requests; l != NULL; l = l->next)
+	{
+	  request = l->data;
+	  if (request->signum != byte)
+	    continue;
+
+	  _mate_thumbnail_stats_get (request->stats, &metrics);
+	  str = mate_thumbnail_metrics_to_string (&metrics);
+	  g_printerr ("Thumbnail metrics for %s:\n%s", request->name, str);
+	  g_free (str);
+	  mate_thumbnail_metrics_clear (&metrics);
+	}
+      G_UNLOCK (dump);
+    }
+
+  return TRUE;
+}
+
+/* Called with the dump lock held */
+static gboolean
+install_signal (int signum)
+{
+  InstalledSignal *installed;
+  struct sigaction action;
+  GIOChannel *channel;
+  GSList *l;
+
+  for (l = installed_signals; l != NULL; l = l->next)
+    if (((InstalledSignal *) l->data)->signum == signum)
+      return TRUE;
+
+  if (dump_pipe[0] == -1)
+    {
+      if (pipe (dump_pipe) != 0)
+	return FALSE;
+
+      fcntl (dump_pipe[0], F_SETFL, O_NONBLOCK);
+      fcntl (dump_pipe[1], F_SETFL, O_NONBLOCK);
+      fcntl (dump_pipe[0], F_SETFD, FD_CLOEXEC);
+      fcntl (dump_pipe[1], F_SETFD, FD_CLOEXEC);
+
+      channel = g_io_channel_unix_new (dump_pipe[0]);
+      g_io_add_watch (channel, G_IO_IN, dump_pipe_readable, NULL);
+      g_io_channel_unref (channel);
+    }
+
+  installed = g_new0 (InstalledSignal, 1);
+  installed->signum = signum;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = dump_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset (&action.sa_mask);
+
+  if (sigaction (signum, &action, &installed->old_action) != 0)
+    {
+      g_free (installed);
+      return FALSE;
+    }
+
+  installed_signals = g_slist_prepend (installed_signals, installed);
+
+  return TRUE;
+}
+
+/* Called with the dump lock held; gives the signal back to whoever had
+ * it once nobody wants it anymore */
+static void
+uninstall_unused_signals (void)
+{
+  InstalledSignal *installed;
+  GSList *l, *next, *r;
+
+  for (l = installed_signals; l != NULL; l = next)
+    {
+      next = l->next;
+      installed = l->data;
+
+      for (r = dump_requests; r != NULL; r = r->next)
+	if (((DumpRequest *) r->data)->signum == installed->signum)
+	  break;
+      if (r != NULL)
+	continue;
+
+      sigaction (installed->signum, &installed->old_action, NULL);
+      installed_signals = g_slist_delete_link (installed_signals, l);
+      g_free (installed);
+    }
+}
+
+void
+_mate_thumbnail_stats_dump_on_signal (MateThumbnailStats *stats,
+				      const char         *name,
+				      int                 signum)
+{
+  DumpRequest *request;
+  GSList *l;
+
+  G_LOCK (dump);
+
+  for (l = dump_requests; l != NULL; l = l->next)
+    {
+      request = l->data;
+      if (request->stats == stats)
+	{
+	  dump_requests = g_slist_delete_link (dump_requests, l);
+	  g_free (request->name);
+	  g_free (request);
+	  break;
+	}
+    }
+
+  if (signum > 0 && signum < 256 && install_signal (signum))
+    {
+      request = g_new0 (DumpRequest, 1);
+      request->stats = stats;
+      request->name = g_strdup (name);
+      request->signum = signum;
+      dump_requests = g_slist_prepend (dump_requests, request);
+    }
+
+  uninstall_unused_signals ();
+
+  G_UNLOCK (dump);
+}
@@ -27,33 +27,38 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
 
 #define LOAD_BUFFER_SIZE 65536
 
-/**
- * mate_thumbnail_scale_down_pixbuf:
- * @pixbuf: a #GdkPixbuf
- * @dest_width: the desired new width
- * @dest_height: the desired new height
- *
- * Scales the pixbuf to the desired size. This function
- * is a lot faster than gdk-pixbuf when scaling down by
- * large amounts.
+/* Below this many source pixels starting threads costs more than it saves */
+#define THREADED_SCALE_THRESHOLD (4 * 1024 * 1024)
+
+/* Scales the source rows [s_y1, s_y_end[ into dest_pixbuf starting
+ * at dest_row. s_yfrac is the error term of the row stepping at s_y1,
+ * which is -dest_height/2 at the top of the image.
  *
- * Return value: a scaled pixbuf
- * 
- * Since: 2.2
- **/
-GdkPixbuf *
-mate_thumbnail_scale_down_pixbuf (GdkPixbuf *pixbuf,
-				   int dest_width,
-				   int dest_height)
+ * Reference implementation, the vectorized paths below must produce
+ * exactly the same output. */
+static void
+scale_down_rows_scalar (GdkPixbuf *pixbuf,
+			GdkPixbuf *dest_pixbuf,
+			int dest_row,
+			int s_y1,
+			int s_yfrac,
+			int s_y_end)
 {
 	int source_width, source_height;
-	int s_x1, s_y1, s_x2, s_y2;
-	int s_xfrac, s_yfrac;
+	int dest_width, dest_height;
+	int s_x1, s_x2, s_y2;
+	int s_xfrac;
 	int dx, dx_frac, dy, dy_frac;
 	div_t ddx, ddy;
 	int x, y;
@@ -61,19 +66,13 @@ mate_thumbnail_scale_down_pixbuf (GdkPixbuf *pixbuf,
 	int n_pixels;
 	gboolean has_alpha;
 	guchar *dest, *src, *xsrc, *src_pixels;
-	GdkPixbuf *dest_pixbuf;
 	int pixel_stride;
 	int source_rowstride, dest_rowstride;
 
-	if (dest_width == 0 || dest_height == 0) {
-		return NULL;
-	}
-	
 	source_width = gdk_pixbuf_get_width (pixbuf);
 	source_height = gdk_pixbuf_get_height (pixbuf);
-
-	g_assert (source_width >= dest_width);
-	g_assert (source_height >= dest_height);
+	dest_width = gdk_pixbuf_get_width (dest_pixbuf);
+	dest_height = gdk_pixbuf_get_height (dest_pixbuf);
 
 	ddx = div (source_width, dest_width);
 	dx = ddx.quot;
@@ -87,16 +86,12 @@ mate_thumbnail_scale_down_pixbuf (GdkPixbuf *pixbuf,
 	source_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
 	src_pixels = gdk_pixbuf_get_pixels (pixbuf);
 
-	dest_pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8,
-				      dest_width, dest_height);
-	dest = gdk_pixbuf_get_pixels (dest_pixbuf);
 	dest_rowstride = gdk_pixbuf_get_rowstride (dest_pixbuf);
+	dest = gdk_pixbuf_get_pixels (dest_pixbuf) + dest_row * dest_rowstride;
 
 	pixel_stride = (has_alpha)?4:3;
 	
-	s_y1 = 0;
-	s_yfrac = -dest_height/2;
-	while (s_y1 < source_height) {
+	while (s_y1 < s_y_end) {
 		s_y2 = s_y1 + dy;
 		s_yfrac += dy_frac;
 		if (s_yfrac > 0) {
@@ -165,7 +160,665 @@ mate_thumbnail_scale_down_pixbuf (GdkPixbuf *pixbuf,
 		s_y1 = s_y2;
 		dest += dest_rowstride - dest_width * pixel_stride;
 	}
-	
+}
+
+
+
+/* The vectorized paths sum each band of source rows into per-column
+ * accumulators first, which is where nearly all of the time goes, and
+ * then average the columns of every block. Integer addition being
+ * associative this gives the same sums as the scalar code. */
+
+typedef void (* AccumulateRowFunc) (const guchar *src,
+				    guint32 *acc,
+				    int n);
+
+/* acc[i] += src[i] for the n bytes of an RGB row */
+static void
+accumulate_row (const guchar *src,
+		guint32 *acc,
+		int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] += src[i];
+}
+
+/* Same for the n pixels of an RGBA row, premultiplying by alpha */
+static void
+accumulate_row_alpha (const guchar *src,
+		      guint32 *acc,
+		      int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		acc[0] += src[3] * src[0];
+		acc[1] += src[3] * src[1];
+		acc[2] += src[3] * src[2];
+		acc[3] += src[3];
+		src += 4;
+		acc += 4;
+	}
+}
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+
+#define ACC_ADD_128(p, v) \
+	_mm_storeu_si128 ((__m128i *) (p), \
+			  _mm_add_epi32 (_mm_loadu_si128 ((const __m128i *) (p)), (v)))
+#define ACC_ADD_256(p, v) \
+	_mm256_storeu_si256 ((__m256i *) (p), \
+			     _mm256_add_epi32 (_mm256_loadu_si256 ((const __m256i *) (p)), (v)))
+
+__attribute__ ((target ("sse2"))) static void
+accumulate_row_sse2 (const guchar *src,
+		     guint32 *acc,
+		     int n)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i v, lo, hi;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *) (src + i));
+		lo = _mm_unpacklo_epi8 (v, zero);
+		hi = _mm_unpackhi_epi8 (v, zero);
+		ACC_ADD_128 (acc + i, _mm_unpacklo_epi16 (lo, zero));
+		ACC_ADD_128 (acc + i + 4, _mm_unpackhi_epi16 (lo, zero));
+		ACC_ADD_128 (acc + i + 8, _mm_unpacklo_epi16 (hi, zero));
+		ACC_ADD_128 (acc + i + 12, _mm_unpackhi_epi16 (hi, zero));
+	}
+
+	accumulate_row (src + i, acc + i, n - i);
+}
+
+__attribute__ ((target ("sse2"))) static void
+accumulate_row_alpha_sse2 (const guchar *src,
+			   guint32 *acc,
+			   int n)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	/* Multiply r, g, b by alpha and alpha by one */
+	const __m128i rgb_mask = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha_one = _mm_set_epi16 (1, 0, 0, 0, 1, 0, 0, 0);
+	__m128i v, p, a;
+	int i, half;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128 ((const __m128i *) (src + 4 * i));
+
+		for (half = 0; half < 2; half++) {
+			p = half ? _mm_unpackhi_epi8 (v, zero) : _mm_unpacklo_epi8 (v, zero);
+			a = _mm_shufflelo_epi16 (p, _MM_SHUFFLE (3, 3, 3, 3));
+			a = _mm_shufflehi_epi16 (a, _MM_SHUFFLE (3, 3, 3, 3));
+			a = _mm_or_si128 (_mm_and_si128 (a, rgb_mask), alpha_one);
+			/* 255 * 255 still fits in 16 bits */
+			p = _mm_mullo_epi16 (p, a);
+			ACC_ADD_128 (acc + 4 * i + 8 * half, _mm_unpacklo_epi16 (p, zero));
+			ACC_ADD_128 (acc + 4 * i + 8 * half + 4, _mm_unpackhi_epi16 (p, zero));
+		}
+	}
+
+	accumulate_row_alpha (src + 4 * i, acc + 4 * i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+accumulate_row_avx2 (const guchar *src,
+		     guint32 *acc,
+		     int n)
+{
+	int i, k;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		for (k = 0; k < 32; k += 8)
+			ACC_ADD_256 (acc + i + k,
+				     _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (src + i + k))));
+	}
+
+	accumulate_row (src + i, acc + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+accumulate_row_alpha_avx2 (const guchar *src,
+			   guint32 *acc,
+			   int n)
+{
+	const __m256i rgb_mask = _mm256_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1,
+						   0, -1, -1, -1, 0, -1, -1, -1);
+	const __m256i alpha_one = _mm256_set_epi16 (1, 0, 0, 0, 1, 0, 0, 0,
+						    1, 0, 0, 0, 1, 0, 0, 0);
+	__m256i p, a;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		p = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *) (src + 4 * i)));
+		a = _mm256_shufflelo_epi16 (p, _MM_SHUFFLE (3, 3, 3, 3));
+		a = _mm256_shufflehi_epi16 (a, _MM_SHUFFLE (3, 3, 3, 3));
+		a = _mm256_or_si256 (_mm256_and_si256 (a, rgb_mask), alpha_one);
+		p = _mm256_mullo_epi16 (p, a);
+		ACC_ADD_256 (acc + 4 * i, _mm256_cvtepu16_epi32 (_mm256_castsi256_si128 (p)));
+		ACC_ADD_256 (acc + 4 * i + 8, _mm256_cvtepu16_epi32 (_mm256_extracti128_si256 (p, 1)));
+	}
+
+	accumulate_row_alpha (src + 4 * i, acc + 4 * i, n - i);
+}
+
+#endif /* HAVE_X86_SIMD_DISPATCH */
+
+/* Averages the column sums of n_rows source rows into one dest row */
+static void
+average_columns (const guint32 *acc,
+		 guchar *dest,
+		 int source_width,
+		 int dest_width,
+		 gboolean has_alpha,
+		 int n_rows)
+{
+	int s_x1, s_x2;
+	int s_xfrac;
+	int dx, dx_frac;
+	div_t ddx;
+	int x;
+	int r, g, b, a;
+	int n_pixels;
+	int pixel_stride;
+	const guint32 *xacc;
+
+	ddx = div (source_width, dest_width);
+	dx = ddx.quot;
+	dx_frac = ddx.rem;
+
+	pixel_stride = (has_alpha)?4:3;
+
+	s_x1 = 0;
+	s_xfrac = -dest_width/2;
+	while (s_x1 < source_width) {
+		s_x2 = s_x1 + dx;
+		s_xfrac += dx_frac;
+		if (s_xfrac > 0) {
+			s_x2++;
+			s_xfrac -= dest_width;
+		}
+
+		r = g = b = a = 0;
+		xacc = acc + s_x1 * pixel_stride;
+		for (x = s_x1; x < s_x2; x++) {
+			r += xacc[0];
+			g += xacc[1];
+			b += xacc[2];
+			if (has_alpha)
+				a += xacc[3];
+			xacc += pixel_stride;
+		}
+		n_pixels = (s_x2 - s_x1) * n_rows;
+
+		if (has_alpha) {
+			if (a != 0) {
+				*dest++ = r / a;
+				*dest++ = g / a;
+				*dest++ = b / a;
+				*dest++ = a / n_pixels;
+			} else {
+				*dest++ = 0;
+				*dest++ = 0;
+				*dest++ = 0;
+				*dest++ = 0;
+			}
+		} else {
+			*dest++ = r / n_pixels;
+			*dest++ = g / n_pixels;
+			*dest++ = b / n_pixels;
+		}
+
+		s_x1 = s_x2;
+	}
+}
+
+static void
+scale_down_rows_accumulated (GdkPixbuf *pixbuf,
+			     GdkPixbuf *dest_pixbuf,
+			     int dest_row,
+			     int s_y1,
+			     int s_yfrac,
+			     int s_y_end,
+			     AccumulateRowFunc accumulate)
+{
+	int source_width, source_height;
+	int dest_width, dest_height;
+	int s_y2;
+	int dy, dy_frac;
+	div_t ddy;
+	int y;
+	gboolean has_alpha;
+	guchar *dest, *src, *src_pixels;
+	guint32 *acc;
+	int pixel_stride, row_length;
+	int source_rowstride, dest_rowstride;
+
+	source_width = gdk_pixbuf_get_width (pixbuf);
+	source_height = gdk_pixbuf_get_height (pixbuf);
+	dest_width = gdk_pixbuf_get_width (dest_pixbuf);
+	dest_height = gdk_pixbuf_get_height (dest_pixbuf);
+
+	ddy = div (source_height, dest_height);
+	dy = ddy.quot;
+	dy_frac = ddy.rem;
+
+	has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+	source_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	src_pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+	dest_rowstride = gdk_pixbuf_get_rowstride (dest_pixbuf);
+	dest = gdk_pixbuf_get_pixels (dest_pixbuf) + dest_row * dest_rowstride;
+
+	pixel_stride = (has_alpha)?4:3;
+	/* The alpha kernels count pixels, the RGB ones bytes */
+	row_length = (has_alpha)?source_width:source_width * 3;
+
+	acc = g_new (guint32, source_width * pixel_stride);
+
+	while (s_y1 < s_y_end) {
+		s_y2 = s_y1 + dy;
+		s_yfrac += dy_frac;
+		if (s_yfrac > 0) {
+			s_y2++;
+			s_yfrac -= dest_height;
+		}
+
+		memset (acc, 0, source_width * pixel_stride * sizeof (guint32));
+		src = src_pixels + s_y1 * source_rowstride;
+		for (y = s_y1; y < s_y2; y++) {
+			accumulate (src, acc, row_length);
+			src += source_rowstride;
+		}
+
+		average_columns (acc, dest, source_width, dest_width,
+				 has_alpha, s_y2 - s_y1);
+
+		s_y1 = s_y2;
+		dest += dest_rowstride;
+	}
+
+	g_free (acc);
+}
+
+MateThumbnailSimdLevel
+_mate_thumbnail_get_simd_level (void)
+{
+	static int level = -1;
+
+	/* Racing threads all compute the same value */
+	if (level < 0) {
+		level = MATE_THUMBNAIL_SIMD_NONE;
+#ifdef HAVE_X86_SIMD_DISPATCH
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports ("avx2"))
+			level = MATE_THUMBNAIL_SIMD_AVX2;
+		else if (__builtin_cpu_supports ("sse2"))
+			level = MATE_THUMBNAIL_SIMD_SSE2;
+#endif
+	}
+
+	return level;
+}
+
+static AccumulateRowFunc
+get_accumulate_func (MateThumbnailSimdLevel level,
+		     gboolean has_alpha)
+{
+	switch (level) {
+#ifdef HAVE_X86_SIMD_DISPATCH
+	case MATE_THUMBNAIL_SIMD_AVX2:
+		return has_alpha ? accumulate_row_alpha_avx2 : accumulate_row_avx2;
+	case MATE_THUMBNAIL_SIMD_SSE2:
+		return has_alpha ? accumulate_row_alpha_sse2 : accumulate_row_sse2;
+#endif
+	default:
+		return has_alpha ? accumulate_row_alpha : accumulate_row;
+	}
+}
+
+static void
+scale_down_rows (GdkPixbuf *pixbuf,
+		 GdkPixbuf *dest_pixbuf,
+		 MateThumbnailSimdLevel level,
+		 int dest_row,
+		 int s_y1,
+		 int s_yfrac,
+		 int s_y_end)
+{
+	if (level == MATE_THUMBNAIL_SIMD_NONE)
+		scale_down_rows_scalar (pixbuf, dest_pixbuf, dest_row, s_y1, s_yfrac, s_y_end);
+	else
+		scale_down_rows_accumulated (pixbuf, dest_pixbuf, dest_row, s_y1, s_yfrac, s_y_end,
+					     get_accumulate_func (level, gdk_pixbuf_get_has_alpha (pixbuf)));
+}
+
+GdkPixbuf *
+_mate_thumbnail_scale_down_pixbuf_for_level (GdkPixbuf *pixbuf,
+					     int dest_width,
+					     int dest_height,
+					     MateThumbnailSimdLevel level)
+{
+	GdkPixbuf *dest_pixbuf;
+
+	if (dest_width == 0 || dest_height == 0) {
+		return NULL;
+	}
+
+	g_assert (gdk_pixbuf_get_width (pixbuf) >= dest_width);
+	g_assert (gdk_pixbuf_get_height (pixbuf) >= dest_height);
+
+	dest_pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+				      gdk_pixbuf_get_has_alpha (pixbuf), 8,
+				      dest_width, dest_height);
+
+	scale_down_rows (pixbuf, dest_pixbuf, level,
+			 0, 0, -dest_height/2, gdk_pixbuf_get_height (pixbuf));
+
 	return dest_pixbuf;
 }
 
+/**
+ * mate_thumbnail_scale_down_pixbuf:
+ * @pixbuf: a #GdkPixbuf
+ * @dest_width: the desired new width
+ * @dest_height: the desired new height
+ *
+ * Scales the pixbuf to the desired size. This function
+ * is a lot faster than gdk-pixbuf when scaling down by
+ * large amounts.
+ *
+ * Return value: a scaled pixbuf
+ * 
+ * Since: 2.2
+ **/
+GdkPixbuf *
+mate_thumbnail_scale_down_pixbuf (GdkPixbuf *pixbuf,
+				   int dest_width,
+				   int dest_height)
+{
+	return _mate_thumbnail_scale_down_pixbuf_for_level (pixbuf,
+							    dest_width,
+							    dest_height,
+							    _mate_thumbnail_get_simd_level ());
+}
+
+struct _MateThumbnailScaler {
+	int source_width;
+	int source_height;
+	gboolean has_alpha;
+	GdkPixbuf *dest_pixbuf;
+	AccumulateRowFunc accumulate;
+	guint32 *acc;
+
+	int dy, dy_frac;
+	int s_y1, s_y2, s_yfrac;  /* source rows of the current dest row */
+	int row;                  /* next source row to be pushed */
+	int dest_row;
+};
+
+static void
+scaler_next_band (MateThumbnailScaler *scaler)
+{
+	int dest_height;
+
+	dest_height = gdk_pixbuf_get_height (scaler->dest_pixbuf);
+
+	scaler->s_y1 = scaler->s_y2;
+	scaler->s_y2 = scaler->s_y1 + scaler->dy;
+	scaler->s_yfrac += scaler->dy_frac;
+	if (scaler->s_yfrac > 0) {
+		scaler->s_y2++;
+		scaler->s_yfrac -= dest_height;
+	}
+}
+
+MateThumbnailScaler *
+_mate_thumbnail_scaler_new (int source_width,
+			    int source_height,
+			    gboolean has_alpha,
+			    int dest_width,
+			    int dest_height)
+{
+	MateThumbnailScaler *scaler;
+	div_t ddy;
+
+	g_return_val_if_fail (dest_width > 0 && dest_height > 0, NULL);
+	g_return_val_if_fail (source_width >= dest_width, NULL);
+	g_return_val_if_fail (source_height >= dest_height, NULL);
+
+	scaler = g_new0 (MateThumbnailScaler, 1);
+	scaler->source_width = source_width;
+	scaler->source_height = source_height;
+	scaler->has_alpha = has_alpha;
+	scaler->dest_pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8,
+					      dest_width, dest_height);
+	scaler->accumulate = get_accumulate_func (_mate_thumbnail_get_simd_level (),
+						  has_alpha);
+	scaler->acc = g_new0 (guint32, source_width * (has_alpha ? 4 : 3));
+
+	ddy = div (source_height, dest_height);
+	scaler->dy = ddy.quot;
+	scaler->dy_frac = ddy.rem;
+	scaler->s_yfrac = -dest_height/2;
+	scaler_next_band (scaler);
+
+	return scaler;
+}
+
+void
+_mate_thumbnail_scaler_push_row (MateThumbnailScaler *scaler,
+				 const guchar *row)
+{
+	int dest_width, pixel_stride;
+	guchar *dest;
+
+	g_return_if_fail (scaler->row < scaler->source_height);
+
+	pixel_stride = scaler->has_alpha ? 4 : 3;
+
+	scaler->accumulate (row, scaler->acc,
+			    scaler->has_alpha ? scaler->source_width : scaler->source_width * 3);
+	scaler->row++;
+
+	if (scaler->row == scaler->s_y2) {
+		dest_width = gdk_pixbuf_get_width (scaler->dest_pixbuf);
+		dest = gdk_pixbuf_get_pixels (scaler->dest_pixbuf) +
+			scaler->dest_row * gdk_pixbuf_get_rowstride (scaler->dest_pixbuf);
+
+		average_columns (scaler->acc, dest, scaler->source_width, dest_width,
+				 scaler->has_alpha, scaler->s_y2 - scaler->s_y1);
+		scaler->dest_row++;
+
+		memset (scaler->acc, 0,
+			scaler->source_width * pixel_stride * sizeof (guint32));
+		scaler_next_band (scaler);
+	}
+}
+
+GdkPixbuf *
+_mate_thumbnail_scaler_finish (MateThumbnailScaler *scaler)
+{
+	if (scaler->row < scaler->source_height)
+		return NULL;
+
+	return g_object_ref (scaler->dest_pixbuf);
+}
+
+void
+_mate_thumbnail_scaler_free (MateThumbnailScaler *scaler)
+{
+	g_object_unref (scaler->dest_pixbuf);
+	g_free (scaler->acc);
+	g_free (scaler);
+}
+
+typedef struct {
+	GMutex *lock;
+	GCond *cond;
+	int pending;
+} ScaleJob;
+
+typedef struct {
+	ScaleJob *job;
+	GdkPixbuf *pixbuf;
+	GdkPixbuf *dest_pixbuf;
+	MateThumbnailSimdLevel level;
+	int dest_row;
+	int s_y1;
+	int s_yfrac;
+	int s_y_end;
+} ScaleBand;
+
+G_LOCK_DEFINE_STATIC (scale_pool);
+static GThreadPool *scale_pool = NULL;
+
+static void
+scale_band_run (ScaleBand *band)
+{
+	scale_down_rows (band->pixbuf, band->dest_pixbuf, band->level,
+			 band->dest_row, band->s_y1, band->s_yfrac, band->s_y_end);
+}
+
+static void
+scale_band_thread_func (gpointer data,
+			gpointer user_data)
+{
+	ScaleBand *band = data;
+	ScaleJob *job = band->job;
+
+	scale_band_run (band);
+
+	g_mutex_lock (job->lock);
+	job->pending--;
+	if (job->pending == 0)
+		g_cond_signal (job->cond);
+	g_mutex_unlock (job->lock);
+}
+
+int
+_mate_thumbnail_get_n_processors (void)
+{
+	long n = -1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+	return n > 0 ? (int) n : 1;
+}
+
+/**
+ * mate_thumbnail_scale_down_pixbuf_threaded:
+ * @pixbuf: a #GdkPixbuf
+ * @dest_width: the desired new width
+ * @dest_height: the desired new height
+ * @n_threads: the number of threads to use, or 0 for one per processor
+ *
+ * Like mate_thumbnail_scale_down_pixbuf(), but splits the destination
+ * into horizontal bands that are scaled in parallel. The result is
+ * identical to that of mate_thumbnail_scale_down_pixbuf(). Small images
+ * are scaled in the calling thread.
+ *
+ * The GLib thread system must be initialized before calling this.
+ *
+ * Return value: a scaled pixbuf
+ *
+ * Since: 1.5
+ **/
+GdkPixbuf *
+mate_thumbnail_scale_down_pixbuf_threaded (GdkPixbuf *pixbuf,
+					    int dest_width,
+					    int dest_height,
+					    int n_threads)
+{
+	int source_width, source_height;
+	int s_y1, s_yfrac, dest_row, end_row;
+	int i, n_bands;
+	div_t ddy;
+	GdkPixbuf *dest_pixbuf;
+	ScaleBand *bands;
+	ScaleJob job;
+
+	if (dest_width == 0 || dest_height == 0) {
+		return NULL;
+	}
+
+	source_width = gdk_pixbuf_get_width (pixbuf);
+	source_height = gdk_pixbuf_get_height (pixbuf);
+
+	if (n_threads <= 0)
+		n_threads = _mate_thumbnail_get_n_processors ();
+	n_bands = MIN (n_threads, dest_height);
+
+	if (n_bands < 2 ||
+	    (gint64) source_width * source_height < THREADED_SCALE_THRESHOLD)
+		return mate_thumbnail_scale_down_pixbuf (pixbuf, dest_width, dest_height);
+
+	g_assert (source_width >= dest_width);
+	g_assert (source_height >= dest_height);
+
+	G_LOCK (scale_pool);
+	if (scale_pool == NULL)
+		scale_pool = g_thread_pool_new (scale_band_thread_func, NULL,
+						_mate_thumbnail_get_n_processors (),
+						FALSE, NULL);
+	G_UNLOCK (scale_pool);
+
+	dest_pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+				      gdk_pixbuf_get_has_alpha (pixbuf), 8,
+				      dest_width, dest_height);
+
+	job.lock = g_mutex_new ();
+	job.cond = g_cond_new ();
+	job.pending = n_bands - 1;
+
+	/* Step through the source rows the same way the scaler does, so
+	 * that every band starts where the previous one ended. */
+	ddy = div (source_height, dest_height);
+	s_y1 = 0;
+	s_yfrac = -dest_height/2;
+	dest_row = 0;
+
+	bands = g_new (ScaleBand, n_bands);
+	for (i = 0; i < n_bands; i++) {
+		bands[i].job = &job;
+		bands[i].pixbuf = pixbuf;
+		bands[i].dest_pixbuf = dest_pixbuf;
+		bands[i].level = _mate_thumbnail_get_simd_level ();
+		bands[i].dest_row = dest_row;
+		bands[i].s_y1 = s_y1;
+		bands[i].s_yfrac = s_yfrac;
+
+		end_row = (gint64) dest_height * (i + 1) / n_bands;
+		for (; dest_row < end_row; dest_row++) {
+			s_y1 += ddy.quot;
+			s_yfrac += ddy.rem;
+			if (s_yfrac > 0) {
+				s_y1++;
+				s_yfrac -= dest_height;
+			}
+		}
+		bands[i].s_y_end = s_y1;
+	}
+
+	for (i = 1; i < n_bands; i++)
+		g_thread_pool_push (scale_pool, &bands[i], NULL);
+
+	/* Do a share of the work instead of just waiting */
+	scale_band_run (&bands[0]);
+
+	g_mutex_lock (job.lock);
+	while (job.pending > 0)
+		g_cond_wait (job.cond, job.lock);
+	g_mutex_unlock (job.lock);
+
+	g_mutex_free (job.lock);
+	g_cond_free (job.cond);
+	g_free (bands);
+
+	return dest_pixbuf;
+}
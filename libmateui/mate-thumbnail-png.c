@@ -0,0 +1,922 @@
+/*
+ * mate-thumbnail-png.c: Minimal PNG chunk access and decoding for
+ * thumbnails
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#include <setjmp.h>
+#endif
+
+#include "mate-thumbnail-private.h"
+
+/* Text chunks larger than this are certainly not ours; skip them */
+#define MAX_TEXT_CHUNK_SIZE (256 * 1024)
+
+#define WRITE_BUFFER_SIZE 8192
+#define IDAT_SIZE 32768
+
+static const guchar png_signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+static guint32
+read_uint32_be (const guchar *p)
+{
+  return ((guint32) p[0] << 24) | ((guint32) p[1] << 16) |
+    ((guint32) p[2] << 8) | (guint32) p[3];
+}
+
+static int
+find_key (const char * const *keys,
+	  const char         *keyword,
+	  gsize               keyword_len)
+{
+  int i;
+
+  for (i = 0; keys[i] != NULL; i++)
+    {
+      if (strlen (keys[i]) == keyword_len &&
+	  memcmp (keys[i], keyword, keyword_len) == 0)
+	return i;
+    }
+
+  return -1;
+}
+
+/* tEXt: keyword \0 latin1-text */
+static char *
+parse_text_chunk (const char *data,
+		  gsize       len,
+		  const char *value_start)
+{
+  const char *end = data + len;
+  const char *p;
+
+  for (p = value_start; p < end; p++)
+    {
+      if ((guchar) *p >= 0x80)
+	return g_convert (value_start, end - value_start,
+			  "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+    }
+
+  return g_strndup (value_start, end - value_start);
+}
+
+/* iTXt: keyword \0 compression-flag method lang \0 translated-keyword \0 utf8-text */
+static char *
+parse_itxt_chunk (const char *data,
+		  gsize       len,
+		  const char *value_start)
+{
+  const char *end = data + len;
+  const char *p;
+
+  if (end - value_start < 2)
+    return NULL;
+
+  /* Compressed text is never written by us, don't bother inflating it */
+  if (value_start[0] != 0)
+    return NULL;
+
+  p = value_start + 2;
+  p = memchr (p, 0, end - p);
+  if (p == NULL)
+    return NULL;
+  p++;
+  p = memchr (p, 0, end - p);
+  if (p == NULL)
+    return NULL;
+  p++;
+
+  if (!g_utf8_validate (p, end - p, NULL))
+    return NULL;
+
+  return g_strndup (p, end - p);
+}
+
+gboolean
+_mate_thumbnail_png_read_text (const char         *path,
+			       const char * const *keys,
+			       char              **values)
+{
+  FILE *f;
+  gboolean res;
+
+  f = g_fopen (path, "rb");
+  if (f == NULL)
+    {
+      while (*keys++ != NULL)
+	*values++ = NULL;
+      return FALSE;
+    }
+
+  res = _mate_thumbnail_png_read_text_from_file (f, keys, values);
+  fclose (f);
+
+  return res;
+}
+
+gboolean
+_mate_thumbnail_png_read_text_from_file (FILE               *f,
+					 const char * const *keys,
+					 char              **values)
+{
+  guchar header[8];
+  char *data;
+  const char *nul;
+  guint32 length;
+  gboolean is_itxt, first;
+  int i, n_keys, n_found;
+
+  for (n_keys = 0; keys[n_keys] != NULL; n_keys++)
+    values[n_keys] = NULL;
+
+  if (fread (header, 1, 8, f) != 8 ||
+      memcmp (header, png_signature, 8) != 0)
+    return FALSE;
+
+  n_found = 0;
+  first = TRUE;
+  while (n_found < n_keys)
+    {
+      if (fread (header, 1, 8, f) != 8)
+	goto truncated;
+
+      length = read_uint32_be (header);
+      if (length > G_MAXINT32)
+	goto truncated;
+
+      /* The first chunk must be IHDR, and there is no text in the
+       * image data or after it that we care about. */
+      if (first && memcmp (header + 4, "IHDR", 4) != 0)
+	goto truncated;
+      first = FALSE;
+
+      if (memcmp (header + 4, "IDAT", 4) == 0 ||
+	  memcmp (header + 4, "IEND", 4) == 0)
+	break;
+
+      is_itxt = memcmp (header + 4, "iTXt", 4) == 0;
+      if ((is_itxt || memcmp (header + 4, "tEXt", 4) == 0) &&
+	  length <= MAX_TEXT_CHUNK_SIZE)
+	{
+	  data = g_malloc (length);
+	  if (fread (data, 1, length, f) != length)
+	    {
+	      g_free (data);
+	      goto truncated;
+	    }
+
+	  nul = memchr (data, 0, length);
+	  if (nul != NULL)
+	    {
+	      i = find_key (keys, data, nul - data);
+	      if (i >= 0 && values[i] == NULL)
+		{
+		  if (is_itxt)
+		    values[i] = parse_itxt_chunk (data, length, nul + 1);
+		  else
+		    values[i] = parse_text_chunk (data, length, nul + 1);
+		  if (values[i] != NULL)
+		    n_found++;
+		}
+	    }
+	  g_free (data);
+
+	  /* Skip the CRC */
+	  if (fseek (f, 4, SEEK_CUR) != 0)
+	    goto truncated;
+	}
+      else if (fseek (f, (long) length + 4, SEEK_CUR) != 0)
+	goto truncated;
+    }
+
+  return TRUE;
+
+ truncated:
+  for (i = 0; i < n_keys; i++)
+    {
+      g_free (values[i]);
+      values[i] = NULL;
+    }
+  return FALSE;
+}
+
+gboolean
+_mate_thumbnail_png_is_valid (const char *path,
+			      const char *uri,
+			      time_t      mtime,
+			      gboolean   *stale)
+{
+  static const char * const keys[] = { "Thumb::URI", "Thumb::MTime", NULL };
+  char *values[2];
+  gboolean res;
+
+  if (stale != NULL)
+    *stale = FALSE;
+
+  if (!_mate_thumbnail_png_read_text (path, keys, values))
+    return FALSE;
+
+  res = values[0] != NULL && strcmp (uri, values[0]) == 0 &&
+    values[1] != NULL && atol (values[1]) == mtime;
+
+  if (stale != NULL)
+    *stale = !res;
+
+  g_free (values[0]);
+  g_free (values[1]);
+
+  return res;
+}
+
+static gboolean
+write_all (int           fd,
+	   const guchar *data,
+	   gsize         len)
+{
+  gssize res;
+
+  while (len > 0)
+    {
+      res = write (fd, data, len);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res <= 0)
+	return FALSE;
+
+      data += res;
+      len -= res;
+    }
+
+  return TRUE;
+}
+
+#ifdef HAVE_ZLIB
+
+typedef struct {
+  int fd;
+  gboolean failed;
+  gsize len;
+  guchar buffer[WRITE_BUFFER_SIZE];
+} PngWriter;
+
+static void
+writer_flush (PngWriter *writer)
+{
+  if (!writer->failed && !write_all (writer->fd, writer->buffer, writer->len))
+    writer->failed = TRUE;
+  writer->len = 0;
+}
+
+static void
+writer_write (PngWriter    *writer,
+	      const guchar *data,
+	      gsize         len)
+{
+  if (writer->len + len > sizeof (writer->buffer))
+    {
+      writer_flush (writer);
+
+      if (len > sizeof (writer->buffer))
+	{
+	  if (!writer->failed && !write_all (writer->fd, data, len))
+	    writer->failed = TRUE;
+	  return;
+	}
+    }
+
+  memcpy (writer->buffer + writer->len, data, len);
+  writer->len += len;
+}
+
+static void
+writer_write_uint32 (PngWriter *writer,
+		     guint32    value)
+{
+  guchar data[4];
+
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+
+  writer_write (writer, data, 4);
+}
+
+/* A chunk whose data is given in up to two pieces */
+static void
+write_chunk (PngWriter    *writer,
+	     const char   *type,
+	     const guchar *data1,
+	     gsize         len1,
+	     const guchar *data2,
+	     gsize         len2)
+{
+  uLong crc;
+
+  /* crc32() with a NULL buffer returns the initial value */
+  crc = crc32 (0, (const Bytef *) type, 4);
+  if (len1 > 0)
+    crc = crc32 (crc, data1, len1);
+  if (len2 > 0)
+    crc = crc32 (crc, data2, len2);
+
+  writer_write_uint32 (writer, len1 + len2);
+  writer_write (writer, (const guchar *) type, 4);
+  writer_write (writer, data1, len1);
+  writer_write (writer, data2, len2);
+  writer_write_uint32 (writer, crc);
+}
+
+static void
+write_text_chunk (PngWriter  *writer,
+		  const char *key,
+		  const char *value)
+{
+  const char *p;
+  gboolean ascii;
+  GString *header;
+
+  ascii = TRUE;
+  for (p = value; *p != 0; p++)
+    {
+      if ((guchar) *p >= 0x80)
+	{
+	  ascii = FALSE;
+	  break;
+	}
+    }
+
+  header = g_string_new (key);
+  g_string_append_c (header, 0);
+
+  /* tEXt is Latin-1; anything beyond ASCII goes into an uncompressed
+   * iTXt chunk with no language tag instead */
+  if (!ascii)
+    g_string_append_len (header, "\0\0\0\0", 4);
+
+  write_chunk (writer, ascii ? "tEXt" : "iTXt",
+	       (const guchar *) header->str, header->len,
+	       (const guchar *) value, strlen (value));
+
+  g_string_free (header, TRUE);
+}
+
+static guchar
+paeth_predictor (int a, int b, int c)
+{
+  int p, pa, pb, pc;
+
+  p = a + b - c;
+  pa = ABS (p - a);
+  pb = ABS (p - b);
+  pc = ABS (p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+/* Filters @row into out[1..] with @filter, using the unfiltered
+ * previous row @prior, and stores the filter type in out[0] */
+static void
+filter_row (const guchar *row,
+	    const guchar *prior,
+	    gsize         row_bytes,
+	    int           bpp,
+	    int           filter,
+	    guchar       *out)
+{
+  gsize i;
+  int a, c;
+
+  out[0] = filter;
+  out++;
+
+  for (i = 0; i < row_bytes; i++)
+    {
+      a = i >= (gsize) bpp ? row[i - bpp] : 0;
+      c = i >= (gsize) bpp ? prior[i - bpp] : 0;
+
+      switch (filter)
+	{
+	case 0:
+	  out[i] = row[i];
+	  break;
+	case 1:
+	  out[i] = row[i] - a;
+	  break;
+	case 2:
+	  out[i] = row[i] - prior[i];
+	  break;
+	case 3:
+	  out[i] = row[i] - ((a + prior[i]) >> 1);
+	  break;
+	default:
+	  out[i] = row[i] - paeth_predictor (a, prior[i], c);
+	  break;
+	}
+    }
+}
+
+/* The usual heuristic: the filtered row whose bytes, taken as signed
+ * values, have the smallest absolute sum tends to compress best */
+static guint
+filtered_row_cost (const guchar *out,
+		   gsize         row_bytes)
+{
+  guint sum;
+  gsize i;
+
+  sum = 0;
+  for (i = 1; i <= row_bytes; i++)
+    sum += ABS ((gint8) out[i]);
+
+  return sum;
+}
+
+static void
+deflate_bytes (PngWriter    *writer,
+	       z_stream     *stream,
+	       guchar       *idat,
+	       const guchar *data,
+	       gsize         len,
+	       int           flush)
+{
+  int res;
+
+  stream->next_in = (Bytef *) data;
+  stream->avail_in = len;
+
+  do
+    {
+      res = deflate (stream, flush);
+
+      if (stream->avail_out == 0 || (flush == Z_FINISH && res == Z_STREAM_END))
+	{
+	  if (IDAT_SIZE - stream->avail_out > 0)
+	    write_chunk (writer, "IDAT", idat, IDAT_SIZE - stream->avail_out,
+			 NULL, 0);
+	  stream->next_out = idat;
+	  stream->avail_out = IDAT_SIZE;
+	}
+    }
+  while (res == Z_OK && (stream->avail_in > 0 || flush == Z_FINISH));
+
+  if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+    writer->failed = TRUE;
+}
+
+gboolean
+_mate_thumbnail_png_write (int                     fd,
+			   GdkPixbuf              *pixbuf,
+			   const char * const     *keys,
+			   const char * const     *values,
+			   int                     level,
+			   MateThumbnailPngFilter  filter)
+{
+  PngWriter *writer;
+  z_stream stream;
+  guchar ihdr[13];
+  guchar *pixels, *prior, *filtered[5], *idat, *best;
+  gsize row_bytes;
+  guint cost, best_cost;
+  int width, height, n_channels, rowstride;
+  int i, y, first_filter, last_filter;
+  gboolean res;
+
+  g_return_val_if_fail (gdk_pixbuf_get_bits_per_sample (pixbuf) == 8, FALSE);
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  row_bytes = (gsize) width * n_channels;
+
+  memset (&stream, 0, sizeof (stream));
+  if (deflateInit2 (&stream,
+		    level < 0 ? Z_DEFAULT_COMPRESSION : MIN (level, 9),
+		    Z_DEFLATED, 15, 8,
+		    filter == MATE_THUMBNAIL_PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK)
+    return FALSE;
+
+  writer = g_new (PngWriter, 1);
+  writer->fd = fd;
+  writer->failed = FALSE;
+  writer->len = 0;
+
+  writer_write (writer, png_signature, sizeof (png_signature));
+
+  ihdr[0] = width >> 24;
+  ihdr[1] = width >> 16;
+  ihdr[2] = width >> 8;
+  ihdr[3] = width;
+  ihdr[4] = height >> 24;
+  ihdr[5] = height >> 16;
+  ihdr[6] = height >> 8;
+  ihdr[7] = height;
+  ihdr[8] = 8;                          /* bit depth */
+  ihdr[9] = n_channels == 4 ? 6 : 2;    /* RGBA or RGB */
+  ihdr[10] = 0;                         /* deflate */
+  ihdr[11] = 0;                         /* adaptive filtering */
+  ihdr[12] = 0;                         /* not interlaced */
+  write_chunk (writer, "IHDR", ihdr, sizeof (ihdr), NULL, 0);
+
+  /* Before the image data, so readers can stop at the first IDAT */
+  for (i = 0; keys[i] != NULL; i++)
+    write_text_chunk (writer, keys[i], values[i]);
+
+  if (filter == MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE)
+    {
+      first_filter = 0;
+      last_filter = 4;
+    }
+  else
+    first_filter = last_filter = filter - MATE_THUMBNAIL_PNG_FILTER_NONE;
+
+  prior = g_malloc0 (row_bytes);
+  for (i = first_filter; i <= last_filter; i++)
+    filtered[i] = g_malloc (row_bytes + 1);
+  idat = g_malloc (IDAT_SIZE);
+
+  stream.next_out = idat;
+  stream.avail_out = IDAT_SIZE;
+
+  for (y = 0; y < height && !writer->failed; y++)
+    {
+      best = NULL;
+      best_cost = G_MAXUINT;
+      for (i = first_filter; i <= last_filter; i++)
+	{
+	  filter_row (pixels, prior, row_bytes, n_channels, i, filtered[i]);
+	  if (first_filter == last_filter)
+	    {
+	      best = filtered[i];
+	      break;
+	    }
+
+	  cost = filtered_row_cost (filtered[i], row_bytes);
+	  if (cost < best_cost)
+	    {
+	      best = filtered[i];
+	      best_cost = cost;
+	    }
+	}
+
+      deflate_bytes (writer, &stream, idat, best, row_bytes + 1, Z_NO_FLUSH);
+
+      memcpy (prior, pixels, row_bytes);
+      pixels += rowstride;
+    }
+
+  deflate_bytes (writer, &stream, idat, NULL, 0, Z_FINISH);
+  deflateEnd (&stream);
+
+  write_chunk (writer, "IEND", NULL, 0, NULL, 0);
+  writer_flush (writer);
+
+  res = !writer->failed;
+
+  g_free (idat);
+  for (i = first_filter; i <= last_filter; i++)
+    g_free (filtered[i]);
+  g_free (prior);
+  g_free (writer);
+
+  return res;
+}
+
+#else /* !HAVE_ZLIB */
+
+static gboolean
+save_to_fd (const gchar *buf,
+	    gsize        count,
+	    GError     **error,
+	    gpointer     data)
+{
+  return write_all (GPOINTER_TO_INT (data), (const guchar *) buf, count);
+}
+
+/* Without zlib gdk-pixbuf does the encoding; the filter can't be
+ * chosen */
+gboolean
+_mate_thumbnail_png_write (int                     fd,
+			   GdkPixbuf              *pixbuf,
+			   const char * const     *keys,
+			   const char * const     *values,
+			   int                     level,
+			   MateThumbnailPngFilter  filter)
+{
+  char **option_keys, **option_values;
+  char level_str[4];
+  gboolean res;
+  int i, n;
+
+  for (n = 0; keys[n] != NULL; n++)
+    ;
+
+  option_keys = g_new0 (char *, n + 2);
+  option_values = g_new0 (char *, n + 2);
+  for (i = 0; i < n; i++)
+    {
+      option_keys[i] = g_strconcat ("tEXt::", keys[i], NULL);
+      option_values[i] = g_strdup (values[i]);
+    }
+  if (level >= 0)
+    {
+      g_snprintf (level_str, sizeof (level_str), "%d", MIN (level, 9));
+      option_keys[n] = g_strdup ("compression");
+      option_values[n] = g_strdup (level_str);
+    }
+
+  res = gdk_pixbuf_save_to_callbackv (pixbuf, save_to_fd, GINT_TO_POINTER (fd),
+				      "png", option_keys, option_values, NULL);
+
+  g_strfreev (option_keys);
+  g_strfreev (option_values);
+
+  return res;
+}
+
+#endif /* HAVE_ZLIB */
+
+/* A non-interlaced PNG can be decoded one row after the other, so it
+ * never needs to be in memory at full size. The IHDR chunk always comes
+ * first and holds the interlace method in its last byte. */
+gboolean
+_mate_thumbnail_png_can_load (const guchar *data,
+			      gsize         length)
+{
+#ifdef HAVE_LIBPNG
+  return length >= 33 &&
+    memcmp (data, png_signature, 8) == 0 &&
+    memcmp (data + 12, "IHDR", 4) == 0 &&
+    data[28] == 0;
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef HAVE_LIBPNG
+
+typedef struct {
+  const guchar *data;
+  gsize length;
+  MateThumbnailReadFunc read_func;
+  gpointer read_data;
+} PngSource;
+
+static void
+read_source (png_structp png,
+	     png_bytep   out,
+	     png_size_t  length)
+{
+  PngSource *source = png_get_io_ptr (png);
+  gsize n;
+
+  while (length > 0)
+    {
+      if (source->length == 0 &&
+	  (!source->read_func (source->read_data, &source->data, &source->length) ||
+	   source->length == 0))
+	png_error (png, "Premature end of file");
+
+      n = MIN (length, source->length);
+      memcpy (out, source->data, n);
+      out += n;
+      length -= n;
+      source->data += n;
+      source->length -= n;
+    }
+}
+
+static void
+error_handler (png_structp     png,
+	       png_const_charp message)
+{
+  longjmp (png_jmpbuf (png), 1);
+}
+
+static void
+warning_handler (png_structp     png,
+		 png_const_charp message)
+{
+}
+
+/* Text chunks become "tEXt::" options, as with the gdk-pixbuf loader */
+static void
+set_text_options (GdkPixbuf   *pixbuf,
+		  png_structp  png,
+		  png_infop    info)
+{
+  png_textp text;
+  char *key, *value;
+  int i, n_text;
+
+  if (png_get_text (png, info, &text, &n_text) == 0)
+    return;
+
+  for (i = 0; i < n_text; i++)
+    {
+      /* Only iTXt is UTF-8, the others are latin1 */
+      if (text[i].compression > PNG_TEXT_COMPRESSION_zTXt)
+	value = g_strdup (text[i].text);
+      else
+	value = g_convert (text[i].text, -1, "UTF-8", "ISO-8859-1",
+			   NULL, NULL, NULL);
+
+      if (value != NULL && g_utf8_validate (value, -1, NULL))
+	{
+	  key = g_strconcat ("tEXt::", text[i].key, NULL);
+	  gdk_pixbuf_set_option (pixbuf, key, value);
+	  g_free (key);
+	}
+      g_free (value);
+    }
+}
+
+GdkPixbuf *
+_mate_thumbnail_png_load (const guchar          *data,
+			  gsize                  length,
+			  MateThumbnailReadFunc  read_func,
+			  gpointer               read_data,
+			  MateThumbnailSizeFunc  size_func,
+			  gpointer               size_data,
+			  int                   *original_width,
+			  int                   *original_height)
+{
+  png_structp png;
+  png_infop info;
+  PngSource source;
+  MateThumbnailScaler *volatile scaler;
+  GdkPixbuf *volatile pixbuf;
+  guchar *volatile row;
+  GdkPixbuf *scaled;
+  guchar *pixels;
+  png_uint_32 width, height, y;
+  int bit_depth, color_type, interlace, rowstride;
+  int dest_width, dest_height;
+  gboolean has_alpha;
+
+  png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL,
+				error_handler, warning_handler);
+  if (png == NULL)
+    return NULL;
+
+  info = png_create_info_struct (png);
+  if (info == NULL)
+    {
+      png_destroy_read_struct (&png, NULL, NULL);
+      return NULL;
+    }
+
+  scaler = NULL;
+  pixbuf = NULL;
+  row = NULL;
+
+  if (setjmp (png_jmpbuf (png)))
+    {
+      if (scaler != NULL)
+	_mate_thumbnail_scaler_free (scaler);
+      if (pixbuf != NULL)
+	g_object_unref (pixbuf);
+      g_free (row);
+      png_destroy_read_struct (&png, &info, NULL);
+      return NULL;
+    }
+
+  source.data = data;
+  source.length = length;
+  source.read_func = read_func;
+  source.read_data = read_data;
+  png_set_read_fn (png, &source, read_source);
+
+  png_read_info (png, info);
+  png_get_IHDR (png, info, &width, &height, &bit_depth, &color_type,
+		&interlace, NULL, NULL);
+  if (interlace != PNG_INTERLACE_NONE || width > G_MAXINT || height > G_MAXINT)
+    png_error (png, "Not supported");
+
+  /* Always 8 bit RGB or RGBA, what a GdkPixbuf holds */
+  png_set_expand (png);
+  png_set_strip_16 (png);
+  if (color_type == PNG_COLOR_TYPE_GRAY ||
+      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb (png);
+  png_read_update_info (png, info);
+
+  has_alpha = png_get_channels (png, info) == 4;
+  if (png_get_channels (png, info) != (has_alpha ? 4 : 3))
+    png_error (png, "Not supported");
+
+  dest_width = width;
+  dest_height = height;
+  size_func (&dest_width, &dest_height, size_data);
+  if (dest_width <= 0 || dest_height <= 0)
+    png_error (png, "Bad size");
+
+  if (dest_width <= (int) width && dest_height <= (int) height &&
+      (dest_width < (int) width || dest_height < (int) height))
+    {
+      scaler = _mate_thumbnail_scaler_new (width, height, has_alpha,
+					   dest_width, dest_height);
+      row = g_try_malloc (png_get_rowbytes (png, info));
+      if (row == NULL)
+	png_error (png, "Out of memory");
+
+      for (y = 0; y < height; y++)
+	{
+	  png_read_row (png, row, NULL);
+	  _mate_thumbnail_scaler_push_row (scaler, row);
+	}
+
+      pixbuf = _mate_thumbnail_scaler_finish (scaler);
+      _mate_thumbnail_scaler_free (scaler);
+      scaler = NULL;
+      g_free (row);
+      row = NULL;
+    }
+  else
+    {
+      /* Enlarged in a direction; only ever asked for small images */
+      pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+      if (pixbuf == NULL)
+	png_error (png, "Out of memory");
+
+      pixels = gdk_pixbuf_get_pixels (pixbuf);
+      rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+      for (y = 0; y < height; y++)
+	png_read_row (png, pixels + y * rowstride, NULL);
+
+      if (dest_width != (int) width || dest_height != (int) height)
+	{
+	  scaled = gdk_pixbuf_scale_simple (pixbuf, dest_width, dest_height,
+					    GDK_INTERP_BILINEAR);
+	  g_object_unref (pixbuf);
+	  pixbuf = scaled;
+	}
+    }
+
+  if (pixbuf == NULL)
+    png_error (png, "Out of memory");
+
+  /* Picks up the text chunks after the image data too */
+  png_read_end (png, info);
+  set_text_options (pixbuf, png, info);
+
+  *original_width = width;
+  *original_height = height;
+
+  png_destroy_read_struct (&png, &info, NULL);
+
+  return pixbuf;
+}
+
+#else /* !HAVE_LIBPNG */
+
+GdkPixbuf *
+_mate_thumbnail_png_load (const guchar          *data,
+			  gsize                  length,
+			  MateThumbnailReadFunc  read_func,
+			  gpointer               read_data,
+			  MateThumbnailSizeFunc  size_func,
+			  gpointer               size_data,
+			  int                   *original_width,
+			  int                   *original_height)
+{
+  return NULL;
+}
+
+#endif /* HAVE_LIBPNG */
@@ -0,0 +1,279 @@
+/*
+ * mate-thumbnail-private.h: Internal helpers shared by the thumbnail code
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef MATE_THUMBNAIL_PRIVATE_H
+#define MATE_THUMBNAIL_PRIVATE_H
+
+#include <stdio.h>
+#include <glib.h>
+#include <time.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mate-thumbnail.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reads the tEXt/iTXt chunks in front of the first IDAT of the PNG at
+ * @path without decoding any image data. @keys is a NULL terminated
+ * list of keywords (e.g. "Thumb::URI"); on success values[i] is set to
+ * a newly allocated UTF-8 copy of the matching text or NULL if the key
+ * was not present. Returns FALSE, with all @values set to NULL, if
+ * @path can't be opened or is not a well formed PNG file. */
+gboolean _mate_thumbnail_png_read_text (const char         *path,
+					const char * const *keys,
+					char              **values);
+/* The same from the current position of @f, which is left open */
+gboolean _mate_thumbnail_png_read_text_from_file (FILE               *f,
+						  const char * const *keys,
+						  char              **values);
+
+/* Header-only equivalent of loading @path and calling
+ * mate_thumbnail_is_valid() on the result. If @stale is not NULL, it
+ * is set when @path is a thumbnail for another uri or mtime. */
+gboolean _mate_thumbnail_png_is_valid  (const char         *path,
+					const char         *uri,
+					time_t              mtime,
+					gboolean           *stale);
+
+/* Writes @pixbuf as a PNG file to @fd with the given text chunks.
+ * @keys and @values are NULL terminated; values are UTF-8. @level is a
+ * zlib compression level, or -1 for the default. */
+gboolean _mate_thumbnail_png_write     (int                     fd,
+					GdkPixbuf              *pixbuf,
+					const char * const     *keys,
+					const char * const     *values,
+					int                     level,
+					MateThumbnailPngFilter  filter);
+
+/* Supplies the next chunk of a file; a @length of 0 means the end */
+typedef gboolean (*MateThumbnailReadFunc) (gpointer       user_data,
+					   const guchar **data,
+					   gsize         *length);
+/* Changes @width and @height, the size of the image, to the size to
+ * load it at */
+typedef void     (*MateThumbnailSizeFunc) (int           *width,
+					   int           *height,
+					   gpointer       user_data);
+
+/* Whether _mate_thumbnail_png_load() can decode the file starting with
+ * the @length bytes at @data: a non-interlaced PNG, with libpng */
+gboolean   _mate_thumbnail_png_can_load (const guchar          *data,
+					 gsize                  length);
+/* Decodes the PNG file that starts with the @length bytes at @data and
+ * continues with what @read_func returns, at the size @size_func picks.
+ * Rows are scaled down as they are decoded, so only the result is ever
+ * held in memory. Returns NULL on errors, including a truncated file. */
+GdkPixbuf *_mate_thumbnail_png_load     (const guchar          *data,
+					 gsize                  length,
+					 MateThumbnailReadFunc  read_func,
+					 gpointer               read_data,
+					 MateThumbnailSizeFunc  size_func,
+					 gpointer               size_data,
+					 int                   *original_width,
+					 int                   *original_height);
+
+/* MD5 of @len bytes at @data, without allocating anything */
+void     _mate_thumbnail_md5_digest    (const char         *data,
+					gsize               len,
+					guint8             *digest);
+
+/* Writes "@dir/<hex digest>.png" to @buffer like snprintf(): returns the
+ * length of the path and only writes it if it fits */
+gsize    _mate_thumbnail_format_path   (const char         *dir,
+					const guint8       *digest,
+					char               *buffer,
+					gsize               buffer_size);
+
+typedef enum {
+  MATE_THUMBNAIL_SIMD_NONE,
+  MATE_THUMBNAIL_SIMD_SSE2,
+  MATE_THUMBNAIL_SIMD_AVX2
+} MateThumbnailSimdLevel;
+
+/* The best box filter kernel the CPU supports */
+MateThumbnailSimdLevel _mate_thumbnail_get_simd_level (void);
+
+/* mate_thumbnail_scale_down_pixbuf() with a given kernel; levels the
+ * build or the CPU doesn't support must not be passed. */
+GdkPixbuf *_mate_thumbnail_scale_down_pixbuf_for_level (GdkPixbuf             *pixbuf,
+							int                    dest_width,
+							int                    dest_height,
+							MateThumbnailSimdLevel level);
+
+int _mate_thumbnail_get_n_processors (void);
+
+/* Incremental version of mate_thumbnail_scale_down_pixbuf(): source
+ * rows are pushed top to bottom as they become available and only the
+ * scaled image plus one row of column sums are kept in memory. */
+typedef struct _MateThumbnailScaler MateThumbnailScaler;
+
+MateThumbnailScaler *_mate_thumbnail_scaler_new      (int                  source_width,
+						      int                  source_height,
+						      gboolean             has_alpha,
+						      int                  dest_width,
+						      int                  dest_height);
+void                 _mate_thumbnail_scaler_push_row (MateThumbnailScaler *scaler,
+						      const guchar        *row);
+/* Returns a new reference to the scaled image, or NULL if not all
+ * source rows were pushed */
+GdkPixbuf *          _mate_thumbnail_scaler_finish   (MateThumbnailScaler *scaler);
+void                 _mate_thumbnail_scaler_free     (MateThumbnailScaler *scaler);
+
+gboolean   _mate_thumbnail_is_jpeg              (const guchar *data,
+						 gsize         length);
+/* Decodes the JPEG file in @data at the smallest size libjpeg can
+ * produce that still covers @max_width x @max_height and scales it down
+ * to fit while decoding. Returns NULL if the file is better left to
+ * gdk-pixbuf, or libjpeg is not available. */
+GdkPixbuf *_mate_thumbnail_jpeg_load            (const guchar *data,
+						 gsize         length,
+						 int           max_width,
+						 int           max_height,
+						 int          *original_width,
+						 int          *original_height);
+/* Loads the preview embedded in the Exif data of a JPEG or TIFF file,
+ * scaled like _mate_thumbnail_jpeg_load(). Returns NULL if there is
+ * none, or it is smaller than that or of another aspect ratio. */
+GdkPixbuf *_mate_thumbnail_load_embedded        (const guchar *data,
+						 gsize         length,
+						 int           max_width,
+						 int           max_height,
+						 int          *original_width,
+						 int          *original_height);
+/* The orientation tag of the Exif data in an APP1 segment, 0 if none */
+int        _mate_thumbnail_exif_get_orientation (const guchar *data,
+						 gsize         length);
+
+/* Persistent record of the Thumb::MTime of the thumbnails in a
+ * directory, keyed by the MD5 digest of their uri. Shared between
+ * processes; see mate-thumbnail-index.c. */
+typedef struct _MateThumbnailIndex MateThumbnailIndex;
+
+typedef enum {
+  MATE_THUMBNAIL_INDEX_UNKNOWN,   /* not indexed, look at the file */
+  MATE_THUMBNAIL_INDEX_VALID,     /* the thumbnail exists and is for mtime */
+  MATE_THUMBNAIL_INDEX_STALE      /* the thumbnail is for another mtime */
+} MateThumbnailIndexResult;
+
+/* Gets the uri digest back from a thumbnail file name */
+gboolean                 _mate_thumbnail_parse_filename (const char   *name,
+							 guint8       *digest);
+
+/* Returns NULL if indexes are not supported on this platform */
+MateThumbnailIndex *     _mate_thumbnail_index_new    (const char         *dir,
+						       const char         *path);
+void                     _mate_thumbnail_index_free   (MateThumbnailIndex *index);
+MateThumbnailIndexResult _mate_thumbnail_index_lookup (MateThumbnailIndex *index,
+						       const guint8       *digest,
+						       time_t              mtime,
+						       const char         *thumbnail_path);
+/* Records a valid thumbnail found at @thumbnail_path */
+void                     _mate_thumbnail_index_insert (MateThumbnailIndex *index,
+						       const guint8       *digest,
+						       time_t              mtime,
+						       const char         *thumbnail_path);
+/* Renames a new thumbnail into place and records it; returns what
+ * g_rename() returned */
+int                      _mate_thumbnail_index_rename (MateThumbnailIndex *index,
+						       const guint8       *digest,
+						       time_t              mtime,
+						       const char         *tmp_path,
+						       const char         *thumbnail_path);
+void                     _mate_thumbnail_index_remove (MateThumbnailIndex *index,
+						       const guint8       *digest);
+/* Makes lookups confirm every hit until the index is verified again */
+void                     _mate_thumbnail_index_invalidate (MateThumbnailIndex *index);
+/* Re-reads the indexed thumbnails, or with @rebuild every thumbnail in
+ * the directory, and marks the index as complete again */
+gboolean                 _mate_thumbnail_index_verify (MateThumbnailIndex *index,
+						       gboolean            rebuild);
+
+/* Long running thumbnailers, see mate-thumbnail-server.c. At most
+ * @max_per_command processes are started for each command line. */
+typedef struct _MateThumbnailServerPool MateThumbnailServerPool;
+
+MateThumbnailServerPool *_mate_thumbnail_server_pool_new   (int                      max_per_command);
+void                     _mate_thumbnail_server_pool_free  (MateThumbnailServerPool *pool);
+/* Stops the idle thumbnailers, and the busy ones once they are done */
+void                     _mate_thumbnail_server_pool_clear (MateThumbnailServerPool *pool);
+/* Returns NULL if the thumbnailer can't be started or fails on @uri,
+ * or if @uri can't be sent to it */
+GdkPixbuf *              _mate_thumbnail_server_pool_run   (MateThumbnailServerPool *pool,
+							    const char              *command_line,
+							    const char              *uri,
+							    int                      size);
+
+/* Instrumentation, see mate-thumbnail-metrics.c. Everything is a
+ * no-op while collecting is disabled, which is the default. */
+typedef enum {
+  MATE_THUMBNAIL_COUNTER_LOOKUPS,
+  MATE_THUMBNAIL_COUNTER_HITS,
+  MATE_THUMBNAIL_COUNTER_MISSES,
+  MATE_THUMBNAIL_COUNTER_STALE,
+  MATE_THUMBNAIL_COUNTER_FAILED_HITS,
+  MATE_THUMBNAIL_COUNTER_GENERATIONS,
+  MATE_THUMBNAIL_COUNTER_GENERATION_FAILURES,
+  MATE_THUMBNAIL_COUNTER_SCRIPT_SPAWNS,
+  MATE_THUMBNAIL_COUNTER_SERVER_REQUESTS,
+  MATE_THUMBNAIL_COUNTER_BYTES_READ,
+  MATE_THUMBNAIL_COUNTER_BYTES_WRITTEN,
+  MATE_THUMBNAIL_N_COUNTERS
+} MateThumbnailCounter;
+
+typedef struct _MateThumbnailStats MateThumbnailStats;
+
+MateThumbnailStats *_mate_thumbnail_stats_new         (void);
+void                _mate_thumbnail_stats_free        (MateThumbnailStats   *stats);
+void                _mate_thumbnail_stats_set_enabled (MateThumbnailStats   *stats,
+						       gboolean              enabled);
+void                _mate_thumbnail_stats_add         (MateThumbnailStats   *stats,
+						       MateThumbnailCounter  counter,
+						       guint64               n);
+void                _mate_thumbnail_stats_add_mime_type (MateThumbnailStats *stats,
+							 const char         *mime_type);
+/* Returns 0 when disabled, which _mate_thumbnail_stats_stop() ignores */
+guint64             _mate_thumbnail_stats_start       (MateThumbnailStats   *stats);
+void                _mate_thumbnail_stats_stop        (MateThumbnailStats   *stats,
+						       MateThumbnailTimer    timer,
+						       guint64               start);
+void                _mate_thumbnail_stats_get         (MateThumbnailStats   *stats,
+						       MateThumbnailMetrics *metrics);
+void                _mate_thumbnail_stats_reset       (MateThumbnailStats   *stats);
+/* Prints the metrics with g_printerr() from the default main loop each
+ * time @signum is received; 0 stops it */
+void                _mate_thumbnail_stats_dump_on_signal (MateThumbnailStats *stats,
+							  const char         *name,
+							  int                 signum);
+
+/* Cache cleanup below @base_dir, see mate_thumbnail_factory_clean_cache() */
+void _mate_thumbnail_clean_cache (const char               *base_dir,
+				  guint64                   max_bytes,
+				  time_t                    max_age,
+				  gboolean                  dry_run,
+				  MateThumbnailCleanResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MATE_THUMBNAIL_PRIVATE_H */
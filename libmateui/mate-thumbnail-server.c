@@ -0,0 +1,489 @@
+/*
+ * mate-thumbnail-server.c: Long running external thumbnailers
+ *
+ * This file is part of the Mate Library.
+ *
+ * The Mate Library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * The Mate Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with the Mate Library; see the file COPYING.LIB.  If not,
+ * write to the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* A thumbnailer registered with a "server_command" key is started once
+ * and then handed one file after the other over its standard input and
+ * output, which are connected to a socket:
+ *
+ *   request:  "<size> <uri>\n"
+ *   reply:    "<length>\n" followed by <length> bytes of an image in
+ *             any format gdk-pixbuf can load. A length of 0 means the
+ *             file could not be thumbnailed.
+ *
+ * Uris containing whitespace or control characters are never sent; the
+ * caller falls back to the thumbnailer's "command". The thumbnailer should
+ * exit when its standard input is closed, which comes with a SIGTERM; it
+ * is killed if it is still running SERVER_EXIT_GRACE later. A thumbnailer
+ * that replies with anything else, or takes longer than SERVER_TIMEOUT
+ * to reply, is killed right away and started again for the next file. */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mate-thumbnail-private.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SERVER_TIMEOUT (30 * 1000)
+#define MAX_REPLY_SIZE (64 * 1024 * 1024)
+#define REPLY_CHUNK_SIZE 65536
+#define SERVER_EXIT_GRACE 1000
+#define SERVER_EXIT_POLL 10
+
+typedef struct {
+  GPid pid;
+  int fd;
+  guint generation;
+} ServerProcess;
+
+typedef struct {
+  GList *idle;                /* ServerProcesses waiting for work */
+  int n_running;              /* idle and busy */
+} ServerCommand;
+
+struct _MateThumbnailServerPool {
+  GMutex *lock;
+  GCond *cond;
+  GHashTable *commands;       /* command line -> ServerCommand */
+  guint generation;
+  int max_per_command;
+};
+
+static void
+server_process_reap (ServerProcess *process)
+{
+  while (waitpid (process->pid, NULL, 0) == -1 && errno == EINTR)
+    ;
+  g_spawn_close_pid (process->pid);
+  g_free (process);
+}
+
+/* For a process that stopped answering, which SIGTERM may not reach */
+static void
+server_process_kill (ServerProcess *process)
+{
+  close (process->fd);
+  kill (process->pid, SIGKILL);
+  server_process_reap (process);
+}
+
+/* Idle processes are asked to exit all at once and given
+ * SERVER_EXIT_GRACE to do so before they are killed. Frees @processes. */
+static void
+server_processes_stop (GList *processes)
+{
+  ServerProcess *process;
+  GList *l, *next;
+  int waited;
+  pid_t res;
+
+  for (l = processes; l != NULL; l = l->next)
+    {
+      process = l->data;
+      close (process->fd);
+      kill (process->pid, SIGTERM);
+    }
+
+  for (waited = 0;
+       processes != NULL && waited < SERVER_EXIT_GRACE;
+       waited += SERVER_EXIT_POLL)
+    {
+      for (l = processes; l != NULL; l = next)
+	{
+	  process = l->data;
+	  next = l->next;
+
+	  do
+	    res = waitpid (process->pid, NULL, WNOHANG);
+	  while (res == -1 && errno == EINTR);
+
+	  if (res != 0)
+	    {
+	      g_spawn_close_pid (process->pid);
+	      g_free (process);
+	      processes = g_list_delete_link (processes, l);
+	    }
+	}
+
+      if (processes != NULL)
+	g_usleep (SERVER_EXIT_POLL * 1000);
+    }
+
+  for (l = processes; l != NULL; l = l->next)
+    {
+      process = l->data;
+      kill (process->pid, SIGKILL);
+      server_process_reap (process);
+    }
+  g_list_free (processes);
+}
+
+static void
+server_child_setup (gpointer user_data)
+{
+  int fd = GPOINTER_TO_INT (user_data);
+
+  dup2 (fd, 0);
+  dup2 (fd, 1);
+}
+
+static ServerProcess *
+server_process_spawn (const char *command)
+{
+  ServerProcess *process;
+  char **argv;
+  int fds[2];
+  GPid pid;
+  gboolean res;
+
+  if (!g_shell_parse_argv (command, NULL, &argv, NULL))
+    return NULL;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      g_strfreev (argv);
+      return NULL;
+    }
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+  res = g_spawn_async (NULL, argv, NULL,
+		       G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+		       server_child_setup, GINT_TO_POINTER (fds[1]),
+		       &pid, NULL);
+  g_strfreev (argv);
+  close (fds[1]);
+
+  if (!res)
+    {
+      close (fds[0]);
+      return NULL;
+    }
+
+  process = g_new0 (ServerProcess, 1);
+  process->pid = pid;
+  process->fd = fds[0];
+
+  return process;
+}
+
+static gboolean
+wait_for_fd (int fd, short events)
+{
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = fd;
+  pfd.events = events;
+
+  do
+    res = poll (&pfd, 1, SERVER_TIMEOUT);
+  while (res == -1 && errno == EINTR);
+
+  return res == 1 && (pfd.revents & events) != 0;
+}
+
+static gboolean
+send_all (int fd, const char *data, gsize len)
+{
+  gssize res;
+
+  while (len > 0)
+    {
+      if (!wait_for_fd (fd, POLLOUT))
+	return FALSE;
+
+      res = send (fd, data, len, MSG_NOSIGNAL);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res <= 0)
+	return FALSE;
+
+      data += res;
+      len -= res;
+    }
+
+  return TRUE;
+}
+
+static gssize
+receive_some (int fd, void *buffer, gsize len)
+{
+  gssize res;
+
+  do
+    {
+      if (!wait_for_fd (fd, POLLIN))
+	return -1;
+      res = recv (fd, buffer, len, 0);
+    }
+  while (res == -1 && errno == EINTR);
+
+  return res;
+}
+
+/* The length line is short; read it a byte at a time so nothing of the
+ * image data is consumed */
+static gboolean
+receive_length (int fd, gsize *length)
+{
+  char line[24], *end;
+  gsize i;
+
+  for (i = 0; i < sizeof (line) - 1; i++)
+    {
+      if (receive_some (fd, &line[i], 1) != 1)
+	return FALSE;
+
+      if (line[i] == '\n')
+	{
+	  line[i] = 0;
+	  *length = g_ascii_strtoull (line, &end, 10);
+	  return i > 0 && *end == 0;
+	}
+    }
+
+  return FALSE;
+}
+
+/* Returns FALSE if the process is not usable anymore */
+static gboolean
+server_process_thumbnail (ServerProcess *process,
+			  const char    *uri,
+			  int            size,
+			  GdkPixbuf    **pixbuf)
+{
+  GdkPixbufLoader *loader;
+  guchar *buffer;
+  char *request;
+  gsize length;
+  gssize n;
+  gboolean res;
+
+  *pixbuf = NULL;
+
+  request = g_strdup_printf ("%d %s\n", size, uri);
+  res = send_all (process->fd, request, strlen (request));
+  g_free (request);
+
+  if (!res || !receive_length (process->fd, &length) ||
+      length > MAX_REPLY_SIZE)
+    return FALSE;
+
+  if (length == 0)
+    return TRUE;
+
+  loader = gdk_pixbuf_loader_new ();
+  buffer = g_malloc (REPLY_CHUNK_SIZE);
+
+  res = TRUE;
+  while (length > 0)
+    {
+      n = receive_some (process->fd, buffer, MIN (length, REPLY_CHUNK_SIZE));
+      if (n <= 0 ||
+	  !gdk_pixbuf_loader_write (loader, buffer, n, NULL))
+	{
+	  res = FALSE;
+	  break;
+	}
+      length -= n;
+    }
+
+  if (gdk_pixbuf_loader_close (loader, NULL) && res)
+    {
+      *pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+      if (*pixbuf != NULL)
+	g_object_ref (*pixbuf);
+    }
+
+  g_free (buffer);
+  g_object_unref (loader);
+
+  return res;
+}
+
+static void
+server_command_free (ServerCommand *command)
+{
+  server_processes_stop (command->idle);
+  g_free (command);
+}
+
+MateThumbnailServerPool *
+_mate_thumbnail_server_pool_new (int max_per_command)
+{
+  MateThumbnailServerPool *pool;
+
+  pool = g_new0 (MateThumbnailServerPool, 1);
+  pool->lock = g_mutex_new ();
+  pool->cond = g_cond_new ();
+  pool->commands = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free,
+					  (GDestroyNotify) server_command_free);
+  pool->max_per_command = MAX (max_per_command, 1);
+
+  return pool;
+}
+
+void
+_mate_thumbnail_server_pool_free (MateThumbnailServerPool *pool)
+{
+  g_hash_table_destroy (pool->commands);
+  g_cond_free (pool->cond);
+  g_mutex_free (pool->lock);
+  g_free (pool);
+}
+
+static void
+clear_idle (gpointer key,
+	    gpointer value,
+	    gpointer user_data)
+{
+  ServerCommand *command = value;
+  GList **idle = user_data;
+
+  command->n_running -= g_list_length (command->idle);
+  *idle = g_list_concat (*idle, command->idle);
+  command->idle = NULL;
+}
+
+void
+_mate_thumbnail_server_pool_clear (MateThumbnailServerPool *pool)
+{
+  GList *idle;
+
+  g_mutex_lock (pool->lock);
+
+  /* Busy processes are killed when they are done */
+  idle = NULL;
+  pool->generation++;
+  g_hash_table_foreach (pool->commands, clear_idle, &idle);
+  g_cond_broadcast (pool->cond);
+
+  g_mutex_unlock (pool->lock);
+
+  /* Waiting for them must not hold up the other threads */
+  server_processes_stop (idle);
+}
+
+/* The request is a single line with the uri after a space, so anything
+ * that could end or split it would leave the thumbnailer out of step */
+static gboolean
+uri_is_safe (const char *uri)
+{
+  const guchar *p;
+
+  if (*uri == '\0')
+    return FALSE;
+
+  for (p = (const guchar *) uri; *p != '\0'; p++)
+    if (*p <= ' ' || *p == 0x7f)
+      return FALSE;
+
+  return TRUE;
+}
+
+GdkPixbuf *
+_mate_thumbnail_server_pool_run (MateThumbnailServerPool *pool,
+				 const char              *command_line,
+				 const char              *uri,
+				 int                      size)
+{
+  ServerCommand *command;
+  ServerProcess *process;
+  GdkPixbuf *pixbuf;
+  gboolean ok;
+
+  if (!uri_is_safe (uri))
+    return NULL;
+
+  g_mutex_lock (pool->lock);
+
+  command = g_hash_table_lookup (pool->commands, command_line);
+  if (command == NULL)
+    {
+      command = g_new0 (ServerCommand, 1);
+      g_hash_table_insert (pool->commands, g_strdup (command_line), command);
+    }
+
+  process = NULL;
+  while (process == NULL)
+    {
+      if (command->idle != NULL)
+	{
+	  process = command->idle->data;
+	  command->idle = g_list_delete_link (command->idle, command->idle);
+	}
+      else if (command->n_running < pool->max_per_command)
+	{
+	  command->n_running++;
+	  g_mutex_unlock (pool->lock);
+
+	  process = server_process_spawn (command_line);
+
+	  g_mutex_lock (pool->lock);
+	  if (process == NULL)
+	    {
+	      command->n_running--;
+	      g_cond_signal (pool->cond);
+	      g_mutex_unlock (pool->lock);
+	      return NULL;
+	    }
+	  process->generation = pool->generation;
+	}
+      else
+	g_cond_wait (pool->cond, pool->lock);
+    }
+
+  g_mutex_unlock (pool->lock);
+
+  ok = server_process_thumbnail (process, uri, size, &pixbuf);
+
+  g_mutex_lock (pool->lock);
+  if (ok && process->generation == pool->generation)
+    {
+      command->idle = g_list_prepend (command->idle, process);
+      process = NULL;
+    }
+  else
+    command->n_running--;
+  g_cond_signal (pool->cond);
+  g_mutex_unlock (pool->lock);
+
+  if (process != NULL)
+    server_process_kill (process);
+
+  return pixbuf;
+}
@@ -27,8 +27,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <dirent.h>
 #include <time.h>
 #include <math.h>
@@ -43,35 +46,167 @@
 #include <libmate/mate-init.h>
 #include <gio/gio.h>
 #include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
 #include "mate-mateconf-ui.h"
 #include <mateconf/mateconf.h>
 #include <mateconf/mateconf-client.h>
 #include <glib/gstdio.h>
 
 #define SECONDS_BETWEEN_STATS 10
-#define LOAD_BUFFER_SIZE 4096
+#define LOAD_BUFFER_SIZE 65536
+#define MAX_LOAD_BUFFER_SIZE (1024 * 1024)
+#define READ_SLICE_SIZE (1024 * 1024)
+#define MAX_FAST_PATH_SIZE (256 * 1024 * 1024)
+/* Holds the Exif preview of most JPEG and camera raw files */
+#define FAST_PATH_PREFIX_SIZE (256 * 1024)
+#define LOOKUP_BAND_SIZE 64
+
+/* Room for any thumbnail path; longer ones couldn't be opened anyway */
+#ifdef PATH_MAX
+#define THUMBNAIL_PATH_SIZE PATH_MAX
+#else
+#define THUMBNAIL_PATH_SIZE 4096
+#endif
+#define MAX_LOOKUP_THREADS 8
+
+typedef struct _Thumbnailers Thumbnailers;
 
 struct _MateThumbnailFactoryPrivate {
   char *application;
   MateThumbnailSize size;
 
+  /* Computed once, see set_thumbnail_dirs() */
+  char *base_dir;             /* ~/.thumbnails */
+  char *image_dir;            /* ~/.thumbnails/normal or large */
+  char *other_image_dir;      /* the one of the other size */
+  char *fail_dir;             /* ~/.thumbnails/fail/<application> */
+
   GMutex *lock;
 
-  GHashTable *scripts_hash;
+  /* Replaced, never modified; see thumbnailers_get() */
+  Thumbnailers *thumbnailers;
+  MateThumbnailServerPool *server_pool;
   guint thumbnailers_notify;
   guint reread_scheduled;
+
+  /* Asynchronous generation, see mate_thumbnail_factory_queue_thumbnail() */
+  GThreadPool *thread_pool;
+  GSequence *queue;           /* ThumbnailJobs waiting for a worker */
+  GHashTable *jobs_by_uri;    /* uri -> queued or running ThumbnailJob */
+  GHashTable *requests;       /* request id -> ThumbnailRequest */
+  guint next_request_id;
+  guint next_job_serial;
+
+  /* See mate_thumbnail_factory_set_use_index(); opened on first use */
+  gboolean use_index;
+  MateThumbnailIndex *index;
+  MateThumbnailIndex *other_index;
+  MateThumbnailIndex *fail_index;
+
+  /* Digests of the failed thumbnails of the application, so that
+   * mate_thumbnail_factory_has_valid_failed_thumbnail() only needs to
+   * look at files that exist. Rescanned when the directory changes. */
+  GHashTable *failed_digests;
+  time_t failed_dir_mtime;
+  time_t last_failed_check;
+
+  /* See mate_thumbnail_factory_set_png_compression() */
+  int png_level;
+  MateThumbnailPngFilter png_filter;
+
+  /* See mate_thumbnail_factory_set_collect_metrics() */
+  MateThumbnailStats *stats;
+};
+
+typedef struct {
+  char *command;              /* run once per file, may be NULL */
+  char *server_command;       /* kept running, may be NULL */
+} ThumbnailerScript;
+
+/* The thumbnailers configuration as read at one point in time. A new
+ * one is published whenever it changes; users hold a reference for as
+ * long as they need it, so lookups need no lock. */
+struct _Thumbnailers {
+  volatile gint ref_count;
+  GHashTable *scripts;        /* mime type -> ThumbnailerScript, NULL
+			       * if thumbnailers are disabled */
 };
 
+typedef struct {
+  MateThumbnailFactory *factory;
+  char *uri;
+  char *mime_type;
+  time_t mtime;
+  int priority;
+  guint serial;
+  GSequenceIter *iter;        /* NULL once a worker picked the job up */
+  GList *requests;
+  GdkPixbuf *thumbnail;
+} ThumbnailJob;
+
+typedef struct {
+  guint id;
+  int priority;
+  ThumbnailJob *job;
+  MateThumbnailFactoryCallback callback;
+  gpointer user_data;
+  GDestroyNotify destroy;
+} ThumbnailRequest;
+
+typedef struct {
+  GMutex *lock;
+  GCond *cond;
+  int pending;
+} LookupJob;
+
+/* A slice of the files passed to mate_thumbnail_factory_lookup_many() */
+typedef struct {
+  LookupJob *job;
+  MateThumbnailIndex *index;
+  MateThumbnailStats *stats;
+  const char *dir;
+  const char * const *uris;
+  const time_t *mtimes;
+  char **paths;
+  int start;
+  int end;
+} LookupBand;
+
+G_LOCK_DEFINE_STATIC (lookup_pool);
+G_LOCK_DEFINE_STATIC (thumbnailers);
+G_LOCK_DEFINE_STATIC (formats_hash);
+static GThreadPool *lookup_pool = NULL;
+
 typedef struct {
     gint width;
     gint height;
     gint input_width;
     gint input_height;
     gboolean preserve_aspect_ratio;
+
+    /* Set whenever the loader decoded some pixels */
+    gboolean updated;
 } SizePrepareContext;
 
+/* Where mate_gdk_pixbuf_new_from_uri_at_scale() gets its data from:
+ * local files are read() in large slices, anything else is read with a
+ * buffer that grows while the stream keeps filling it. Files are not
+ * mapped: one that shrinks while it is loaded would raise SIGBUS. */
+typedef struct {
+    int fd;
+
+    GInputStream *stream;
+    guchar *buffer;
+    gsize buffer_size;
+    gboolean buffer_filled;
+
+    /* What was read so far */
+    gsize bytes_read;
+} LoadSource;
+
 static void mate_thumbnail_factory_init          (MateThumbnailFactory      *factory);
 static void mate_thumbnail_factory_class_init    (MateThumbnailFactoryClass *class);
+static void thumbnailers_unref                   (Thumbnailers              *thumbnailers);
 
 G_DEFINE_TYPE (MateThumbnailFactory,
 	       mate_thumbnail_factory,
@@ -93,6 +228,56 @@ mate_thumbnail_factory_finalize (GObject *object)
   g_free (priv->application);
   priv->application = NULL;
 
+  g_free (priv->base_dir);
+  g_free (priv->image_dir);
+  g_free (priv->other_image_dir);
+  g_free (priv->fail_dir);
+  priv->base_dir = priv->image_dir = priv->other_image_dir = priv->fail_dir = NULL;
+
+  /* Queued jobs keep the factory alive, so only idle workers are left */
+  if (priv->thread_pool != NULL)
+    {
+      g_thread_pool_free (priv->thread_pool, FALSE, TRUE);
+      priv->thread_pool = NULL;
+    }
+  if (priv->queue != NULL)
+    {
+      g_sequence_free (priv->queue);
+      priv->queue = NULL;
+    }
+  if (priv->jobs_by_uri != NULL)
+    {
+      g_hash_table_destroy (priv->jobs_by_uri);
+      priv->jobs_by_uri = NULL;
+    }
+  if (priv->requests != NULL)
+    {
+      g_hash_table_destroy (priv->requests);
+      priv->requests = NULL;
+    }
+
+  if (priv->index != NULL)
+    {
+      _mate_thumbnail_index_free (priv->index);
+      priv->index = NULL;
+    }
+  if (priv->other_index != NULL)
+    {
+      _mate_thumbnail_index_free (priv->other_index);
+      priv->other_index = NULL;
+    }
+  if (priv->fail_index != NULL)
+    {
+      _mate_thumbnail_index_free (priv->fail_index);
+      priv->fail_index = NULL;
+    }
+
+  if (priv->failed_digests != NULL)
+    {
+      g_hash_table_destroy (priv->failed_digests);
+      priv->failed_digests = NULL;
+    }
+
   if (priv->reread_scheduled != 0) {
     g_source_remove (priv->reread_scheduled);
     priv->reread_scheduled = 0;
@@ -105,10 +290,16 @@ mate_thumbnail_factory_finalize (GObject *object)
     g_object_unref (client);
   }
   
-  if (priv->scripts_hash)
+  if (priv->thumbnailers)
+    {
+      thumbnailers_unref (priv->thumbnailers);
+      priv->thumbnailers = NULL;
+    }
+
+  if (priv->server_pool)
     {
-      g_hash_table_destroy (priv->scripts_hash);
-      priv->scripts_hash = NULL;
+      _mate_thumbnail_server_pool_free (priv->server_pool);
+      priv->server_pool = NULL;
     }
 
   if (priv->lock)
@@ -116,6 +307,12 @@ mate_thumbnail_factory_finalize (GObject *object)
       g_mutex_free (priv->lock);
       priv->lock = NULL;
     }
+
+  if (priv->stats)
+    {
+      _mate_thumbnail_stats_free (priv->stats);
+      priv->stats = NULL;
+    }
   
   g_free (priv);
   factory->priv = NULL;
@@ -124,6 +321,51 @@ mate_thumbnail_factory_finalize (GObject *object)
     (* G_OBJECT_CLASS (parent_class)->finalize) (object);
 }
 
+static void
+thumbnailer_script_free (ThumbnailerScript *script)
+{
+  g_free (script->command);
+  g_free (script->server_command);
+  g_free (script);
+}
+
+static void
+thumbnailers_unref (Thumbnailers *thumbnailers)
+{
+  if (g_atomic_int_dec_and_test (&thumbnailers->ref_count))
+    {
+      if (thumbnailers->scripts != NULL)
+	g_hash_table_destroy (thumbnailers->scripts);
+      g_free (thumbnailers);
+    }
+}
+
+/* Returns a new reference to the current configuration. The lock only
+ * covers taking the reference, so that the snapshot can't be freed in
+ * between; the lookups themselves happen outside of it. */
+static Thumbnailers *
+thumbnailers_get (MateThumbnailFactory *factory)
+{
+  Thumbnailers *thumbnailers;
+
+  G_LOCK (thumbnailers);
+  thumbnailers = factory->priv->thumbnailers;
+  g_atomic_int_inc (&thumbnailers->ref_count);
+  G_UNLOCK (thumbnailers);
+
+  return thumbnailers;
+}
+
+static ThumbnailerScript *
+thumbnailers_lookup (Thumbnailers *thumbnailers,
+		     const char   *mime_type)
+{
+  if (thumbnailers->scripts == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (thumbnailers->scripts, mime_type);
+}
+
 /* Must be called on main thread */
 static GHashTable *
 read_scripts (void)
@@ -131,7 +373,9 @@ read_scripts (void)
   GHashTable *scripts_hash;
   MateConfClient *client;
   GSList *subdirs, *l;
+  ThumbnailerScript *script;
   char *subdir, *enable, *escape, *commandkey, *command, *mimetype;
+  char *server_command;
 
   client = mateconf_client_get_default ();
 
@@ -145,7 +389,8 @@ read_scripts (void)
   
   scripts_hash = g_hash_table_new_full (g_str_hash,
 					g_str_equal,
-					g_free, g_free);
+					g_free,
+					(GDestroyNotify) thumbnailer_script_free);
 
   
   subdirs = mateconf_client_all_dirs (client, "/desktop/mate/thumbnailers", NULL);
@@ -163,7 +408,11 @@ read_scripts (void)
 	  command = mateconf_client_get_string (client, commandkey, NULL);
 	  g_free (commandkey);
 
-	  if (command != NULL) {
+	  commandkey = g_strdup_printf ("%s/server_command", subdir);
+	  server_command = mateconf_client_get_string (client, commandkey, NULL);
+	  g_free (commandkey);
+
+	  if (command != NULL || server_command != NULL) {
 	    mimetype = strrchr (subdir, '/');
 	    if (mimetype != NULL)
 	      {
@@ -178,12 +427,16 @@ read_scripts (void)
 		while ((escape = strchr (mimetype, '@')) != NULL)
                   *escape = '+';
 
+		script = g_new (ThumbnailerScript, 1);
+		script->command = command;
+		script->server_command = server_command;
 		g_hash_table_insert (scripts_hash,
-				     g_strdup (mimetype), command);
+				     g_strdup (mimetype), script);
 	      }
 	    else
 	      {
 		g_free (command);
+		g_free (server_command);
 	      }
 	  }
 	}
@@ -205,18 +458,24 @@ static void
 mate_thumbnail_factory_reread_scripts (MateThumbnailFactory *factory)
 {
   MateThumbnailFactoryPrivate *priv = factory->priv;
-  GHashTable *scripts_hash;
+  Thumbnailers *thumbnailers, *old;
 
-  scripts_hash = read_scripts ();
+  thumbnailers = g_new (Thumbnailers, 1);
+  thumbnailers->ref_count = 1;
+  thumbnailers->scripts = read_scripts ();
 
-  g_mutex_lock (priv->lock);
+  /* Users of the old snapshot keep it alive until they are done */
+  G_LOCK (thumbnailers);
+  old = priv->thumbnailers;
+  priv->thumbnailers = thumbnailers;
+  G_UNLOCK (thumbnailers);
 
-  if (priv->scripts_hash != NULL)
-    g_hash_table_destroy (priv->scripts_hash);
-  
-  priv->scripts_hash = scripts_hash;
-  
-  g_mutex_unlock (priv->lock);
+  if (old != NULL)
+    thumbnailers_unref (old);
+
+  /* The server commands may have changed */
+  if (priv->server_pool != NULL)
+    _mate_thumbnail_server_pool_clear (priv->server_pool);
 }
 
 static gboolean
@@ -254,6 +513,30 @@ schedule_reread (MateConfClient* client,
   g_mutex_unlock (priv->lock);
 }
 
+static void
+set_thumbnail_dirs (MateThumbnailFactory *factory)
+{
+  MateThumbnailFactoryPrivate *priv = factory->priv;
+
+  g_free (priv->base_dir);
+  g_free (priv->image_dir);
+  g_free (priv->other_image_dir);
+  g_free (priv->fail_dir);
+
+  priv->base_dir = g_build_filename (g_get_home_dir (),
+				     ".thumbnails",
+				     NULL);
+  priv->image_dir = g_build_filename (priv->base_dir,
+				      (priv->size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
+				      NULL);
+  priv->other_image_dir = g_build_filename (priv->base_dir,
+					    (priv->size == MATE_THUMBNAIL_SIZE_NORMAL)?"large":"normal",
+					    NULL);
+  priv->fail_dir = g_build_filename (priv->base_dir,
+				     "fail",
+				     priv->application,
+				     NULL);
+}
 
 static void
 mate_thumbnail_factory_init (MateThumbnailFactory *factory)
@@ -267,11 +550,24 @@ mate_thumbnail_factory_init (MateThumbnailFactory *factory)
 
   priv->size = MATE_THUMBNAIL_SIZE_NORMAL;
   priv->application = g_strdup ("mate-thumbnail-factory");
+  set_thumbnail_dirs (factory);
+
+  priv->png_level = -1;
+  priv->png_filter = MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE;
+
+  priv->stats = _mate_thumbnail_stats_new ();
   
-  priv->scripts_hash = NULL;
+  priv->thumbnailers = NULL;
   
   priv->lock = g_mutex_new ();
 
+  priv->server_pool = _mate_thumbnail_server_pool_new (_mate_thumbnail_get_n_processors ());
+
+  priv->queue = g_sequence_new (NULL);
+  priv->jobs_by_uri = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->next_request_id = 1;
+
   mate_thumbnail_factory_reread_scripts (factory);
 
   client = mateconf_client_get_default ();
@@ -316,10 +612,123 @@ mate_thumbnail_factory_new (MateThumbnailSize size)
   factory = g_object_new (MATE_TYPE_THUMBNAIL_FACTORY, NULL);
   
   factory->priv->size = size;
+  set_thumbnail_dirs (factory);
   
   return factory;
 }
 
+static const char *
+get_image_dir (MateThumbnailFactory *factory,
+	       MateThumbnailSize     size)
+{
+  MateThumbnailFactoryPrivate *priv = factory->priv;
+
+  return size == priv->size ? priv->image_dir : priv->other_image_dir;
+}
+
+/* The index of the @size thumbnails, or with @failed of the failed
+ * thumbnails of the application */
+static MateThumbnailIndex *
+get_index_for_size (MateThumbnailFactory *factory,
+		    MateThumbnailSize     size,
+		    gboolean              failed)
+{
+  MateThumbnailFactoryPrivate *priv = factory->priv;
+  MateThumbnailIndex **indexp, *index;
+  char *path, *name;
+
+  if (failed)
+    indexp = &priv->fail_index;
+  else
+    indexp = size == priv->size ? &priv->index : &priv->other_index;
+
+  g_mutex_lock (priv->lock);
+
+  if (priv->use_index && *indexp == NULL)
+    {
+      if (failed)
+	name = g_strconcat ("mate-index-fail-", priv->application, NULL);
+      else
+	name = g_strconcat ("mate-index-",
+			    (size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
+			    NULL);
+      path = g_build_filename (priv->base_dir, name, NULL);
+
+      *indexp = _mate_thumbnail_index_new (failed ? priv->fail_dir : get_image_dir (factory, size),
+					   path);
+
+      g_free (name);
+      g_free (path);
+    }
+
+  index = priv->use_index ? *indexp : NULL;
+
+  g_mutex_unlock (priv->lock);
+
+  return index;
+}
+
+static MateThumbnailIndex *
+get_index (MateThumbnailFactory *factory,
+	   gboolean              failed)
+{
+  return get_index_for_size (factory, factory->priv->size, failed);
+}
+
+/* Checks the thumbnail at @path, asking the index first if there is
+ * one. @stale is set if there is a thumbnail, but for another mtime. */
+static gboolean
+thumbnail_is_valid (MateThumbnailIndex *index,
+		    const guint8       *digest,
+		    const char         *path,
+		    const char         *uri,
+		    time_t              mtime,
+		    gboolean           *stale)
+{
+  MateThumbnailIndexResult result;
+
+  result = MATE_THUMBNAIL_INDEX_UNKNOWN;
+  if (index != NULL)
+    result = _mate_thumbnail_index_lookup (index, digest, mtime, path);
+
+  *stale = FALSE;
+  switch (result)
+    {
+    case MATE_THUMBNAIL_INDEX_VALID:
+      return TRUE;
+    case MATE_THUMBNAIL_INDEX_STALE:
+      *stale = TRUE;
+      return FALSE;
+    default:
+      break;
+    }
+
+  /* Only the text chunks are needed, don't decode the image data */
+  if (!_mate_thumbnail_png_is_valid (path, uri, mtime, stale))
+    return FALSE;
+
+  if (index != NULL)
+    _mate_thumbnail_index_insert (index, digest, mtime, path);
+
+  return TRUE;
+}
+
+static void
+count_lookup (MateThumbnailStats *stats,
+	      guint64             start,
+	      gboolean            found,
+	      gboolean            stale)
+{
+  _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_LOOKUPS, 1);
+  if (found)
+    _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_HITS, 1);
+  else if (stale)
+    _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_STALE, 1);
+  else
+    _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_MISSES, 1);
+  _mate_thumbnail_stats_stop (stats, MATE_THUMBNAIL_TIMER_LOOKUP, start);
+}
+
 /**
  * mate_thumbnail_factory_lookup:
  * @factory: a #MateThumbnailFactory
@@ -340,46 +749,268 @@ mate_thumbnail_factory_lookup (MateThumbnailFactory *factory,
 				time_t                 mtime)
 {
   MateThumbnailFactoryPrivate *priv = factory->priv;
-  char *path, *file;
-  GChecksum *checksum;
+  char path[THUMBNAIL_PATH_SIZE];
   guint8 digest[16];
-  gsize digest_len = sizeof (digest);
-  GdkPixbuf *pixbuf;
-  gboolean res;
+  gboolean found, stale;
+  guint64 start;
 
   g_return_val_if_fail (uri != NULL, NULL);
 
-  res = FALSE;
+  start = _mate_thumbnail_stats_start (priv->stats);
 
-  checksum = g_checksum_new (G_CHECKSUM_MD5);
-  g_checksum_update (checksum, (const guchar *) uri, strlen (uri));
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
 
-  g_checksum_get_digest (checksum, digest, &digest_len);
-  g_assert (digest_len == 16);
+  stale = FALSE;
+  found = _mate_thumbnail_format_path (priv->image_dir, digest, path, sizeof (path)) < sizeof (path) &&
+    thumbnail_is_valid (get_index (factory, FALSE), digest, path, uri, mtime, &stale);
 
-  file = g_strconcat (g_checksum_get_string (checksum), ".png", NULL);
-  
-  path = g_build_filename (g_get_home_dir (),
-			   ".thumbnails",
-			   (priv->size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
-			   file,
-			   NULL);
-  g_free (file);
-
-  pixbuf = gdk_pixbuf_new_from_file (path, NULL);
-  if (pixbuf != NULL)
+  count_lookup (priv->stats, start, found, stale);
+
+  if (!found)
+    return NULL;
+
+  return g_strdup (path);
+}
+
+static void
+lookup_band_run (LookupBand *band)
+{
+  guint8 digest[16];
+  char path[THUMBNAIL_PATH_SIZE];
+  gboolean found, stale;
+  guint64 start;
+  int i;
+
+  for (i = band->start; i < band->end; i++)
     {
-      res = mate_thumbnail_is_valid (pixbuf, uri, mtime);
-      g_object_unref (pixbuf);
+      band->paths[i] = NULL;
+      if (band->uris[i] == NULL)
+	continue;
+
+      start = _mate_thumbnail_stats_start (band->stats);
+
+      _mate_thumbnail_md5_digest (band->uris[i], strlen (band->uris[i]), digest);
+
+      stale = FALSE;
+      found = _mate_thumbnail_format_path (band->dir, digest, path, sizeof (path)) < sizeof (path) &&
+	thumbnail_is_valid (band->index, digest, path,
+			    band->uris[i], band->mtimes[i], &stale);
+      if (found)
+	band->paths[i] = g_strdup (path);
+
+      count_lookup (band->stats, start, found, stale);
     }
+}
 
-  g_checksum_free (checksum);
+static void
+lookup_band_thread_func (gpointer data,
+			 gpointer user_data)
+{
+  LookupBand *band = data;
+  LookupJob *job = band->job;
 
-  if (res)
-    return path;
+  lookup_band_run (band);
 
-  g_free (path);
-  return NULL;
+  g_mutex_lock (job->lock);
+  job->pending--;
+  if (job->pending == 0)
+    g_cond_signal (job->cond);
+  g_mutex_unlock (job->lock);
+}
+
+/**
+ * mate_thumbnail_factory_lookup_many:
+ * @factory: a #MateThumbnailFactory
+ * @uris: the uris of @n_files files
+ * @mtimes: the mtimes of the files
+ * @n_files: the number of files
+ * @paths: an array of @n_files elements to store the results in
+ *
+ * Does mate_thumbnail_factory_lookup() for many files at once. For
+ * each file, paths[i] is set to the newly allocated absolute path of
+ * its thumbnail, or %NULL if none exists or uris[i] is %NULL.
+ *
+ * Large batches are split among several threads so that the
+ * thumbnail files are read concurrently; the GLib thread system must
+ * be initialized for that, otherwise the files are checked in the
+ * calling thread.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_lookup_many (MateThumbnailFactory *factory,
+				    const char * const   *uris,
+				    const time_t         *mtimes,
+				    int                   n_files,
+				    char                **paths)
+{
+  MateThumbnailFactoryPrivate *priv;
+  MateThumbnailIndex *index;
+  LookupBand *bands;
+  LookupJob job;
+  int i, n_bands;
+
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (n_files >= 0);
+
+  if (n_files == 0)
+    return;
+
+  g_return_if_fail (uris != NULL && mtimes != NULL && paths != NULL);
+
+  priv = factory->priv;
+  index = get_index (factory, FALSE);
+
+  n_bands = 1;
+  if (g_thread_supported ())
+    n_bands = CLAMP (n_files / LOOKUP_BAND_SIZE, 1, MAX_LOOKUP_THREADS);
+
+  job.lock = NULL;
+  job.cond = NULL;
+  job.pending = n_bands - 1;
+
+  bands = g_new (LookupBand, n_bands);
+  for (i = 0; i < n_bands; i++)
+    {
+      bands[i].job = &job;
+      bands[i].index = index;
+      bands[i].stats = priv->stats;
+      bands[i].dir = priv->image_dir;
+      bands[i].uris = uris;
+      bands[i].mtimes = mtimes;
+      bands[i].paths = paths;
+      bands[i].start = (gint64) n_files * i / n_bands;
+      bands[i].end = (gint64) n_files * (i + 1) / n_bands;
+    }
+
+  if (n_bands > 1)
+    {
+      G_LOCK (lookup_pool);
+      if (lookup_pool == NULL)
+	lookup_pool = g_thread_pool_new (lookup_band_thread_func, NULL,
+					 MAX_LOOKUP_THREADS, FALSE, NULL);
+      G_UNLOCK (lookup_pool);
+
+      job.lock = g_mutex_new ();
+      job.cond = g_cond_new ();
+
+      for (i = 1; i < n_bands; i++)
+	g_thread_pool_push (lookup_pool, &bands[i], NULL);
+    }
+
+  lookup_band_run (&bands[0]);
+
+  if (n_bands > 1)
+    {
+      g_mutex_lock (job.lock);
+      while (job.pending > 0)
+	g_cond_wait (job.cond, job.lock);
+      g_mutex_unlock (job.lock);
+
+      g_mutex_free (job.lock);
+      g_cond_free (job.cond);
+    }
+
+  g_free (bands);
+}
+
+static guint
+digest_hash (gconstpointer key)
+{
+  guint hash;
+
+  memcpy (&hash, key, sizeof (hash));
+  return hash;
+}
+
+static gboolean
+digest_equal (gconstpointer a,
+	      gconstpointer b)
+{
+  return memcmp (a, b, 16) == 0;
+}
+
+static GHashTable *
+scan_failed_dir (const char *dir)
+{
+  GHashTable *digests;
+  GDir *gdir;
+  const char *name;
+  guint8 digest[16];
+
+  digests = g_hash_table_new_full (digest_hash, digest_equal, g_free, NULL);
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (gdir != NULL)
+    {
+      while ((name = g_dir_read_name (gdir)) != NULL)
+	{
+	  if (_mate_thumbnail_parse_filename (name, digest))
+	    g_hash_table_insert (digests, g_memdup (digest, 16),
+				 GINT_TO_POINTER (TRUE));
+	}
+      g_dir_close (gdir);
+    }
+
+  return digests;
+}
+
+/* Returns FALSE if there is certainly no failed thumbnail for @digest */
+static gboolean
+failed_thumbnail_may_exist (MateThumbnailFactory *factory,
+			    const guint8         *digest)
+{
+  MateThumbnailFactoryPrivate *priv = factory->priv;
+  GHashTable *digests;
+  struct stat st;
+  time_t now, dir_mtime;
+  gboolean res;
+
+  now = time (NULL);
+
+  g_mutex_lock (priv->lock);
+  if (priv->failed_digests != NULL &&
+      now - priv->last_failed_check < SECONDS_BETWEEN_STATS)
+    {
+      res = g_hash_table_lookup (priv->failed_digests, digest) != NULL;
+      g_mutex_unlock (priv->lock);
+      return res;
+    }
+  priv->last_failed_check = now;
+  g_mutex_unlock (priv->lock);
+
+  dir_mtime = -1;
+  if (g_stat (priv->fail_dir, &st) == 0)
+    dir_mtime = st.st_mtime;
+
+  g_mutex_lock (priv->lock);
+  res = priv->failed_digests != NULL && dir_mtime == priv->failed_dir_mtime;
+  g_mutex_unlock (priv->lock);
+
+  if (!res)
+    {
+      digests = scan_failed_dir (priv->fail_dir);
+
+      /* A file added later in the same second wouldn't change the
+       * mtime, so scan again next time */
+      if (dir_mtime >= now)
+	dir_mtime = -1;
+
+      g_mutex_lock (priv->lock);
+      if (priv->failed_digests != NULL)
+	g_hash_table_destroy (priv->failed_digests);
+      priv->failed_digests = digests;
+      priv->failed_dir_mtime = dir_mtime;
+      g_mutex_unlock (priv->lock);
+    }
+
+  g_mutex_lock (priv->lock);
+  res = g_hash_table_lookup (priv->failed_digests, digest) != NULL;
+  g_mutex_unlock (priv->lock);
+
+  return res;
 }
 
 /**
@@ -403,42 +1034,25 @@ mate_thumbnail_factory_has_valid_failed_thumbnail (MateThumbnailFactory *factory
 						    const char            *uri,
 						    time_t                 mtime)
 {
-  char *path, *file;
-  GdkPixbuf *pixbuf;
-  gboolean res;
-  GChecksum *checksum;
+  char path[THUMBNAIL_PATH_SIZE];
   guint8 digest[16];
-  gsize digest_len = sizeof (digest);
-
-  checksum = g_checksum_new (G_CHECKSUM_MD5);
-  g_checksum_update (checksum, (const guchar *) uri, strlen (uri));
-
-  g_checksum_get_digest (checksum, digest, &digest_len);
-  g_assert (digest_len == 16);
-
-  res = FALSE;
+  gboolean stale;
 
-  file = g_strconcat (g_checksum_get_string (checksum), ".png", NULL);
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
 
-  path = g_build_filename (g_get_home_dir (),
-			   ".thumbnails/fail",
-			   factory->priv->application,
-			   file,
-			   NULL);
-  g_free (file);
+  if (!failed_thumbnail_may_exist (factory, digest))
+    return FALSE;
 
-  pixbuf = gdk_pixbuf_new_from_file (path, NULL);
-  g_free (path);
+  if (_mate_thumbnail_format_path (factory->priv->fail_dir, digest,
+				   path, sizeof (path)) >= sizeof (path))
+    return FALSE;
 
-  if (pixbuf)
-    {
-      res = mate_thumbnail_is_valid (pixbuf, uri, mtime);
-      g_object_unref (pixbuf);
-    }
+  if (!thumbnail_is_valid (get_index (factory, TRUE), digest, path, uri, mtime, &stale))
+    return FALSE;
 
-  g_checksum_free (checksum);
+  _mate_thumbnail_stats_add (factory->priv->stats, MATE_THUMBNAIL_COUNTER_FAILED_HITS, 1);
 
-  return res;
+  return TRUE;
 }
 
 static gboolean
@@ -446,7 +1060,10 @@ mimetype_supported_by_gdk_pixbuf (const char *mime_type)
 {
 	guint i;
 	static GHashTable *formats_hash = NULL;
+	gboolean res;
 
+	/* can_thumbnail() may be called from several threads */
+	G_LOCK (formats_hash);
 	if (!formats_hash) {
 		GSList *formats, *list;
 		
@@ -472,10 +1089,10 @@ mimetype_supported_by_gdk_pixbuf (const char *mime_type)
 		g_slist_free (formats);
 	}
 
-	if (g_hash_table_lookup (formats_hash, mime_type))
-		return TRUE;
+	res = g_hash_table_lookup (formats_hash, mime_type) != NULL;
+	G_UNLOCK (formats_hash);
 
-	return FALSE;
+	return res;
 }
 
 /**
@@ -500,16 +1117,27 @@ mate_thumbnail_factory_can_thumbnail (MateThumbnailFactory *factory,
 				       const char            *mime_type,
 				       time_t                 mtime)
 {
+  Thumbnailers *thumbnailers;
+  gboolean supported;
+
   /* Don't thumbnail thumbnails */
   if (uri &&
       strncmp (uri, "file:/", 6) == 0 &&
       strstr (uri, "/.thumbnails/") != NULL)
     return FALSE;
+
+  if (mime_type == NULL)
+    return FALSE;
+
+  supported = mimetype_supported_by_gdk_pixbuf (mime_type);
+  if (!supported)
+    {
+      thumbnailers = thumbnailers_get (factory);
+      supported = thumbnailers_lookup (thumbnailers, mime_type) != NULL;
+      thumbnailers_unref (thumbnailers);
+    }
   
-  if (mime_type != NULL &&
-      (mimetype_supported_by_gdk_pixbuf (mime_type) ||
-       (factory->priv->scripts_hash != NULL &&
-	g_hash_table_lookup (factory->priv->scripts_hash, mime_type))))
+  if (supported)
     {
       return !mate_thumbnail_factory_has_valid_failed_thumbnail (factory,
 								  uri,
@@ -592,15 +1220,14 @@ expand_thumbnailing_script (const char *script,
 }
 
 
+/* A MateThumbnailSizeFunc */
 static void
-size_prepared_cb (GdkPixbufLoader *loader, 
-		  int              width,
-		  int              height,
-		  gpointer         data)
+prepare_size (int      *width_inout,
+	      int      *height_inout,
+	      gpointer  data)
 {
 	SizePrepareContext *info = data;
-
-	g_return_if_fail (width > 0 && height > 0);
+	int width = *width_inout, height = *height_inout;
 
 	info->input_width = width;
 	info->input_height = height;
@@ -634,11 +1261,154 @@ size_prepared_cb (GdkPixbufLoader *loader,
 			height = info->height;
 	}
 	
-	gdk_pixbuf_loader_set_size (loader, width, height);
+	*width_inout = width;
+	*height_inout = height;
 }
 
-
-/**
+static void
+size_prepared_cb (GdkPixbufLoader *loader, 
+		  int              width,
+		  int              height,
+		  gpointer         data)
+{
+	int scaled_width = width, scaled_height = height;
+
+	g_return_if_fail (width > 0 && height > 0);
+
+	prepare_size (&scaled_width, &scaled_height, data);
+	if (scaled_width != width || scaled_height != height)
+		gdk_pixbuf_loader_set_size (loader, scaled_width, scaled_height);
+}
+
+static void
+area_updated_cb (GdkPixbufLoader *loader,
+		 int              x,
+		 int              y,
+		 int              width,
+		 int              height,
+		 gpointer         data)
+{
+	SizePrepareContext *info = data;
+
+	info->updated = TRUE;
+}
+
+static gboolean
+load_source_open (LoadSource *source,
+		  GFile      *file)
+{
+    GFileInputStream *file_input_stream;
+    char *path;
+
+    memset (source, 0, sizeof (LoadSource));
+    source->fd = -1;
+
+    if (g_file_is_native (file)) {
+	path = g_file_get_path (file);
+	if (path != NULL)
+	    source->fd = g_open (path, O_RDONLY, 0);
+	g_free (path);
+
+	if (source->fd != -1) {
+	    source->buffer_size = READ_SLICE_SIZE;
+	    source->buffer = g_malloc (source->buffer_size);
+	    return TRUE;
+	}
+    }
+
+    file_input_stream = g_file_read (file, NULL, NULL);
+    if (file_input_stream == NULL)
+	return FALSE;
+
+    source->stream = G_INPUT_STREAM (file_input_stream);
+    source->buffer_size = LOAD_BUFFER_SIZE;
+    source->buffer = g_malloc (source->buffer_size);
+
+    return TRUE;
+}
+
+/* Returns FALSE on error, a length of 0 at the end of the data */
+static gboolean
+load_source_read (LoadSource    *source,
+		  const guchar **data,
+		  gsize         *length)
+{
+    gssize bytes_read;
+
+    if (source->fd != -1) {
+	do
+	    bytes_read = read (source->fd, source->buffer, source->buffer_size);
+	while (bytes_read == -1 && errno == EINTR);
+	if (bytes_read < 0)
+	    return FALSE;
+
+	*data = source->buffer;
+	*length = bytes_read;
+	source->bytes_read += bytes_read;
+	return TRUE;
+    }
+
+    /* A full buffer means the stream has more data ready than we ask for */
+    if (source->buffer_filled && source->buffer_size < MAX_LOAD_BUFFER_SIZE) {
+	source->buffer_size *= 2;
+	g_free (source->buffer);
+	source->buffer = g_malloc (source->buffer_size);
+    }
+
+    bytes_read = g_input_stream_read (source->stream,
+				      source->buffer,
+				      source->buffer_size,
+				      NULL,
+				      NULL);
+    if (bytes_read < 0)
+	return FALSE;
+
+    source->buffer_filled = (gsize) bytes_read == source->buffer_size;
+    *data = source->buffer;
+    *length = bytes_read;
+    source->bytes_read += bytes_read;
+
+    return TRUE;
+}
+
+/* A MateThumbnailReadFunc */
+static gboolean
+load_source_read_func (gpointer       data,
+		       const guchar **buffer,
+		       gsize         *length)
+{
+    return load_source_read (data, buffer, length);
+}
+
+static void
+load_source_close (LoadSource *source)
+{
+    if (source->fd != -1)
+	close (source->fd);
+
+    if (source->stream != NULL) {
+	g_input_stream_close (source->stream, NULL, NULL);
+	g_object_unref (source->stream);
+    }
+
+    g_free (source->buffer);
+}
+
+static void
+set_original_size (GdkPixbuf          *pixbuf,
+		   SizePrepareContext *info,
+		   gsize               bytes_read)
+{
+	g_object_set_data (G_OBJECT (pixbuf), "mate-original-width",
+			   GINT_TO_POINTER (info->input_width));
+	g_object_set_data (G_OBJECT (pixbuf), "mate-original-height",
+			   GINT_TO_POINTER (info->input_height));
+	g_object_set_data (G_OBJECT (pixbuf), "mate-bytes-read",
+			   GSIZE_TO_POINTER (bytes_read));
+}
+
+
+/**
  * mate_gdk_pixbuf_new_from_uri_at_scale:
  * @uri: the uri of an image
  * @width: The width the image should have or -1 to not constrain the width
@@ -662,9 +1432,10 @@ mate_gdk_pixbuf_new_from_uri_at_scale (const char *uri,
 					gint        height,
 					gboolean    preserve_aspect_ratio)
 {
-    GError *result;
-    char buffer[LOAD_BUFFER_SIZE];
-    guint64 bytes_read;
+    LoadSource source;
+    const guchar *data;
+    gsize length;
+    gboolean failed;
     GdkPixbufLoader *loader;
     GdkPixbuf *pixbuf;	
     GdkPixbufAnimation *animation;
@@ -672,84 +1443,90 @@ mate_gdk_pixbuf_new_from_uri_at_scale (const char *uri,
     gboolean has_frame;
     SizePrepareContext info;
     GFile *file;
-    GFileInputStream *file_input_stream;
 
     g_return_val_if_fail (uri != NULL, NULL);
 
     file = g_file_new_for_uri (uri);
-    file_input_stream = g_file_read (file, NULL, NULL);
-    if (file_input_stream == NULL) {
+    if (!load_source_open (&source, file)) {
 	g_object_unref (file);
 	return NULL;
     }
+    g_object_unref (file);
+
+    info.width = width;
+    info.height = height;
+    info.input_width = info.input_height = 0;
+    info.preserve_aspect_ratio = preserve_aspect_ratio;
+    info.updated = FALSE;
+
+    if (!load_source_read (&source, &data, &length)) {
+	load_source_close (&source);
+	return NULL;
+    }
+
+    /* gdk-pixbuf decodes PNG files at full size whatever size is asked
+     * for; libpng lets them be scaled down row by row instead */
+    if ((1 <= width || 1 <= height) && _mate_thumbnail_png_can_load (data, length)) {
+	pixbuf = _mate_thumbnail_png_load (data, length,
+					   load_source_read_func, &source,
+					   prepare_size, &info,
+					   &info.input_width, &info.input_height);
+	load_source_close (&source);
+	if (pixbuf != NULL)
+	    set_original_size (pixbuf, &info, source.bytes_read);
+	return pixbuf;
+    }
 
     loader = gdk_pixbuf_loader_new ();
     if (1 <= width || 1 <= height) {
-        info.width = width;
-        info.height = height;
-	info.input_width = info.input_height = 0;
-        info.preserve_aspect_ratio = preserve_aspect_ratio;        
         g_signal_connect (loader, "size-prepared", G_CALLBACK (size_prepared_cb), &info);
     }
+    g_signal_connect (loader, "area-updated", G_CALLBACK (area_updated_cb), &info);
 
     has_frame = FALSE;
+    failed = FALSE;
+    animation = NULL;
 
-    result = G_IO_ERROR_FAILED;
-    while (!has_frame) {
-
-	bytes_read = g_input_stream_read (G_INPUT_STREAM (file_input_stream),
-					  buffer,
-					  sizeof (buffer),
-					  NULL,
-					  NULL);
-	if (bytes_read == -1) {
-	    break;
-	}
-	result = NULL;
-	if (bytes_read == 0) {
+    while (length > 0) {
+	if (!gdk_pixbuf_loader_write (loader, data, length, NULL)) {
+	    failed = TRUE;
 	    break;
 	}
 
-	if (!gdk_pixbuf_loader_write (loader,
-				      (unsigned char *)buffer,
-				      bytes_read,
-				      NULL)) {
-	    result = G_IO_ERROR_INVALID_DATA;
-	    break;
-	}
+	/* A frame can only have been completed by a write that decoded
+	 * some pixels, and static images are never done before EOF. */
+	if (info.updated) {
+	    info.updated = FALSE;
 
-	animation = gdk_pixbuf_loader_get_animation (loader);
-	if (animation) {
+	    if (animation == NULL)
+		animation = gdk_pixbuf_loader_get_animation (loader);
+	    if (animation != NULL && !gdk_pixbuf_animation_is_static_image (animation)) {
 		iter = gdk_pixbuf_animation_get_iter (animation, NULL);
-		if (!gdk_pixbuf_animation_iter_on_currently_loading_frame (iter)) {
-			has_frame = TRUE;
-		}
+		has_frame = !gdk_pixbuf_animation_iter_on_currently_loading_frame (iter);
 		g_object_unref (iter);
+		if (has_frame)
+		    break;
+	    }
+	}
+
+	if (!load_source_read (&source, &data, &length)) {
+	    failed = TRUE;
+	    break;
 	}
     }
 
     gdk_pixbuf_loader_close (loader, NULL);
+    load_source_close (&source);
     
-    if (result != NULL) {
+    if (failed) {
 	g_object_unref (G_OBJECT (loader));
-	g_input_stream_close (G_INPUT_STREAM (file_input_stream), NULL, NULL);
-	g_object_unref (file_input_stream);
-	g_object_unref (file);
-	g_error_free (result);
 	return NULL;
     }
 
-    g_input_stream_close (G_INPUT_STREAM (file_input_stream), NULL, NULL);
-    g_object_unref (file_input_stream);
-    g_object_unref (file);
-
     pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
     if (pixbuf != NULL) {
 	g_object_ref (G_OBJECT (pixbuf));
-	g_object_set_data (G_OBJECT (pixbuf), "mate-original-width",
-			   GINT_TO_POINTER (info.input_width));
-	g_object_set_data (G_OBJECT (pixbuf), "mate-original-height",
-			   GINT_TO_POINTER (info.input_height));
+	set_original_size (pixbuf, &info, source.bytes_read);
     }
     g_object_unref (G_OBJECT (loader));
 
@@ -757,52 +1534,200 @@ mate_gdk_pixbuf_new_from_uri_at_scale (const char *uri,
 }
 
 
-/**
- * mate_thumbnail_factory_generate_thumbnail:
- * @factory: a #MateThumbnailFactory
- * @uri: the uri of a file
- * @mime_type: the mime type of the file
- *
- * Tries to generate a thumbnail for the specified file. If it succeeds
- * it returns a pixbuf that can be used as a thumbnail.
- *
- * Usage of this function is threadsafe.
- *
- * Return value: thumbnail pixbuf if thumbnailing succeeded, %NULL otherwise.
- *
- * Since: 2.2
- **/
-GdkPixbuf *
-mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
-					    const char            *uri,
-					    const char            *mime_type)
+/* Returns a new reference to @pixbuf scaled down to fit in @size
+ * pixels, keeping the original dimensions it recorded */
+static GdkPixbuf *
+fit_thumbnail (MateThumbnailFactory *factory,
+	       GdkPixbuf            *pixbuf,
+	       int                   size)
+{
+  GdkPixbuf *scaled;
+  const gchar *orig_width, *orig_height;
+  int width, height;
+  double scale;
+  guint64 start;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+
+  if (width <= size && height <= size)
+    return g_object_ref (pixbuf);
+
+  scale = (double)size / MAX (width, height);
+
+  start = _mate_thumbnail_stats_start (factory->priv->stats);
+  scaled = mate_thumbnail_scale_down_pixbuf (pixbuf,
+					      floor (width * scale + 0.5),
+					      floor (height * scale + 0.5));
+  _mate_thumbnail_stats_stop (factory->priv->stats, MATE_THUMBNAIL_TIMER_SCALE, start);
+
+  orig_width = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::Image::Width");
+  orig_height = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::Image::Height");
+
+  if (orig_width != NULL) {
+	  gdk_pixbuf_set_option (scaled, "tEXt::Thumb::Image::Width", orig_width);
+  }
+  if (orig_height != NULL) {
+	  gdk_pixbuf_set_option (scaled, "tEXt::Thumb::Image::Height", orig_height);
+  }
+
+  return scaled;
+}
+
+/* The types load_image_at_size() looks at: JPEG, and TIFF based camera
+ * raw formats, which have an Exif preview in their first IFDs */
+static const char *fast_path_mime_types[] = {
+  "image/jpeg",
+  "image/tiff",
+  "image/x-adobe-dng",
+  "image/x-canon-cr2",
+  "image/x-kodak-dcr",
+  "image/x-nikon-nef",
+  "image/x-olympus-orf",
+  "image/x-panasonic-raw",
+  "image/x-panasonic-rw2",
+  "image/x-pentax-pef",
+  "image/x-samsung-srw",
+  "image/x-sony-arw",
+  "image/x-sony-sr2",
+  NULL
+};
+
+/* Reads up to @length bytes at @offset; fewer if the file is shorter */
+static gsize
+read_at (int     fd,
+	 guchar *buffer,
+	 gsize   length,
+	 off_t   offset)
+{
+  gsize done;
+  gssize res;
+
+  done = 0;
+  while (done < length)
+    {
+      res = pread (fd, buffer + done, length - done, offset + done);
+      if (res == -1 && errno == EINTR)
+	continue;
+      if (res <= 0)
+	break;
+      done += res;
+    }
+
+  return done;
+}
+
+/* Decodes local camera pictures and JPEG files straight at @size,
+ * from their Exif preview if it is large enough, else with libjpeg
+ * skipping most of the work. Returns NULL for anything else, which
+ * is left to mate_gdk_pixbuf_new_from_uri_at_scale(). */
+static GdkPixbuf *
+load_image_at_size (const char *uri,
+		    const char *mime_type,
+		    int         size,
+		    int        *original_width,
+		    int        *original_height,
+		    gsize      *bytes_read)
+{
+  GdkPixbuf *pixbuf;
+  guchar header[4], *data;
+  struct stat st;
+  gsize length;
+  char *path;
+  int fd, i;
+
+  for (i = 0; fast_path_mime_types[i] != NULL; i++)
+    if (strcmp (mime_type, fast_path_mime_types[i]) == 0)
+      break;
+  if (fast_path_mime_types[i] == NULL)
+    return NULL;
+
+  path = g_filename_from_uri (uri, NULL, NULL);
+  if (path == NULL)
+    return NULL;
+  fd = g_open (path, O_RDONLY, 0);
+  g_free (path);
+  if (fd == -1)
+    return NULL;
+
+  /* Mime types are often guessed from the name; check the contents */
+  if (read_at (fd, header, sizeof (header), 0) != sizeof (header) ||
+      (!_mate_thumbnail_is_jpeg (header, sizeof (header)) &&
+       memcmp (header, "II\52\0", 4) != 0 &&
+       memcmp (header, "MM\0\52", 4) != 0) ||
+      fstat (fd, &st) != 0 || st.st_size > MAX_FAST_PATH_SIZE)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* Read, not mapped: a file that shrinks meanwhile just comes out
+   * short, which the decoders handle. The rest of the file is only
+   * read if the preview isn't in the first part. */
+  data = g_malloc (st.st_size);
+  length = read_at (fd, data, MIN (st.st_size, FAST_PATH_PREFIX_SIZE), 0);
+  pixbuf = _mate_thumbnail_load_embedded (data, length,
+					  size, size,
+					  original_width, original_height);
+
+  if (pixbuf == NULL && length == FAST_PATH_PREFIX_SIZE)
+    {
+      length += read_at (fd, data + length, st.st_size - length, length);
+      pixbuf = _mate_thumbnail_load_embedded (data, length,
+					      size, size,
+					      original_width, original_height);
+    }
+  close (fd);
+  *bytes_read = length;
+
+  if (pixbuf == NULL && _mate_thumbnail_is_jpeg (data, length))
+    pixbuf = _mate_thumbnail_jpeg_load (data, length,
+					size, size,
+					original_width, original_height);
+  g_free (data);
+
+  return pixbuf;
+}
+
+static GdkPixbuf *
+generate_thumbnail_at_size (MateThumbnailFactory *factory,
+			    const char           *uri,
+			    const char           *mime_type,
+			    int                   size)
 {
+  MateThumbnailStats *stats = factory->priv->stats;
   GdkPixbuf *pixbuf, *scaled, *tmp_pixbuf;
-  char *script, *expanded_script;
-  int width, height, size;
+  Thumbnailers *thumbnailers;
+  ThumbnailerScript *script;
+  char *expanded_script;
   int original_width = 0;
   int original_height = 0;
   char dimension[12];
-  double scale;
   int exit_status;
   char *tmpname;
-
-  g_return_val_if_fail (uri != NULL, NULL);
-  g_return_val_if_fail (mime_type != NULL, NULL);
+  gboolean external;
+  guint64 start;
 
   /* Doesn't access any volatile fields in factory, so it's threadsafe */
-  
-  size = 128;
-  if (factory->priv->size == MATE_THUMBNAIL_SIZE_LARGE)
-    size = 256;
 
   pixbuf = NULL;
+  start = _mate_thumbnail_stats_start (stats);
 
-  script = NULL;
-  if (factory->priv->scripts_hash != NULL)
-    script = g_hash_table_lookup (factory->priv->scripts_hash, mime_type);
-  
-  if (script)
+  /* Stays valid even if the configuration changes meanwhile */
+  thumbnailers = thumbnailers_get (factory);
+  script = thumbnailers_lookup (thumbnailers, mime_type);
+  external = script != NULL &&
+    (script->server_command != NULL || script->command != NULL);
+
+  /* A running thumbnailer avoids the process startup for every file */
+  if (script != NULL && script->server_command != NULL)
+    {
+      _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_SERVER_REQUESTS, 1);
+      pixbuf = _mate_thumbnail_server_pool_run (factory->priv->server_pool,
+						script->server_command, uri, size);
+    }
+
+  if (pixbuf == NULL && script != NULL && script->command != NULL)
     {
       int fd;
 
@@ -812,7 +1737,9 @@ mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
 	{
 	  close (fd);
 
-	  expanded_script = expand_thumbnailing_script (script, size, uri, tmpname);
+	  expanded_script = expand_thumbnailing_script (script->command, size, uri, tmpname);
+	  if (expanded_script != NULL)
+	    _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_SCRIPT_SPAWNS, 1);
 	  if (expanded_script != NULL &&
 	      g_spawn_command_line_sync (expanded_script,
 					 NULL, NULL, &exit_status, NULL) &&
@@ -827,22 +1754,51 @@ mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
 	}
     }
 
-  /* Fall back to gdk-pixbuf */
+  thumbnailers_unref (thumbnailers);
+
+  if (external)
+    _mate_thumbnail_stats_stop (stats, MATE_THUMBNAIL_TIMER_EXTERNAL, start);
+
   if (pixbuf == NULL)
     {
-      pixbuf = mate_gdk_pixbuf_new_from_uri_at_scale (uri, size, size, TRUE);
+      gsize bytes_read = 0;
+
+      start = _mate_thumbnail_stats_start (stats);
+
+      pixbuf = load_image_at_size (uri, mime_type, size,
+				   &original_width, &original_height,
+				   &bytes_read);
+      _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_BYTES_READ,
+				 bytes_read);
+
+      /* Fall back to gdk-pixbuf */
+      if (pixbuf == NULL)
+	{
+	  pixbuf = mate_gdk_pixbuf_new_from_uri_at_scale (uri, size, size, TRUE);
 
-      if (pixbuf != NULL)
-        {
-          original_width = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (pixbuf),
-                                                               "mate-original-width"));
-          original_height = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (pixbuf),
-                                                                "mate-original-height"));
-        }
+	  if (pixbuf != NULL)
+	    {
+	      original_width = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (pixbuf),
+								   "mate-original-width"));
+	      original_height = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (pixbuf),
+								    "mate-original-height"));
+	      _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_BYTES_READ,
+					 GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (pixbuf),
+									      "mate-bytes-read")));
+	    }
+	}
+
+      _mate_thumbnail_stats_stop (stats, MATE_THUMBNAIL_TIMER_DECODE, start);
     }
       
   if (pixbuf == NULL)
-    return NULL;
+    {
+      _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_GENERATION_FAILURES, 1);
+      return NULL;
+    }
+
+  _mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_GENERATIONS, 1);
+  _mate_thumbnail_stats_add_mime_type (stats, mime_type);
 
   /* The pixbuf loader may attach an "orientation" option to the pixbuf,
      if the tiff or exif jpeg file had an orientation tag. Rotate/flip
@@ -851,32 +1807,10 @@ mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
   g_object_unref (pixbuf);
   pixbuf = tmp_pixbuf;
 
-  width = gdk_pixbuf_get_width (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
-  
-  if (width > size || height > size)
-    {
-      const gchar *orig_width, *orig_height;
-      scale = (double)size / MAX (width, height);
-
-      scaled = mate_thumbnail_scale_down_pixbuf (pixbuf,
-						  floor (width * scale + 0.5),
-						  floor (height * scale + 0.5));
-
-      orig_width = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::Image::Width");
-      orig_height = gdk_pixbuf_get_option (pixbuf, "tEXt::Thumb::Image::Height");
+  scaled = fit_thumbnail (factory, pixbuf, size);
+  g_object_unref (pixbuf);
+  pixbuf = scaled;
 
-      if (orig_width != NULL) {
-	      gdk_pixbuf_set_option (scaled, "tEXt::Thumb::Image::Width", orig_width);
-      }
-      if (orig_height != NULL) {
-	      gdk_pixbuf_set_option (scaled, "tEXt::Thumb::Image::Height", orig_height);
-      }
-      
-      g_object_unref (pixbuf);
-      pixbuf = scaled;
-    }
-  
   if (original_width > 0) {
 	  g_snprintf (dimension, sizeof (dimension), "%i", original_width);
 	  gdk_pixbuf_set_option (pixbuf, "tEXt::Thumb::Image::Width", dimension);
@@ -889,193 +1823,285 @@ mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
   return pixbuf;
 }
 
+/**
+ * mate_thumbnail_factory_generate_thumbnail:
+ * @factory: a #MateThumbnailFactory
+ * @uri: the uri of a file
+ * @mime_type: the mime type of the file
+ *
+ * Tries to generate a thumbnail for the specified file. If it succeeds
+ * it returns a pixbuf that can be used as a thumbnail.
+ *
+ * External thumbnailers are registered under /desktop/mate/thumbnailers
+ * with a "command" key, which is run once for every file, and/or a
+ * "server_command" key. A server command is started once and kept
+ * running, up to one process per processor; it reads "<size> <uri>"
+ * lines on its standard input and answers each with a line holding
+ * the length of the image that follows on its standard output, or 0
+ * if it failed.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Return value: thumbnail pixbuf if thumbnailing succeeded, %NULL otherwise.
+ *
+ * Since: 2.2
+ **/
+GdkPixbuf *
+mate_thumbnail_factory_generate_thumbnail (MateThumbnailFactory *factory,
+					    const char            *uri,
+					    const char            *mime_type)
+{
+  g_return_val_if_fail (uri != NULL, NULL);
+  g_return_val_if_fail (mime_type != NULL, NULL);
+
+  return generate_thumbnail_at_size (factory, uri, mime_type,
+				     factory->priv->size == MATE_THUMBNAIL_SIZE_LARGE ? 256 : 128);
+}
+
+/* Only called once creating a file failed, so mkdir() can tell which
+ * directories were missing without stat()ing them first */
 static gboolean
-make_thumbnail_dirs (MateThumbnailFactory *factory)
+make_thumbnail_dirs (MateThumbnailFactory *factory,
+		     const char           *image_dir)
 {
-  char *thumbnail_dir;
-  char *image_dir;
+  MateThumbnailFactoryPrivate *priv = factory->priv;
   gboolean res;
 
   res = FALSE;
 
-  thumbnail_dir = g_build_filename (g_get_home_dir (),
-				    ".thumbnails",
-				    NULL);
-  if (!g_file_test (thumbnail_dir, G_FILE_TEST_IS_DIR))
-    {
-      g_mkdir (thumbnail_dir, 0700);
-      res = TRUE;
-    }
-
-  image_dir = g_build_filename (thumbnail_dir,
-				(factory->priv->size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
-				NULL);
-  if (!g_file_test (image_dir, G_FILE_TEST_IS_DIR))
-    {
-      g_mkdir (image_dir, 0700);
-      res = TRUE;
-    }
+  if (g_mkdir (priv->base_dir, 0700) == 0)
+    res = TRUE;
+  if (g_mkdir (image_dir, 0700) == 0)
+    res = TRUE;
 
-  g_free (thumbnail_dir);
-  g_free (image_dir);
-  
   return res;
 }
 
 static gboolean
 make_thumbnail_fail_dirs (MateThumbnailFactory *factory)
 {
-  char *thumbnail_dir;
+  MateThumbnailFactoryPrivate *priv = factory->priv;
   char *fail_dir;
-  char *app_dir;
   gboolean res;
 
   res = FALSE;
 
-  thumbnail_dir = g_build_filename (g_get_home_dir (),
-				    ".thumbnails",
-				    NULL);
-  if (!g_file_test (thumbnail_dir, G_FILE_TEST_IS_DIR))
-    {
-      g_mkdir (thumbnail_dir, 0700);
-      res = TRUE;
-    }
-
-  fail_dir = g_build_filename (thumbnail_dir,
-			       "fail",
-			       NULL);
-  if (!g_file_test (fail_dir, G_FILE_TEST_IS_DIR))
-    {
-      g_mkdir (fail_dir, 0700);
-      res = TRUE;
-    }
+  fail_dir = g_path_get_dirname (priv->fail_dir);
 
-  app_dir = g_build_filename (fail_dir,
-			      factory->priv->application,
-			      NULL);
-  if (!g_file_test (app_dir, G_FILE_TEST_IS_DIR))
-    {
-      g_mkdir (app_dir, 0700);
-      res = TRUE;
-    }
+  if (g_mkdir (priv->base_dir, 0700) == 0)
+    res = TRUE;
+  if (g_mkdir (fail_dir, 0700) == 0)
+    res = TRUE;
+  if (g_mkdir (priv->fail_dir, 0700) == 0)
+    res = TRUE;
 
-  g_free (thumbnail_dir);
   g_free (fail_dir);
-  g_free (app_dir);
-  
+
   return res;
 }
 
 
-/**
- * mate_thumbnail_factory_save_thumbnail:
- * @factory: a #MateThumbnailFactory
- * @thumbnail: the thumbnail as a pixbuf 
- * @uri: the uri of a file
- * @original_mtime: the modification time of the original file 
- *
- * Saves @thumbnail at the right place. If the save fails a
- * failed thumbnail is written.
- *
- * Usage of this function is threadsafe.
- *
- * Since: 2.2
- **/
-void
-mate_thumbnail_factory_save_thumbnail (MateThumbnailFactory *factory,
-					GdkPixbuf             *thumbnail,
-					const char            *uri,
-					time_t                 original_mtime)
+static void
+save_thumbnail_for_size (MateThumbnailFactory *factory,
+			 GdkPixbuf            *thumbnail,
+			 const char           *uri,
+			 time_t                original_mtime,
+			 MateThumbnailSize     size)
 {
   MateThumbnailFactoryPrivate *priv = factory->priv;
-  char *path, *file, *dir;
-  char *tmp_path;
+  MateThumbnailIndex *index;
+  const char *image_dir;
+  char path[THUMBNAIL_PATH_SIZE];
+  char tmp_path[THUMBNAIL_PATH_SIZE + 7];
+  const char *keys[6], *values[6];
   const char *width, *height;
-  int tmp_fd;
+  int tmp_fd, n;
   char mtime_str[21];
   gboolean saved_ok;
-  GChecksum *checksum;
   guint8 digest[16];
-  gsize digest_len = sizeof (digest);
+  gsize len;
+  off_t written;
+  guint64 start;
 
-  checksum = g_checksum_new (G_CHECKSUM_MD5);
-  g_checksum_update (checksum, (const guchar *) uri, strlen (uri));
-
-  g_checksum_get_digest (checksum, digest, &digest_len);
-  g_assert (digest_len == 16);
-
-  file = g_strconcat (g_checksum_get_string (checksum), ".png", NULL);
-  
-  dir = g_build_filename (g_get_home_dir (),
-			  ".thumbnails",
-			  (priv->size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
-			  NULL);
-  
-  path = g_build_filename (dir,
-			   file,
-			   NULL);
-  g_free (file);
+  start = _mate_thumbnail_stats_start (priv->stats);
 
-  g_checksum_free (checksum);
+  image_dir = get_image_dir (factory, size);
 
-  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
+
+  len = _mate_thumbnail_format_path (image_dir, digest, path, sizeof (path));
+  if (len >= sizeof (path))
+    {
+      mate_thumbnail_factory_create_failed_thumbnail (factory, uri, original_mtime);
+      return;
+    }
+  memcpy (tmp_path, path, len);
+  strcpy (tmp_path + len, ".XXXXXX");
 
   tmp_fd = g_mkstemp (tmp_path);
   if (tmp_fd == -1 &&
-      make_thumbnail_dirs (factory))
+      make_thumbnail_dirs (factory, image_dir))
     {
-      g_free (tmp_path);
-      tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+      strcpy (tmp_path + len, ".XXXXXX");
       tmp_fd = g_mkstemp (tmp_path);
     }
 
   if (tmp_fd == -1)
     {
       mate_thumbnail_factory_create_failed_thumbnail (factory, uri, original_mtime);
-      g_free (dir);
-      g_free (tmp_path);
-      g_free (path);
       return;
     }
-  close (tmp_fd);
-  
+
   g_snprintf (mtime_str, 21, "%ld",  original_mtime);
   width = gdk_pixbuf_get_option (thumbnail, "tEXt::Thumb::Image::Width");
   height = gdk_pixbuf_get_option (thumbnail, "tEXt::Thumb::Image::Height");
 
-  if (width != NULL && height != NULL) 
-    saved_ok  = gdk_pixbuf_save (thumbnail,
-				 tmp_path,
-				 "png", NULL,
-				 "tEXt::Thumb::Image::Width", width,
-				 "tEXt::Thumb::Image::Height", height,
-				 "tEXt::Thumb::URI", uri,
-				 "tEXt::Thumb::MTime", mtime_str,
-				 "tEXt::Software", "MATE::ThumbnailFactory",
-				 NULL);
-  else
-    saved_ok  = gdk_pixbuf_save (thumbnail,
-				 tmp_path,
-				 "png", NULL,
-				 "tEXt::Thumb::URI", uri,
-				 "tEXt::Thumb::MTime", mtime_str,
-				 "tEXt::Software", "MATE::ThumbnailFactory",
-				 NULL);
-    
+  n = 0;
+  if (width != NULL && height != NULL)
+    {
+      keys[n] = "Thumb::Image::Width";
+      values[n++] = width;
+      keys[n] = "Thumb::Image::Height";
+      values[n++] = height;
+    }
+  keys[n] = "Thumb::URI";
+  values[n++] = uri;
+  keys[n] = "Thumb::MTime";
+  values[n++] = mtime_str;
+  keys[n] = "Software";
+  values[n++] = "MATE::ThumbnailFactory";
+  keys[n] = NULL;
+  values[n] = NULL;
+
+  /* g_mkstemp() already created the file with mode 0600 */
+  saved_ok = _mate_thumbnail_png_write (tmp_fd, thumbnail, keys, values,
+					priv->png_level, priv->png_filter);
+  written = lseek (tmp_fd, 0, SEEK_CUR);
+  if (close (tmp_fd) != 0)
+    saved_ok = FALSE;
+
+  if (written > 0)
+    _mate_thumbnail_stats_add (priv->stats, MATE_THUMBNAIL_COUNTER_BYTES_WRITTEN, written);
 
   if (saved_ok)
     {
-      g_chmod (tmp_path, 0600);
-      g_rename(tmp_path, path);
+      if ((index = get_index_for_size (factory, size, FALSE)) != NULL)
+	_mate_thumbnail_index_rename (index, digest, original_mtime, tmp_path, path);
+      else
+	g_rename (tmp_path, path);
     }
   else
     {
+      g_unlink (tmp_path);
       mate_thumbnail_factory_create_failed_thumbnail (factory, uri, original_mtime);
     }
 
-  g_free (dir);
-  g_free (path);
-  g_free (tmp_path);
+  _mate_thumbnail_stats_stop (priv->stats, MATE_THUMBNAIL_TIMER_SAVE, start);
+}
+
+/**
+ * mate_thumbnail_factory_save_thumbnail:
+ * @factory: a #MateThumbnailFactory
+ * @thumbnail: the thumbnail as a pixbuf 
+ * @uri: the uri of a file
+ * @original_mtime: the modification time of the original file 
+ *
+ * Saves @thumbnail at the right place. If the save fails a
+ * failed thumbnail is written.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Since: 2.2
+ **/
+void
+mate_thumbnail_factory_save_thumbnail (MateThumbnailFactory *factory,
+					GdkPixbuf             *thumbnail,
+					const char            *uri,
+					time_t                 original_mtime)
+{
+  save_thumbnail_for_size (factory, thumbnail, uri, original_mtime,
+			   factory->priv->size);
+}
+
+/**
+ * mate_thumbnail_factory_generate_thumbnails:
+ * @factory: a #MateThumbnailFactory
+ * @uri: the uri of a file
+ * @mime_type: the mime type of the file
+ * @original_mtime: the modification time of the file
+ * @sizes: the sizes of the thumbnails to create
+ * @n_sizes: the number of elements in @sizes
+ * @thumbnails: an array of @n_sizes pixbufs to store the thumbnails in, or %NULL
+ *
+ * Generates and saves thumbnails of several sizes for the file, which
+ * is only read once: the thumbnail of the largest size is generated as
+ * with mate_thumbnail_factory_generate_thumbnail() and scaled down for
+ * the others. Unlike the rest of the factory, this is not limited to
+ * the size @factory was created for.
+ *
+ * If no thumbnail can be generated a failed thumbnail is written.
+ * Otherwise, if @thumbnails is not %NULL, it is filled with a new
+ * reference to the thumbnail of each size.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Return value: %TRUE if thumbnailing succeeded.
+ *
+ * Since: 1.5
+ **/
+gboolean
+mate_thumbnail_factory_generate_thumbnails (MateThumbnailFactory    *factory,
+					     const char              *uri,
+					     const char              *mime_type,
+					     time_t                   original_mtime,
+					     const MateThumbnailSize *sizes,
+					     int                      n_sizes,
+					     GdkPixbuf              **thumbnails)
+{
+  GdkPixbuf *pixbuf, *thumbnail;
+  int i, size, max_size;
+
+  g_return_val_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory), FALSE);
+  g_return_val_if_fail (uri != NULL, FALSE);
+  g_return_val_if_fail (mime_type != NULL, FALSE);
+  g_return_val_if_fail (sizes != NULL || n_sizes == 0, FALSE);
+
+  max_size = 0;
+  for (i = 0; i < n_sizes; i++)
+    {
+      size = sizes[i] == MATE_THUMBNAIL_SIZE_LARGE ? 256 : 128;
+      max_size = MAX (max_size, size);
+    }
+
+  if (thumbnails != NULL)
+    memset (thumbnails, 0, n_sizes * sizeof (GdkPixbuf *));
+
+  if (max_size == 0)
+    return FALSE;
+
+  pixbuf = generate_thumbnail_at_size (factory, uri, mime_type, max_size);
+  if (pixbuf == NULL)
+    {
+      mate_thumbnail_factory_create_failed_thumbnail (factory, uri, original_mtime);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_sizes; i++)
+    {
+      size = sizes[i] == MATE_THUMBNAIL_SIZE_LARGE ? 256 : 128;
+      thumbnail = fit_thumbnail (factory, pixbuf, size);
+
+      save_thumbnail_for_size (factory, thumbnail, uri, original_mtime, sizes[i]);
+
+      if (thumbnails != NULL)
+	thumbnails[i] = thumbnail;
+      else
+	g_object_unref (thumbnail);
+    }
+
+  g_object_unref (pixbuf);
+
+  return TRUE;
 }
 
 /**
@@ -1096,75 +2122,680 @@ mate_thumbnail_factory_create_failed_thumbnail (MateThumbnailFactory *factory,
 						 const char            *uri,
 						 time_t                 mtime)
 {
-  char *path, *file, *dir;
-  char *tmp_path;
-  int tmp_fd;
+  MateThumbnailIndex *index;
+  char path[THUMBNAIL_PATH_SIZE];
+  char tmp_path[THUMBNAIL_PATH_SIZE + 7];
+  const char *keys[4], *values[4];
+  int tmp_fd, res;
   char mtime_str[21];
   gboolean saved_ok;
   GdkPixbuf *pixbuf;
-  GChecksum *checksum;
   guint8 digest[16];
-  gsize digest_len = sizeof (digest);
+  gsize len;
 
-  checksum = g_checksum_new (G_CHECKSUM_MD5);
-  g_checksum_update (checksum, (const guchar *) uri, strlen (uri));
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
 
-  g_checksum_get_digest (checksum, digest, &digest_len);
-  g_assert (digest_len == 16);
-
-  file = g_strconcat (g_checksum_get_string (checksum), ".png", NULL);
-  
-  dir = g_build_filename (g_get_home_dir (),
-			  ".thumbnails/fail",
-			  factory->priv->application,
-			  NULL);
-  
-  path = g_build_filename (dir,
-			   file,
-			   NULL);
-  g_free (file);
-
-  g_checksum_free (checksum);
-
-  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  len = _mate_thumbnail_format_path (factory->priv->fail_dir, digest, path, sizeof (path));
+  if (len >= sizeof (path))
+    {
+      return;
+    }
+  memcpy (tmp_path, path, len);
+  strcpy (tmp_path + len, ".XXXXXX");
 
   tmp_fd = g_mkstemp (tmp_path);
   if (tmp_fd == -1 &&
       make_thumbnail_fail_dirs (factory))
     {
-      g_free (tmp_path);
-      tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+      strcpy (tmp_path + len, ".XXXXXX");
       tmp_fd = g_mkstemp (tmp_path);
     }
 
   if (tmp_fd == -1)
-    {
-      g_free (dir);
-      g_free (tmp_path);
-      g_free (path);
-      return;
-    }
-  close (tmp_fd);
-  
+    return;
+
   g_snprintf (mtime_str, 21, "%ld",  mtime);
+  keys[0] = "Thumb::URI";
+  values[0] = uri;
+  keys[1] = "Thumb::MTime";
+  values[1] = mtime_str;
+  keys[2] = "Software";
+  values[2] = "MATE::ThumbnailFactory";
+  keys[3] = NULL;
+  values[3] = NULL;
+
   pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
-  saved_ok  = gdk_pixbuf_save (pixbuf,
-			       tmp_path,
-			       "png", NULL, 
-			       "tEXt::Thumb::URI", uri,
-			       "tEXt::Thumb::MTime", mtime_str,
-			       "tEXt::Software", "MATE::ThumbnailFactory",
-			       NULL);
+  gdk_pixbuf_fill (pixbuf, 0);
+  saved_ok = _mate_thumbnail_png_write (tmp_fd, pixbuf, keys, values,
+					factory->priv->png_level,
+					factory->priv->png_filter);
   g_object_unref (pixbuf);
-  if (saved_ok)
+  if (close (tmp_fd) != 0)
+    saved_ok = FALSE;
+
+  if (!saved_ok)
+    g_unlink (tmp_path);
+  else
     {
-      g_chmod (tmp_path, 0600);
-      g_rename(tmp_path, path);
+      index = get_index (factory, TRUE);
+      if (index != NULL)
+	res = _mate_thumbnail_index_rename (index, digest, mtime, tmp_path, path);
+      else
+	res = g_rename (tmp_path, path);
+
+      if (res == 0)
+	{
+	  g_mutex_lock (factory->priv->lock);
+	  if (factory->priv->failed_digests != NULL)
+	    g_hash_table_insert (factory->priv->failed_digests,
+				 g_memdup (digest, 16), GINT_TO_POINTER (TRUE));
+	  g_mutex_unlock (factory->priv->lock);
+	}
     }
+}
 
-  g_free (dir);
-  g_free (path);
-  g_free (tmp_path);
+static gint
+thumbnail_job_compare (gconstpointer a,
+		       gconstpointer b,
+		       gpointer      user_data)
+{
+  const ThumbnailJob *job_a = a;
+  const ThumbnailJob *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+
+  /* First come, first served within a priority */
+  if (job_a->serial != job_b->serial)
+    return job_a->serial < job_b->serial ? -1 : 1;
+
+  return 0;
+}
+
+static void
+thumbnail_job_free (ThumbnailJob *job)
+{
+  g_free (job->uri);
+  g_free (job->mime_type);
+  if (job->thumbnail != NULL)
+    g_object_unref (job->thumbnail);
+  g_object_unref (job->factory);
+  g_free (job);
+}
+
+static void
+thumbnail_request_free (ThumbnailRequest *request)
+{
+  if (request->destroy != NULL)
+    (* request->destroy) (request->user_data);
+  g_free (request);
+}
+
+/* Called with the lock held, on a job that is still in the queue */
+static void
+thumbnail_job_update_priority (ThumbnailJob *job)
+{
+  ThumbnailRequest *request;
+  GList *l;
+  int priority;
+
+  priority = G_MAXINT;
+  for (l = job->requests; l != NULL; l = l->next)
+    {
+      request = l->data;
+      priority = MIN (priority, request->priority);
+    }
+
+  if (priority != job->priority)
+    {
+      job->priority = priority;
+      g_sequence_sort_changed (job->iter, thumbnail_job_compare, NULL);
+    }
+}
+
+static gboolean
+thumbnail_job_done_idle (gpointer data)
+{
+  ThumbnailJob *job = data;
+  MateThumbnailFactoryPrivate *priv = job->factory->priv;
+  ThumbnailRequest *request;
+  GList *requests, *l;
+
+  g_mutex_lock (priv->lock);
+  /* A newer job for the uri may have been queued meanwhile */
+  if (g_hash_table_lookup (priv->jobs_by_uri, job->uri) == job)
+    g_hash_table_remove (priv->jobs_by_uri, job->uri);
+  requests = job->requests;
+  job->requests = NULL;
+  for (l = requests; l != NULL; l = l->next)
+    {
+      request = l->data;
+      g_hash_table_remove (priv->requests, GUINT_TO_POINTER (request->id));
+    }
+  g_mutex_unlock (priv->lock);
+
+  for (l = requests; l != NULL; l = l->next)
+    {
+      request = l->data;
+      (* request->callback) (job->factory, job->uri,
+			     job->thumbnail, request->user_data);
+      thumbnail_request_free (request);
+    }
+  g_list_free (requests);
+
+  thumbnail_job_free (job);
+
+  return FALSE;
+}
+
+static void
+thumbnail_thread_func (gpointer data,
+		       gpointer user_data)
+{
+  MateThumbnailFactory *factory = user_data;
+  MateThumbnailFactoryPrivate *priv = factory->priv;
+  GSequenceIter *iter;
+  ThumbnailJob *job;
+  GdkPixbuf *pixbuf;
+
+  /* Every queued job pushes one token into the pool, but jobs can be
+   * cancelled or reprioritized meanwhile, so just run whatever is at
+   * the head of the queue right now. */
+  g_mutex_lock (priv->lock);
+  iter = g_sequence_get_begin_iter (priv->queue);
+  if (g_sequence_iter_is_end (iter))
+    {
+      g_mutex_unlock (priv->lock);
+      return;
+    }
+  job = g_sequence_get (iter);
+  g_sequence_remove (iter);
+  job->iter = NULL;
+  g_mutex_unlock (priv->lock);
+
+  pixbuf = mate_thumbnail_factory_generate_thumbnail (factory,
+						       job->uri,
+						       job->mime_type);
+  if (pixbuf != NULL)
+    mate_thumbnail_factory_save_thumbnail (factory, pixbuf,
+					   job->uri, job->mtime);
+  else
+    mate_thumbnail_factory_create_failed_thumbnail (factory,
+						    job->uri, job->mtime);
+
+  job->thumbnail = pixbuf;
+
+  g_idle_add (thumbnail_job_done_idle, job);
+}
+
+/**
+ * mate_thumbnail_factory_queue_thumbnail:
+ * @factory: a #MateThumbnailFactory
+ * @uri: the uri of a file
+ * @mime_type: the mime type of the file
+ * @mtime: the modification time of the file
+ * @priority: the priority of the request, lower values are handled first
+ * @callback: function to call when the thumbnail is ready
+ * @user_data: data to pass to @callback
+ * @destroy: function to free @user_data, or %NULL
+ *
+ * Queues generation of a thumbnail for @uri. The thumbnail is generated
+ * by a pool of worker threads, one per processor, and saved (or a failed
+ * thumbnail is written) as with mate_thumbnail_factory_save_thumbnail().
+ * @callback is then called on the main loop with the thumbnail, or with
+ * %NULL if thumbnailing failed.
+ *
+ * Requests for an uri that is already queued, or being generated for
+ * the same @mtime, share the result of the pending job instead of
+ * generating it again.
+ *
+ * The factory is kept alive until all requests are done or cancelled.
+ * The GLib thread system must be initialized and this function must be
+ * called on the main thread.
+ *
+ * Return value: an id that can be passed to
+ * mate_thumbnail_factory_cancel_request() and
+ * mate_thumbnail_factory_set_request_priority().
+ *
+ * Since: 1.5
+ **/
+guint
+mate_thumbnail_factory_queue_thumbnail (MateThumbnailFactory        *factory,
+					const char                  *uri,
+					const char                  *mime_type,
+					time_t                       mtime,
+					int                          priority,
+					MateThumbnailFactoryCallback callback,
+					gpointer                     user_data,
+					GDestroyNotify               destroy)
+{
+  MateThumbnailFactoryPrivate *priv;
+  ThumbnailRequest *request;
+  ThumbnailJob *job;
+  gboolean new_job;
+
+  g_return_val_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory), 0);
+  g_return_val_if_fail (uri != NULL, 0);
+  g_return_val_if_fail (mime_type != NULL, 0);
+  g_return_val_if_fail (callback != NULL, 0);
+
+  priv = factory->priv;
+
+  if (priv->thread_pool == NULL)
+    priv->thread_pool = g_thread_pool_new (thumbnail_thread_func, factory,
+					   _mate_thumbnail_get_n_processors (),
+					   FALSE, NULL);
+
+  request = g_new0 (ThumbnailRequest, 1);
+  request->priority = priority;
+  request->callback = callback;
+  request->user_data = user_data;
+  request->destroy = destroy;
+
+  g_mutex_lock (priv->lock);
+
+  request->id = priv->next_request_id++;
+  if (priv->next_request_id == 0)
+    priv->next_request_id = 1;
+  g_hash_table_insert (priv->requests, GUINT_TO_POINTER (request->id), request);
+
+  /* A running job can only serve requests for the file it looks at */
+  job = g_hash_table_lookup (priv->jobs_by_uri, uri);
+  new_job = job == NULL || (job->iter == NULL && job->mtime != mtime);
+  if (new_job)
+    {
+      job = g_new0 (ThumbnailJob, 1);
+      job->factory = g_object_ref (factory);
+      job->uri = g_strdup (uri);
+      job->mime_type = g_strdup (mime_type);
+      job->mtime = mtime;
+      job->priority = priority;
+      job->serial = priv->next_job_serial++;
+      job->iter = g_sequence_insert_sorted (priv->queue, job,
+					    thumbnail_job_compare, NULL);
+      /* Replaces the key too, which belongs to the running job */
+      g_hash_table_replace (priv->jobs_by_uri, job->uri, job);
+    }
+  else if (job->iter != NULL)
+    {
+      /* Not started yet, so the newest mtime still applies */
+      job->mtime = MAX (job->mtime, mtime);
+    }
+
+  request->job = job;
+  job->requests = g_list_prepend (job->requests, request);
+  if (!new_job && job->iter != NULL)
+    thumbnail_job_update_priority (job);
+
+  g_mutex_unlock (priv->lock);
+
+  if (new_job)
+    g_thread_pool_push (priv->thread_pool, GINT_TO_POINTER (1), NULL);
+
+  return request->id;
+}
+
+/**
+ * mate_thumbnail_factory_set_request_priority:
+ * @factory: a #MateThumbnailFactory
+ * @request_id: an id returned by mate_thumbnail_factory_queue_thumbnail()
+ * @priority: the new priority
+ *
+ * Changes the priority of a queued request, e.g. when the item it is
+ * for scrolls into view. Has no effect once generation started.
+ *
+ * This function must be called on the main thread.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_set_request_priority (MateThumbnailFactory *factory,
+					     guint                 request_id,
+					     int                   priority)
+{
+  MateThumbnailFactoryPrivate *priv;
+  ThumbnailRequest *request;
+
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  priv = factory->priv;
+
+  g_mutex_lock (priv->lock);
+  request = g_hash_table_lookup (priv->requests, GUINT_TO_POINTER (request_id));
+  if (request != NULL)
+    {
+      request->priority = priority;
+      if (request->job->iter != NULL)
+	thumbnail_job_update_priority (request->job);
+    }
+  g_mutex_unlock (priv->lock);
+}
+
+/**
+ * mate_thumbnail_factory_cancel_request:
+ * @factory: a #MateThumbnailFactory
+ * @request_id: an id returned by mate_thumbnail_factory_queue_thumbnail()
+ *
+ * Cancels a request. Its callback will not be called. The thumbnail is
+ * still generated if other requests for the same uri are pending or if
+ * a worker already started on it.
+ *
+ * This function must be called on the main thread.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_cancel_request (MateThumbnailFactory *factory,
+				       guint                 request_id)
+{
+  MateThumbnailFactoryPrivate *priv;
+  ThumbnailRequest *request;
+  ThumbnailJob *job;
+
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  priv = factory->priv;
+  job = NULL;
+
+  g_mutex_lock (priv->lock);
+  request = g_hash_table_lookup (priv->requests, GUINT_TO_POINTER (request_id));
+  if (request == NULL)
+    {
+      g_mutex_unlock (priv->lock);
+      return;
+    }
+
+  g_hash_table_remove (priv->requests, GUINT_TO_POINTER (request_id));
+  request->job->requests = g_list_remove (request->job->requests, request);
+
+  if (request->job->iter != NULL)
+    {
+      if (request->job->requests == NULL)
+	{
+	  job = request->job;
+	  g_sequence_remove (job->iter);
+	  g_hash_table_remove (priv->jobs_by_uri, job->uri);
+	}
+      else
+	thumbnail_job_update_priority (request->job);
+    }
+  g_mutex_unlock (priv->lock);
+
+  thumbnail_request_free (request);
+
+  /* May drop the last reference to the factory */
+  if (job != NULL)
+    thumbnail_job_free (job);
+}
+
+/**
+ * mate_thumbnail_factory_set_use_index:
+ * @factory: a #MateThumbnailFactory
+ * @use_index: whether to use the thumbnail index
+ *
+ * Makes @factory keep an index of the thumbnails it looked up or wrote
+ * in a file under ~/.thumbnails, one per thumbnail size and one for
+ * the failed thumbnails of the application. The index is shared by all
+ * processes using it, and lets mate_thumbnail_factory_lookup() and
+ * mate_thumbnail_factory_has_valid_failed_thumbnail() answer for
+ * indexed files without opening the thumbnail.
+ *
+ * Changes made to the thumbnail directories by programs that don't use
+ * the index are noticed through the directory modification time, after
+ * which indexed thumbnails are checked with a stat() until
+ * mate_thumbnail_factory_verify_index() is called.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_set_use_index (MateThumbnailFactory *factory,
+				      gboolean              use_index)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  g_mutex_lock (factory->priv->lock);
+  factory->priv->use_index = use_index != FALSE;
+  g_mutex_unlock (factory->priv->lock);
+}
+
+/**
+ * mate_thumbnail_factory_verify_index:
+ * @factory: a #MateThumbnailFactory
+ * @rebuild: whether to index every thumbnail in the directories
+ *
+ * Brings the indexes used by @factory back in line with the thumbnail
+ * directories. Without @rebuild only the indexed thumbnails are
+ * checked; with it the indexes are recreated from all the thumbnails
+ * found, which reads every file in the directories.
+ *
+ * This does nothing unless mate_thumbnail_factory_set_use_index() was
+ * called. Usage of this function is threadsafe.
+ *
+ * Return value: %TRUE if the indexes could be updated.
+ *
+ * Since: 1.5
+ **/
+gboolean
+mate_thumbnail_factory_verify_index (MateThumbnailFactory *factory,
+				     gboolean              rebuild)
+{
+  MateThumbnailIndex *index, *fail_index;
+  gboolean res;
+
+  g_return_val_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory), FALSE);
+
+  index = get_index (factory, FALSE);
+  fail_index = get_index (factory, TRUE);
+  if (index == NULL || fail_index == NULL)
+    return FALSE;
+
+  res = _mate_thumbnail_index_verify (index, rebuild);
+  if (!_mate_thumbnail_index_verify (fail_index, rebuild))
+    res = FALSE;
+
+  return res;
+}
+
+/**
+ * mate_thumbnail_factory_set_png_compression:
+ * @factory: a #MateThumbnailFactory
+ * @level: a zlib compression level from 0 to 9, or -1 for the default
+ * @filter: the PNG row filter to use
+ *
+ * Sets how the thumbnails saved by @factory are compressed. The
+ * default, -1 with %MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE, produces small
+ * files. When generating many thumbnails at once a low level such as 1
+ * with %MATE_THUMBNAIL_PNG_FILTER_SUB or %MATE_THUMBNAIL_PNG_FILTER_UP
+ * saves them several times faster, at the cost of larger files.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_set_png_compression (MateThumbnailFactory  *factory,
+					    int                    level,
+					    MateThumbnailPngFilter filter)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (level >= -1 && level <= 9);
+  g_return_if_fail (filter >= MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE &&
+		    filter <= MATE_THUMBNAIL_PNG_FILTER_PAETH);
+
+  g_mutex_lock (factory->priv->lock);
+  factory->priv->png_level = level;
+  factory->priv->png_filter = filter;
+  g_mutex_unlock (factory->priv->lock);
+}
+
+/**
+ * mate_thumbnail_factory_get_thumbnail_path:
+ * @factory: a #MateThumbnailFactory
+ * @uri: the uri of a file
+ * @failed: whether to get the path of the failed thumbnail
+ * @buffer: where to store the path
+ * @buffer_size: the size of @buffer in bytes
+ *
+ * Stores the absolute path of the thumbnail that @factory would save
+ * for @uri, or of its failed thumbnail if @failed is %TRUE, in @buffer
+ * without allocating any memory. Like snprintf(), nothing is written
+ * if the path and its terminating nul byte don't fit; all paths of a
+ * factory have the same length, so a buffer of the size returned for
+ * one uri can be reused for all others.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Return value: the length of the path, not counting the nul byte.
+ *
+ * Since: 1.5
+ **/
+gsize
+mate_thumbnail_factory_get_thumbnail_path (MateThumbnailFactory *factory,
+					   const char           *uri,
+					   gboolean              failed,
+					   char                 *buffer,
+					   gsize                 buffer_size)
+{
+  MateThumbnailFactoryPrivate *priv;
+  guint8 digest[16];
+
+  g_return_val_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory), 0);
+  g_return_val_if_fail (uri != NULL, 0);
+  g_return_val_if_fail (buffer != NULL || buffer_size == 0, 0);
+
+  priv = factory->priv;
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
+
+  return _mate_thumbnail_format_path (failed ? priv->fail_dir : priv->image_dir,
+				      digest, buffer, buffer_size);
+}
+
+/**
+ * mate_thumbnail_factory_clean_cache:
+ * @factory: a #MateThumbnailFactory
+ * @max_bytes: the size to shrink the cache to, or 0 for no limit
+ * @max_age: how many seconds a thumbnail may go unused, or 0 for no limit
+ * @dry_run: only count what would be removed
+ * @result: where to store what was found and removed, or %NULL
+ *
+ * Removes the thumbnails of all sizes and the failed thumbnails of all
+ * applications that are not needed anymore: those of local files that
+ * were deleted or modified since, unreadable ones and temporary files
+ * left behind by crashed programs. A file counts as deleted only if its
+ * directory still exists, so the thumbnails of unmounted disks are kept. Then the thumbnails that were not
+ * used for @max_age seconds are removed, and finally the least recently
+ * used ones until the cache holds at most @max_bytes.
+ *
+ * Thumbnails are checked by several threads if the GLib thread system
+ * is initialized. This reads the header of every thumbnail and can take
+ * a while on a large cache, so it is best done from a thread or a
+ * separate program.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_clean_cache (MateThumbnailFactory     *factory,
+				    guint64                   max_bytes,
+				    time_t                    max_age,
+				    gboolean                  dry_run,
+				    MateThumbnailCleanResult *result)
+{
+  MateThumbnailCleanResult dummy;
+
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (max_age >= 0);
+
+  _mate_thumbnail_clean_cache (factory->priv->base_dir, max_bytes, max_age,
+			       dry_run, result != NULL ? result : &dummy);
+}
+
+/**
+ * mate_thumbnail_factory_set_collect_metrics:
+ * @factory: a #MateThumbnailFactory
+ * @collect: whether to collect metrics
+ *
+ * Starts or stops counting the lookups, generations and saves done
+ * by @factory and timing them, see mate_thumbnail_factory_get_metrics().
+ * This is off by default; while it is off, the only cost is one check
+ * per operation.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_set_collect_metrics (MateThumbnailFactory *factory,
+					    gboolean              collect)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  _mate_thumbnail_stats_set_enabled (factory->priv->stats, collect);
+}
+
+/**
+ * mate_thumbnail_factory_get_metrics:
+ * @factory: a #MateThumbnailFactory
+ * @metrics: where to store the metrics
+ *
+ * Stores a snapshot of the metrics collected by @factory since
+ * mate_thumbnail_factory_set_collect_metrics() was turned on, or since
+ * the last mate_thumbnail_factory_reset_metrics(), in @metrics. Free
+ * it with mate_thumbnail_metrics_clear().
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_get_metrics (MateThumbnailFactory *factory,
+				    MateThumbnailMetrics *metrics)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+  g_return_if_fail (metrics != NULL);
+
+  _mate_thumbnail_stats_get (factory->priv->stats, metrics);
+}
+
+/**
+ * mate_thumbnail_factory_reset_metrics:
+ * @factory: a #MateThumbnailFactory
+ *
+ * Sets all the metrics collected by @factory back to zero.
+ *
+ * Usage of this function is threadsafe.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_reset_metrics (MateThumbnailFactory *factory)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  _mate_thumbnail_stats_reset (factory->priv->stats);
+}
+
+/**
+ * mate_thumbnail_factory_dump_metrics_on_signal:
+ * @factory: a #MateThumbnailFactory
+ * @signum: a signal number such as SIGUSR1, or 0
+ *
+ * Makes @factory print its metrics on standard error, as formatted by
+ * mate_thumbnail_metrics_to_string(), each time the process receives
+ * @signum. Useful to look at a running program without changing it.
+ * The metrics are printed from the default main loop, which must be
+ * running. Passing 0 stops it and gives the signal back to its
+ * previous handler if no other factory uses it.
+ *
+ * This function must be called on the main thread.
+ *
+ * Since: 1.5
+ **/
+void
+mate_thumbnail_factory_dump_metrics_on_signal (MateThumbnailFactory *factory,
+					       int                   signum)
+{
+  g_return_if_fail (MATE_IS_THUMBNAIL_FACTORY (factory));
+
+  _mate_thumbnail_stats_dump_on_signal (factory->priv->stats,
+					factory->priv->image_dir, signum);
 }
 
 /**
@@ -1183,9 +2814,22 @@ mate_thumbnail_factory_create_failed_thumbnail (MateThumbnailFactory *factory,
 char *
 mate_thumbnail_md5 (const char *uri)
 {
-  return g_compute_checksum_for_data (G_CHECKSUM_MD5,
-                                      (const guchar *) uri,
-                                      strlen (uri));
+  static const char hex_digits[] = "0123456789abcdef";
+  guint8 digest[16];
+  char *md5;
+  int i;
+
+  _mate_thumbnail_md5_digest (uri, strlen (uri), digest);
+
+  md5 = g_malloc (33);
+  for (i = 0; i < 16; i++)
+    {
+      md5[2 * i] = hex_digits[digest[i] >> 4];
+      md5[2 * i + 1] = hex_digits[digest[i] & 0xf];
+    }
+  md5[32] = 0;
+
+  return md5;
 }
 
 /**
@@ -1203,21 +2847,12 @@ char *
 mate_thumbnail_path_for_uri (const char         *uri,
 			      MateThumbnailSize  size)
 {
-  char *md5;
-  char *file;
   char *path;
+  gsize len;
 
-  md5 = mate_thumbnail_md5 (uri);
-  file = g_strconcat (md5, ".png", NULL);
-  g_free (md5);
-  
-  path = g_build_filename (g_get_home_dir (),
-			   ".thumbnails",
-			   (size == MATE_THUMBNAIL_SIZE_NORMAL)?"normal":"large",
-			   file,
-			   NULL);
-    
-  g_free (file);
+  len = mate_thumbnail_path_for_uri_into (uri, size, NULL, 0);
+  path = g_malloc (len + 1);
+  mate_thumbnail_path_for_uri_into (uri, size, path, len + 1);
 
   return path;
 }
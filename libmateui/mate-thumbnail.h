@@ -40,6 +40,116 @@ typedef enum {
   MATE_THUMBNAIL_SIZE_LARGE
 } MateThumbnailSize;
 
+typedef enum {
+  MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE,
+  MATE_THUMBNAIL_PNG_FILTER_NONE,
+  MATE_THUMBNAIL_PNG_FILTER_SUB,
+  MATE_THUMBNAIL_PNG_FILTER_UP,
+  MATE_THUMBNAIL_PNG_FILTER_AVERAGE,
+  MATE_THUMBNAIL_PNG_FILTER_PAETH
+} MateThumbnailPngFilter;
+
+typedef enum {
+  MATE_THUMBNAIL_TIMER_LOOKUP,
+  MATE_THUMBNAIL_TIMER_DECODE,
+  MATE_THUMBNAIL_TIMER_SCALE,
+  MATE_THUMBNAIL_TIMER_SAVE,
+  MATE_THUMBNAIL_TIMER_EXTERNAL
+} MateThumbnailTimer;
+
+#define MATE_THUMBNAIL_N_TIMERS 5
+#define MATE_THUMBNAIL_HISTOGRAM_BUCKETS 24
+
+/**
+ * MateThumbnailHistogram:
+ * @count: how many times the operation was timed
+ * @total_usec: the sum of all durations, in microseconds
+ * @max_usec: the longest duration
+ * @buckets: buckets[i] counts the durations shorter than 2^i
+ * microseconds and not counted by a previous bucket; the last bucket
+ * also counts all the longer ones.
+ *
+ * The distribution of the durations of one operation.
+ */
+typedef struct {
+  guint64 count;
+  guint64 total_usec;
+  guint64 max_usec;
+  guint64 buckets[MATE_THUMBNAIL_HISTOGRAM_BUCKETS];
+} MateThumbnailHistogram;
+
+/**
+ * MateThumbnailMetrics:
+ * @lookups: calls to mate_thumbnail_factory_lookup(), counting each
+ * file of mate_thumbnail_factory_lookup_many()
+ * @hits: lookups that found a valid thumbnail
+ * @misses: lookups that found no thumbnail
+ * @stale: lookups that found a thumbnail of an older version of the file
+ * @failed_hits: files for which
+ * mate_thumbnail_factory_has_valid_failed_thumbnail() returned %TRUE
+ * @generations: thumbnails generated successfully
+ * @generation_failures: files that couldn't be thumbnailed
+ * @script_spawns: thumbnailer commands run
+ * @server_requests: files sent to thumbnailer servers
+ * @bytes_read: bytes read from images by the built-in loaders, which
+ * may be only a part of a file
+ * @bytes_written: bytes of saved thumbnails
+ * @n_mime_types: the number of elements of @mime_types
+ * @mime_types: the mime types of the generated thumbnails
+ * @mime_type_generations: how many thumbnails were generated for
+ * each element of @mime_types
+ * @timers: the durations of the lookups, of the decoding of the
+ * files by the built-in loaders, of the scaling, of the saving and of
+ * the external thumbnailers, indexed by #MateThumbnailTimer.
+ *
+ * A snapshot of the metrics of a #MateThumbnailFactory, see
+ * mate_thumbnail_factory_get_metrics().
+ */
+typedef struct {
+  guint64 lookups;
+  guint64 hits;
+  guint64 misses;
+  guint64 stale;
+  guint64 failed_hits;
+  guint64 generations;
+  guint64 generation_failures;
+  guint64 script_spawns;
+  guint64 server_requests;
+  guint64 bytes_read;
+  guint64 bytes_written;
+
+  int n_mime_types;
+  char **mime_types;
+  guint64 *mime_type_generations;
+
+  MateThumbnailHistogram timers[MATE_THUMBNAIL_N_TIMERS];
+} MateThumbnailMetrics;
+
+/**
+ * MateThumbnailCleanResult:
+ * @files: the thumbnails found, including failed thumbnails
+ * @bytes: their total size
+ * @orphaned: thumbnails removed because their local file is gone from
+ *   its directory
+ * @stale: thumbnails removed because their file was modified since
+ * @invalid: unreadable thumbnails and leftover temporary files removed
+ * @expired: thumbnails removed because they were not used for too long
+ * @evicted: thumbnails removed to bring the cache under its size limit
+ * @bytes_removed: the total size of the removed files
+ *
+ * What mate_thumbnail_factory_clean_cache() found and removed.
+ */
+typedef struct {
+  guint64 files;
+  guint64 bytes;
+  guint64 orphaned;
+  guint64 stale;
+  guint64 invalid;
+  guint64 expired;
+  guint64 evicted;
+  guint64 bytes_removed;
+} MateThumbnailCleanResult;
+
 #define MATE_TYPE_THUMBNAIL_FACTORY	(mate_thumbnail_factory_get_type ())
 #define MATE_THUMBNAIL_FACTORY(obj)		(G_TYPE_CHECK_INSTANCE_CAST ((obj), MATE_TYPE_THUMBNAIL_FACTORY, MateThumbnailFactory))
 #define MATE_THUMBNAIL_FACTORY_CLASS(klass)	(G_TYPE_CHECK_CLASS_CAST ((klass), MATE_TYPE_THUMBNAIL_FACTORY, MateThumbnailFactoryClass))
@@ -60,12 +170,22 @@ struct _MateThumbnailFactoryClass {
 	GObjectClass parent;
 };
 
+typedef void (* MateThumbnailFactoryCallback) (MateThumbnailFactory *factory,
+					       const char            *uri,
+					       GdkPixbuf             *thumbnail,
+					       gpointer               user_data);
+
 GType                  mate_thumbnail_factory_get_type (void);
 MateThumbnailFactory *mate_thumbnail_factory_new      (MateThumbnailSize     size);
 
 char *                 mate_thumbnail_factory_lookup   (MateThumbnailFactory *factory,
 							 const char            *uri,
 							 time_t                 mtime);
+void                   mate_thumbnail_factory_lookup_many (MateThumbnailFactory *factory,
+							   const char * const   *uris,
+							   const time_t         *mtimes,
+							   int                   n_files,
+							   char                **paths);
 
 gboolean               mate_thumbnail_factory_has_valid_failed_thumbnail (MateThumbnailFactory *factory,
 									   const char            *uri,
@@ -84,6 +204,57 @@ void                   mate_thumbnail_factory_save_thumbnail (MateThumbnailFacto
 void                   mate_thumbnail_factory_create_failed_thumbnail (MateThumbnailFactory *factory,
 									const char            *uri,
 									time_t                 mtime);
+gboolean               mate_thumbnail_factory_generate_thumbnails (MateThumbnailFactory    *factory,
+								    const char              *uri,
+								    const char              *mime_type,
+								    time_t                   original_mtime,
+								    const MateThumbnailSize *sizes,
+								    int                      n_sizes,
+								    GdkPixbuf              **thumbnails);
+
+guint                  mate_thumbnail_factory_queue_thumbnail (MateThumbnailFactory        *factory,
+							        const char                  *uri,
+							        const char                  *mime_type,
+							        time_t                       mtime,
+							        int                          priority,
+							        MateThumbnailFactoryCallback callback,
+							        gpointer                     user_data,
+							        GDestroyNotify               destroy);
+void                   mate_thumbnail_factory_set_request_priority (MateThumbnailFactory *factory,
+								     guint                 request_id,
+								     int                   priority);
+void                   mate_thumbnail_factory_cancel_request (MateThumbnailFactory *factory,
+							       guint                 request_id);
+
+void                   mate_thumbnail_factory_set_use_index (MateThumbnailFactory *factory,
+							      gboolean              use_index);
+gboolean               mate_thumbnail_factory_verify_index  (MateThumbnailFactory *factory,
+							      gboolean              rebuild);
+void                   mate_thumbnail_factory_set_png_compression (MateThumbnailFactory  *factory,
+								    int                    level,
+								    MateThumbnailPngFilter filter);
+gsize                  mate_thumbnail_factory_get_thumbnail_path (MateThumbnailFactory *factory,
+								   const char           *uri,
+								   gboolean              failed,
+								   char                 *buffer,
+								   gsize                 buffer_size);
+
+void                   mate_thumbnail_factory_set_collect_metrics (MateThumbnailFactory *factory,
+								    gboolean              collect);
+void                   mate_thumbnail_factory_get_metrics     (MateThumbnailFactory *factory,
+							       MateThumbnailMetrics *metrics);
+void                   mate_thumbnail_factory_reset_metrics   (MateThumbnailFactory *factory);
+void                   mate_thumbnail_factory_dump_metrics_on_signal (MateThumbnailFactory *factory,
+								       int                   signum);
+
+void                   mate_thumbnail_factory_clean_cache (MateThumbnailFactory     *factory,
+							    guint64                   max_bytes,
+							    time_t                    max_age,
+							    gboolean                  dry_run,
+							    MateThumbnailCleanResult *result);
+
+void                   mate_thumbnail_metrics_clear     (MateThumbnailMetrics       *metrics);
+char *                 mate_thumbnail_metrics_to_string (const MateThumbnailMetrics *metrics);
 
 
 /* Thumbnailing utils: */
@@ -95,6 +266,10 @@ gboolean   mate_thumbnail_is_valid          (GdkPixbuf          *pixbuf,
 char *     mate_thumbnail_md5               (const char         *uri);
 char *     mate_thumbnail_path_for_uri      (const char         *uri,
 					      MateThumbnailSize  size);
+gsize      mate_thumbnail_path_for_uri_into (const char         *uri,
+					      MateThumbnailSize  size,
+					      char               *buffer,
+					      gsize               buffer_size);
 
 
 /* Pixbuf utils */
@@ -102,6 +277,10 @@ char *     mate_thumbnail_path_for_uri      (const char         *uri,
 GdkPixbuf *mate_thumbnail_scale_down_pixbuf (GdkPixbuf          *pixbuf,
 					      int                 dest_width,
 					      int                 dest_height);
+GdkPixbuf *mate_thumbnail_scale_down_pixbuf_threaded (GdkPixbuf   *pixbuf,
+						       int          dest_width,
+						       int          dest_height,
+						       int          n_threads);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,666 @@
+/*
+ * Checks the thumbnail helpers that have several implementations
+ * against each other. Builds its own copy of the helpers so that
+ * internal entry points can be reached.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mate-thumbnail.h"
+#include "mate-thumbnail-private.h"
+
+static const char *level_names[] = { "scalar", "sse2", "avx2" };
+
+static GdkPixbuf *
+random_pixbuf (gboolean has_alpha, int width, int height)
+{
+	GdkPixbuf *pixbuf;
+	guchar *pixels;
+	int rowstride, x, y;
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+	pixels = gdk_pixbuf_get_pixels (pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < rowstride; x++)
+			pixels[y * rowstride + x] = g_random_int_range (0, 256);
+
+	/* Make sure fully transparent blocks get exercised too */
+	if (has_alpha && height > 2)
+		for (x = 0; x < width; x++)
+			pixels[rowstride + 4 * x + 3] = 0;
+
+	return pixbuf;
+}
+
+static gboolean
+pixbufs_equal (GdkPixbuf *a, GdkPixbuf *b)
+{
+	int y, row_bytes;
+
+	if (gdk_pixbuf_get_width (a) != gdk_pixbuf_get_width (b) ||
+	    gdk_pixbuf_get_height (a) != gdk_pixbuf_get_height (b) ||
+	    gdk_pixbuf_get_n_channels (a) != gdk_pixbuf_get_n_channels (b))
+		return FALSE;
+
+	row_bytes = gdk_pixbuf_get_width (a) * gdk_pixbuf_get_n_channels (a);
+	for (y = 0; y < gdk_pixbuf_get_height (a); y++) {
+		if (memcmp (gdk_pixbuf_get_pixels (a) + y * gdk_pixbuf_get_rowstride (a),
+			    gdk_pixbuf_get_pixels (b) + y * gdk_pixbuf_get_rowstride (b),
+			    row_bytes) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int
+test_scale_down (void)
+{
+	static const int sizes[][4] = {
+		{ 1, 1, 1, 1 },
+		{ 7, 7, 7, 7 },
+		{ 33, 17, 5, 3 },
+		{ 640, 480, 128, 96 },
+		{ 1001, 3, 100, 1 },
+		{ 3, 1001, 1, 100 },
+		{ 2999, 1999, 256, 171 },
+	};
+	GdkPixbuf *source, *reference, *scaled;
+	guint i;
+	int level, max_level, has_alpha, failures;
+
+	failures = 0;
+	max_level = _mate_thumbnail_get_simd_level ();
+	g_print ("scale_down: best kernel is %s\n", level_names[max_level]);
+
+	for (has_alpha = 0; has_alpha < 2; has_alpha++) {
+		for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+			source = random_pixbuf (has_alpha, sizes[i][0], sizes[i][1]);
+			reference = _mate_thumbnail_scale_down_pixbuf_for_level (source,
+										 sizes[i][2], sizes[i][3],
+										 MATE_THUMBNAIL_SIMD_NONE);
+
+			for (level = MATE_THUMBNAIL_SIMD_NONE + 1; level <= max_level; level++) {
+				scaled = _mate_thumbnail_scale_down_pixbuf_for_level (source,
+										      sizes[i][2], sizes[i][3],
+										      level);
+				if (!pixbufs_equal (reference, scaled)) {
+					g_print ("scale_down: %s differs from scalar for %s %dx%d -> %dx%d\n",
+						 level_names[level], has_alpha ? "RGBA" : "RGB",
+						 sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3]);
+					failures++;
+				}
+				g_object_unref (scaled);
+			}
+
+			g_object_unref (reference);
+			g_object_unref (source);
+		}
+	}
+
+	return failures;
+}
+
+static int
+test_scale_down_threaded (void)
+{
+	static const int sizes[][4] = {
+		{ 4000, 3000, 128, 96 },
+		{ 3001, 2003, 256, 171 },
+		{ 8000, 700, 256, 22 },
+		{ 2100, 2100, 7, 3 },
+	};
+	static const int n_threads[] = { 0, 2, 3, 16 };
+	GdkPixbuf *source, *reference, *scaled;
+	guint i, j;
+	int has_alpha, failures;
+
+	failures = 0;
+
+	for (has_alpha = 0; has_alpha < 2; has_alpha++) {
+		for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+			source = random_pixbuf (has_alpha, sizes[i][0], sizes[i][1]);
+			reference = mate_thumbnail_scale_down_pixbuf (source,
+								       sizes[i][2], sizes[i][3]);
+
+			for (j = 0; j < G_N_ELEMENTS (n_threads); j++) {
+				scaled = mate_thumbnail_scale_down_pixbuf_threaded (source,
+										     sizes[i][2], sizes[i][3],
+										     n_threads[j]);
+				if (!pixbufs_equal (reference, scaled)) {
+					g_print ("scale_down_threaded: %d threads differ for %s %dx%d -> %dx%d\n",
+						 n_threads[j], has_alpha ? "RGBA" : "RGB",
+						 sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3]);
+					failures++;
+				}
+				g_object_unref (scaled);
+			}
+
+			g_object_unref (reference);
+			g_object_unref (source);
+		}
+	}
+
+	return failures;
+}
+
+static int
+test_scaler (void)
+{
+	static const int sizes[][4] = {
+		{ 1, 1, 1, 1 },
+		{ 33, 17, 5, 3 },
+		{ 640, 480, 128, 96 },
+		{ 1001, 3, 100, 1 },
+		{ 3, 1001, 1, 100 },
+	};
+	MateThumbnailScaler *scaler;
+	GdkPixbuf *source, *reference, *scaled;
+	guint i;
+	int y, has_alpha, failures;
+
+	failures = 0;
+
+	for (has_alpha = 0; has_alpha < 2; has_alpha++) {
+		for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+			source = random_pixbuf (has_alpha, sizes[i][0], sizes[i][1]);
+			reference = mate_thumbnail_scale_down_pixbuf (source,
+								       sizes[i][2], sizes[i][3]);
+
+			scaler = _mate_thumbnail_scaler_new (sizes[i][0], sizes[i][1], has_alpha,
+							     sizes[i][2], sizes[i][3]);
+			for (y = 0; y < sizes[i][1] - 1; y++)
+				_mate_thumbnail_scaler_push_row (scaler,
+								 gdk_pixbuf_get_pixels (source) +
+								 y * gdk_pixbuf_get_rowstride (source));
+
+			if (_mate_thumbnail_scaler_finish (scaler) != NULL) {
+				g_print ("scaler: finished with a row missing\n");
+				failures++;
+			}
+
+			_mate_thumbnail_scaler_push_row (scaler,
+							 gdk_pixbuf_get_pixels (source) +
+							 y * gdk_pixbuf_get_rowstride (source));
+			scaled = _mate_thumbnail_scaler_finish (scaler);
+			if (scaled == NULL || !pixbufs_equal (reference, scaled)) {
+				g_print ("scaler: differs from scale_down for %s %dx%d -> %dx%d\n",
+					 has_alpha ? "RGBA" : "RGB",
+					 sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3]);
+				failures++;
+			}
+			if (scaled != NULL)
+				g_object_unref (scaled);
+			_mate_thumbnail_scaler_free (scaler);
+
+			g_object_unref (reference);
+			g_object_unref (source);
+		}
+	}
+
+	return failures;
+}
+
+static int
+test_png_write (void)
+{
+	static const char * const keys[] = { "Thumb::URI", "Thumb::MTime", NULL };
+	static const char * const values[] = { "file:///tmp/%C3%A9t%C3%A9.png", "1234567890", NULL };
+	static const char * const unicode_values[] = { "file:///tmp/\303\251t\303\251.png", "1", NULL };
+	GdkPixbuf *source, *loaded;
+	const char * const *expected;
+	char *path, *read_values[2];
+	int fd, filter, level, has_alpha, failures;
+	gboolean res;
+
+	failures = 0;
+
+	for (has_alpha = 0; has_alpha < 2; has_alpha++) {
+		for (filter = MATE_THUMBNAIL_PNG_FILTER_ADAPTIVE;
+		     filter <= MATE_THUMBNAIL_PNG_FILTER_PAETH; filter++) {
+			for (level = -1; level <= 9; level += 5) {
+				source = random_pixbuf (has_alpha, 97, 61);
+				expected = filter % 2 ? unicode_values : values;
+
+				fd = g_file_open_tmp ("test-thumbnail.XXXXXX", &path, NULL);
+				g_assert (fd != -1);
+				res = _mate_thumbnail_png_write (fd, source, keys, expected,
+								 level, filter);
+				close (fd);
+
+				loaded = res ? gdk_pixbuf_new_from_file (path, NULL) : NULL;
+				if (loaded == NULL || !pixbufs_equal (source, loaded)) {
+					g_print ("png_write: %s filter %d level %d doesn't load back\n",
+						 has_alpha ? "RGBA" : "RGB", filter, level);
+					failures++;
+				}
+
+				if (!_mate_thumbnail_png_read_text (path, keys, read_values) ||
+				    read_values[0] == NULL || strcmp (read_values[0], expected[0]) != 0 ||
+				    read_values[1] == NULL || strcmp (read_values[1], expected[1]) != 0) {
+					g_print ("png_write: text chunks differ for filter %d\n", filter);
+					failures++;
+				}
+				g_free (read_values[0]);
+				g_free (read_values[1]);
+
+				if (loaded != NULL)
+					g_object_unref (loaded);
+				g_object_unref (source);
+				unlink (path);
+				g_free (path);
+			}
+		}
+	}
+
+	return failures;
+}
+
+static GdkPixbuf *
+gradient_pixbuf (int width, int height)
+{
+	GdkPixbuf *pixbuf;
+	guchar *p;
+	int x, y;
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	for (y = 0; y < height; y++) {
+		p = gdk_pixbuf_get_pixels (pixbuf) + y * gdk_pixbuf_get_rowstride (pixbuf);
+		for (x = 0; x < width; x++) {
+			*p++ = x * 255 / width;
+			*p++ = y * 255 / height;
+			*p++ = 128;
+		}
+	}
+
+	return pixbuf;
+}
+
+static int
+test_jpeg_load (void)
+{
+	static const int sizes[][2] = { { 3000, 2000 }, { 700, 1300 }, { 100, 50 }, { 129, 129 } };
+	static const guchar exif[] = {
+		'E', 'x', 'i', 'f', 0, 0, 'I', 'I', 42, 0, 8, 0, 0, 0,
+		1, 0, 0x12, 0x01, 3, 0, 1, 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0
+	};
+	GdkPixbuf *source, *loaded;
+	gchar *buffer;
+	gsize length;
+	const guchar *p;
+	int i, x, y, width, height, original_width, original_height, failures;
+
+	failures = 0;
+
+	if (_mate_thumbnail_exif_get_orientation (exif, sizeof (exif)) != 6) {
+		g_print ("jpeg: Exif orientation not found\n");
+		failures++;
+	}
+
+#ifdef HAVE_LIBJPEG
+	for (i = 0; i < (int) G_N_ELEMENTS (sizes); i++) {
+		source = gradient_pixbuf (sizes[i][0], sizes[i][1]);
+		if (!gdk_pixbuf_save_to_buffer (source, &buffer, &length, "jpeg", NULL,
+						"quality", "95", NULL)) {
+			g_object_unref (source);
+			continue;
+		}
+
+		loaded = _mate_thumbnail_jpeg_load ((const guchar *) buffer, length, 128, 128,
+						    &original_width, &original_height);
+		if (loaded == NULL) {
+			g_print ("jpeg: %dx%d doesn't load\n", sizes[i][0], sizes[i][1]);
+			failures++;
+			g_object_unref (source);
+			g_free (buffer);
+			continue;
+		}
+
+		width = gdk_pixbuf_get_width (loaded);
+		height = gdk_pixbuf_get_height (loaded);
+		if (original_width != sizes[i][0] || original_height != sizes[i][1] ||
+		    MAX (width, height) != MIN (128, MAX (sizes[i][0], sizes[i][1]))) {
+			g_print ("jpeg: %dx%d loaded as %dx%d\n",
+				 sizes[i][0], sizes[i][1], width, height);
+			failures++;
+		}
+
+		/* Reduced DCT decoding is not exact, but the gradient must
+		 * come out where it was */
+		for (y = 0; y < height; y++) {
+			p = gdk_pixbuf_get_pixels (loaded) + y * gdk_pixbuf_get_rowstride (loaded);
+			for (x = 0; x < width; x++, p += 3) {
+				if (ABS (p[0] - (x * 255 + 127) / width) > 12 ||
+				    ABS (p[1] - (y * 255 + 127) / height) > 12 ||
+				    ABS (p[2] - 128) > 12)
+					break;
+			}
+			if (x < width) {
+				g_print ("jpeg: %dx%d wrong at %d,%d\n",
+					 sizes[i][0], sizes[i][1], x, y);
+				failures++;
+				break;
+			}
+		}
+
+		g_object_unref (loaded);
+		g_object_unref (source);
+		g_free (buffer);
+	}
+#endif
+
+	return failures;
+}
+
+static GdkPixbuf *
+solid_pixbuf (int width, int height, guint32 rgb)
+{
+	GdkPixbuf *pixbuf;
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	gdk_pixbuf_fill (pixbuf, rgb << 8 | 0xff);
+
+	return pixbuf;
+}
+
+/* A JPEG of @width x @height with a red preview of @preview_width x
+ * @preview_height in its Exif data, and orientation 6 */
+static gchar *
+jpeg_with_preview (int width, int height,
+		   int preview_width, int preview_height,
+		   gsize *length)
+{
+	GdkPixbuf *pixbuf;
+	GString *file;
+	gchar *main_jpeg, *preview;
+	gsize main_length, preview_length, segment_length;
+	guchar tiff[56];
+
+	pixbuf = solid_pixbuf (preview_width, preview_height, 0xff0000);
+	gdk_pixbuf_save_to_buffer (pixbuf, &preview, &preview_length, "jpeg", NULL, NULL);
+	g_object_unref (pixbuf);
+
+	pixbuf = solid_pixbuf (width, height, 0x0000ff);
+	gdk_pixbuf_save_to_buffer (pixbuf, &main_jpeg, &main_length, "jpeg", NULL, NULL);
+	g_object_unref (pixbuf);
+
+	/* Little endian TIFF header, IFD0 at 8 with the orientation,
+	 * IFD1 at 26 pointing at the preview right after it */
+	memset (tiff, 0, sizeof (tiff));
+	memcpy (tiff, "II\52\0\10\0\0\0", 8);
+	tiff[8] = 1;
+	tiff[10] = 0x12; tiff[11] = 0x01; tiff[12] = 3; tiff[14] = 1; tiff[18] = 6;
+	tiff[22] = 26;
+	tiff[26] = 2;
+	tiff[28] = 0x01; tiff[29] = 0x02; tiff[30] = 4; tiff[32] = 1; tiff[36] = sizeof (tiff);
+	tiff[40] = 0x02; tiff[41] = 0x02; tiff[42] = 4; tiff[44] = 1;
+	tiff[48] = preview_length & 0xff; tiff[49] = preview_length >> 8;
+
+	/* APP1 right after SOI */
+	segment_length = 2 + 6 + sizeof (tiff) + preview_length;
+	file = g_string_new_len (main_jpeg, 2);
+	g_string_append_c (file, 0xff);
+	g_string_append_c (file, 0xe1);
+	g_string_append_c (file, segment_length >> 8);
+	g_string_append_c (file, segment_length & 0xff);
+	g_string_append_len (file, "Exif\0\0", 6);
+	g_string_append_len (file, (gchar *) tiff, sizeof (tiff));
+	g_string_append_len (file, preview, preview_length);
+	g_string_append_len (file, main_jpeg + 2, main_length - 2);
+
+	g_free (preview);
+	g_free (main_jpeg);
+
+	*length = file->len;
+	return g_string_free (file, FALSE);
+}
+
+static int
+test_embedded_preview (void)
+{
+	static const struct {
+		int width, height, preview_width, preview_height, size;
+		gboolean used;
+	} tests[] = {
+		{ 1600, 1200, 160, 120, 128, TRUE },
+		{ 1500, 1000, 160, 107, 128, TRUE },
+		{ 1600, 1200, 160, 120, 256, FALSE },	/* too small */
+		{ 1500, 1000, 160, 120, 128, FALSE },	/* letterboxed */
+		{ 100, 75, 160, 120, 128, FALSE }	/* image is small */
+	};
+	GdkPixbuf *pixbuf;
+	const guchar *p;
+	gchar *data;
+	gsize length;
+	int i, original_width, original_height, failures;
+
+	failures = 0;
+
+	for (i = 0; i < (int) G_N_ELEMENTS (tests); i++) {
+		data = jpeg_with_preview (tests[i].width, tests[i].height,
+					  tests[i].preview_width, tests[i].preview_height,
+					  &length);
+		pixbuf = _mate_thumbnail_load_embedded ((const guchar *) data, length,
+							tests[i].size, tests[i].size,
+							&original_width, &original_height);
+		g_free (data);
+
+		if ((pixbuf != NULL) != tests[i].used) {
+			g_print ("embedded: preview %sused for test %d\n",
+				 pixbuf != NULL ? "" : "not ", i);
+			failures++;
+		}
+		if (pixbuf == NULL)
+			continue;
+
+		p = gdk_pixbuf_get_pixels (pixbuf);
+		if (MAX (gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf)) != tests[i].size ||
+		    original_width != tests[i].width || original_height != tests[i].height ||
+		    p[0] < 200 || p[2] > 50 ||
+		    g_strcmp0 (gdk_pixbuf_get_option (pixbuf, "orientation"), "6") != 0) {
+			g_print ("embedded: wrong thumbnail for test %d\n", i);
+			failures++;
+		}
+		g_object_unref (pixbuf);
+	}
+
+	return failures;
+}
+
+static int
+test_md5 (void)
+{
+	char data[201];
+	guint8 digest[16], expected[16];
+	gsize digest_len;
+	GChecksum *checksum;
+	int len, failures;
+
+	failures = 0;
+
+	for (len = 0; len < (int) sizeof (data); len++)
+		data[len] = g_random_int_range (0, 256);
+
+	/* Covers the padding spilling into a second block at 56 */
+	for (len = 0; len <= 200; len++) {
+		checksum = g_checksum_new (G_CHECKSUM_MD5);
+		g_checksum_update (checksum, (const guchar *) data, len);
+		digest_len = sizeof (expected);
+		g_checksum_get_digest (checksum, expected, &digest_len);
+		g_checksum_free (checksum);
+
+		_mate_thumbnail_md5_digest (data, len, digest);
+		if (memcmp (digest, expected, sizeof (digest)) != 0) {
+			g_print ("md5: wrong digest for %d bytes\n", len);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+static int
+test_metrics (void)
+{
+	MateThumbnailStats *stats;
+	MateThumbnailMetrics metrics;
+	guint64 start;
+	char *str;
+	int failures;
+
+	failures = 0;
+	stats = _mate_thumbnail_stats_new ();
+
+	/* Nothing is counted until enabled */
+	_mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_HITS, 1);
+	if (_mate_thumbnail_stats_start (stats) != 0)
+		failures++;
+
+	_mate_thumbnail_stats_set_enabled (stats, TRUE);
+	_mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_LOOKUPS, 2);
+	_mate_thumbnail_stats_add (stats, MATE_THUMBNAIL_COUNTER_BYTES_WRITTEN, 1000);
+	_mate_thumbnail_stats_add_mime_type (stats, "image/png");
+	_mate_thumbnail_stats_add_mime_type (stats, "image/png");
+
+	/* Pretend the save started 1.5ms ago */
+	start = _mate_thumbnail_stats_start (stats);
+	_mate_thumbnail_stats_stop (stats, MATE_THUMBNAIL_TIMER_SAVE, start - 1500);
+
+	_mate_thumbnail_stats_get (stats, &metrics);
+	if (metrics.hits != 0 || metrics.lookups != 2 || metrics.bytes_written != 1000) {
+		g_print ("metrics: wrong counters\n");
+		failures++;
+	}
+	if (metrics.n_mime_types != 1 || strcmp (metrics.mime_types[0], "image/png") != 0 ||
+	    metrics.mime_type_generations[0] != 2) {
+		g_print ("metrics: wrong mime types\n");
+		failures++;
+	}
+	if (metrics.timers[MATE_THUMBNAIL_TIMER_SAVE].count != 1 ||
+	    metrics.timers[MATE_THUMBNAIL_TIMER_SAVE].max_usec < 1500 ||
+	    metrics.timers[MATE_THUMBNAIL_TIMER_SAVE].buckets[10] != 0 ||
+	    metrics.timers[MATE_THUMBNAIL_TIMER_LOOKUP].count != 0) {
+		g_print ("metrics: wrong histograms\n");
+		failures++;
+	}
+
+	str = mate_thumbnail_metrics_to_string (&metrics);
+	if (strstr (str, "image/png: 2") == NULL) {
+		g_print ("metrics: wrong string:\n%s", str);
+		failures++;
+	}
+	g_free (str);
+	mate_thumbnail_metrics_clear (&metrics);
+
+	_mate_thumbnail_stats_reset (stats);
+	_mate_thumbnail_stats_get (stats, &metrics);
+	if (metrics.lookups != 0 || metrics.n_mime_types != 0 ||
+	    metrics.timers[MATE_THUMBNAIL_TIMER_SAVE].count != 0) {
+		g_print ("metrics: not reset\n");
+		failures++;
+	}
+	mate_thumbnail_metrics_clear (&metrics);
+
+	_mate_thumbnail_stats_free (stats);
+
+	return failures;
+}
+
+static char *
+old_path_for_uri (const char *uri)
+{
+	char *md5, *file, *path;
+
+	md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
+	file = g_strconcat (md5, ".png", NULL);
+	g_free (md5);
+
+	path = g_build_filename (g_get_home_dir (), ".thumbnails", "normal", file, NULL);
+	g_free (file);
+
+	return path;
+}
+
+static int
+test_path_for_uri (gboolean benchmark)
+{
+	char uri[64], buffer[4096], *path;
+	GTimer *timer;
+	double old_time, new_time;
+	int i, n, failures;
+
+	failures = 0;
+
+	for (i = 0; i < 1000; i++) {
+		g_snprintf (uri, sizeof (uri), "file:///home/user/Pictures/IMG_%05d.JPG", i);
+		path = old_path_for_uri (uri);
+		if (mate_thumbnail_path_for_uri_into (uri, MATE_THUMBNAIL_SIZE_NORMAL,
+						      buffer, sizeof (buffer)) != strlen (path) ||
+		    strcmp (path, buffer) != 0) {
+			g_print ("path_for_uri_into: %s != %s\n", buffer, path);
+			failures++;
+		}
+		g_free (path);
+	}
+
+	if (!benchmark)
+		return failures;
+
+	n = 1000000;
+	timer = g_timer_new ();
+
+	for (i = 0; i < n; i++) {
+		g_snprintf (uri, sizeof (uri), "file:///home/user/Pictures/IMG_%07d.JPG", i);
+		g_free (old_path_for_uri (uri));
+	}
+	old_time = g_timer_elapsed (timer, NULL);
+
+	g_timer_start (timer);
+	for (i = 0; i < n; i++) {
+		g_snprintf (uri, sizeof (uri), "file:///home/user/Pictures/IMG_%07d.JPG", i);
+		mate_thumbnail_path_for_uri_into (uri, MATE_THUMBNAIL_SIZE_NORMAL,
+						  buffer, sizeof (buffer));
+	}
+	new_time = g_timer_elapsed (timer, NULL);
+
+	g_timer_destroy (timer);
+
+	g_print ("%d uris: GChecksum + g_build_filename %.3fs, path_for_uri_into %.3fs\n",
+		 n, old_time, new_time);
+
+	return failures;
+}
+
+int
+main (int argc, char **argv)
+{
+	int failures;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+	g_type_init ();
+
+	failures = 0;
+	failures += test_scale_down ();
+	failures += test_scale_down_threaded ();
+	failures += test_scaler ();
+	failures += test_png_write ();
+	failures += test_md5 ();
+	failures += test_jpeg_load ();
+	failures += test_embedded_preview ();
+	failures += test_metrics ();
+	/* Run with --benchmark to also time a million uris */
+	failures += test_path_for_uri (argc > 1 && strcmp (argv[1], "--benchmark") == 0);
+
+	g_print ("%s\n", failures == 0 ? "PASS" : "FAIL");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -1,5 +1,8 @@
 #undef GTK_DISABLE_DEPRECATED
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <gtk/gtk.h>
 #include <libmateui.h>
 
@@ -15,13 +18,86 @@ unselect_icon (GtkWidget *widget, gint num, GdkEvent *event)
 	g_print ("unselected icon %d\n", num);
 }
 
+/* Appends many icons to the shown list without freezing it, the way
+ * a program filling a view while reading a directory does.  Returns
+ * FALSE if the last icon can't be scrolled to. */
+static gboolean
+append_benchmark (MateIconList *gil, gint count)
+{
+	MateIconTextItem *text;
+	GdkPixbuf *pixbuf;
+	GTimer *timer;
+	gint i, last;
+	double y1;
+	gboolean ok;
+
+	pixbuf = gtk_widget_render_icon (GTK_WIDGET (gil), GTK_STOCK_FILE,
+					 GTK_ICON_SIZE_BUTTON, NULL);
+	timer = g_timer_new ();
+
+	for (i = 0; i < count; i++) {
+		gchar *text = g_strdup_printf ("Icon %d", i);
+
+		mate_icon_list_append_pixbuf (gil, pixbuf, NULL, text);
+		g_free (text);
+
+		if ((i + 1) % 10000 == 0)
+			g_print ("%d icons appended in %.2fs\n", i + 1,
+				 g_timer_elapsed (timer, NULL));
+	}
+
+	/* The last icon must lie below 32767 pixels, the limit of X window
+	 * coordinates, and still be placed and scrolled to */
+	last = mate_icon_list_get_num_icons (gil) - 1;
+	mate_icon_list_moveto (gil, last, 0.0);
+	while (gtk_events_pending ())
+		gtk_main_iteration ();
+
+	ok = mate_icon_list_icon_is_visible (gil, last) == GTK_VISIBILITY_FULL;
+	g_print ("last icon %s\n", ok ? "shown" : "NOT SHOWN");
+
+	text = mate_icon_list_get_icon_text_item (gil, last);
+	if (text != NULL) {
+		mate_canvas_item_get_bounds (MATE_CANVAS_ITEM (text), NULL, &y1, NULL, NULL);
+		g_print ("last icon text at y = %.0f\n", y1);
+		ok = ok && y1 > 32767;
+	} else {
+		g_print ("last icon has no text item\n");
+		ok = FALSE;
+	}
+
+	g_timer_destroy (timer);
+	g_object_unref (pixbuf);
+
+	return ok;
+}
+
 gint
 main (gint argc, gchar **argv)
 {
 	MateProgram *program;
 	GtkWidget *window, *scrolled_window, *icon_list, *vbox, *button;
 	GSList *ids, *list;
-	gint i;
+	gint i, benchmark = 0, flags = MATE_ICON_LIST_IS_EDITABLE;
+
+	/* testiconlist [--virtual] [--benchmark N]: --benchmark appends N
+	 * more icons, timing it, and fails unless the last one can be
+	 * shown past 32767 pixels (N = 10000 gets there), then exits;
+	 * --virtual makes a virtual list */
+	for (;;) {
+		if (argc > 1 && strcmp (argv[1], "--virtual") == 0) {
+			flags |= MATE_ICON_LIST_VIRTUAL;
+			argv[1] = argv[0];
+			argv++;
+			argc--;
+		} else if (argc > 2 && strcmp (argv[1], "--benchmark") == 0) {
+			benchmark = atoi (argv[2]);
+			argv[2] = argv[0];
+			argv += 2;
+			argc -= 2;
+		} else
+			break;
+	}
 	
 	program = mate_program_init ("testiconlist", "0.0",
 			    LIBMATEUI_MODULE,
@@ -42,7 +118,7 @@ main (gint argc, gchar **argv)
 	gtk_scrolled_window_set_shadow_type (GTK_SCROLLED_WINDOW (scrolled_window),
 					     GTK_SHADOW_ETCHED_IN);
 	
-	icon_list = mate_icon_list_new (80, NULL, MATE_ICON_LIST_IS_EDITABLE);
+	icon_list = mate_icon_list_new (80, NULL, flags);
 	gtk_container_add (GTK_CONTAINER (scrolled_window), icon_list);
 	
 	g_signal_connect (icon_list, "select_icon",
@@ -87,6 +163,15 @@ main (gint argc, gchar **argv)
 
 	gtk_widget_show_all (window);
 
+	if (benchmark > 0) {
+		if (!append_benchmark (MATE_ICON_LIST (icon_list), benchmark)) {
+			g_printerr ("benchmark failed\n");
+			return 1;
+		}
+		g_object_unref (program);
+		return 0;
+	}
+
 	gtk_main ();
 
 	g_object_unref (program);
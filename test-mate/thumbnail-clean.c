@@ -0,0 +1,87 @@
+/*
+ * Removes unneeded thumbnails from ~/.thumbnails and keeps the cache
+ * under a given size, e.g. from a weekly cron job:
+ *
+ *   thumbnail-clean --max-size=500 --max-age=90
+ *
+ * Thumbnails of deleted or modified local files and broken ones are
+ * always removed; see mate_thumbnail_factory_clean_cache().
+ */
+
+#include <config.h>
+#include <stdio.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mate-thumbnail.h"
+
+static int max_size = 0;
+static int max_age = 0;
+static gboolean dry_run;
+
+static GOptionEntry entries[] = {
+	{ "max-size", 's', 0, G_OPTION_ARG_INT, &max_size,
+	  "Remove the least recently used thumbnails above SIZE megabytes", "SIZE" },
+	{ "max-age", 'a', 0, G_OPTION_ARG_INT, &max_age,
+	  "Remove the thumbnails not used for DAYS days", "DAYS" },
+	{ "dry-run", 'n', 0, G_OPTION_ARG_NONE, &dry_run,
+	  "Only show what would be removed", NULL },
+	{ NULL }
+};
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	MateThumbnailFactory *factory;
+	MateThumbnailCleanResult result;
+	guint64 removed;
+	GTimer *timer;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+	g_type_init ();
+
+	context = g_option_context_new ("- remove unneeded thumbnails");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	if (max_size < 0 || max_age < 0) {
+		g_printerr ("Limits can't be negative\n");
+		return 1;
+	}
+
+	factory = mate_thumbnail_factory_new (MATE_THUMBNAIL_SIZE_NORMAL);
+	timer = g_timer_new ();
+
+	mate_thumbnail_factory_clean_cache (factory,
+					    (guint64) max_size * 1024 * 1024,
+					    (time_t) max_age * 24 * 60 * 60,
+					    dry_run, &result);
+
+	removed = result.orphaned + result.stale + result.invalid +
+		result.expired + result.evicted;
+
+	g_print ("%" G_GUINT64_FORMAT " thumbnails, %" G_GUINT64_FORMAT " KB, checked in %.1fs\n",
+		 result.files, result.bytes / 1024, g_timer_elapsed (timer, NULL));
+	g_print ("%s %" G_GUINT64_FORMAT " files, %" G_GUINT64_FORMAT " KB:\n",
+		 dry_run ? "Would remove" : "Removed",
+		 removed, result.bytes_removed / 1024);
+	g_print ("  %" G_GUINT64_FORMAT " of deleted files\n", result.orphaned);
+	g_print ("  %" G_GUINT64_FORMAT " of modified files\n", result.stale);
+	g_print ("  %" G_GUINT64_FORMAT " broken or left over\n", result.invalid);
+	g_print ("  %" G_GUINT64_FORMAT " unused for too long\n", result.expired);
+	g_print ("  %" G_GUINT64_FORMAT " to fit in the size limit\n", result.evicted);
+
+	g_timer_destroy (timer);
+	g_object_unref (factory);
+
+	return 0;
+}
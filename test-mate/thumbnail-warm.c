@@ -0,0 +1,448 @@
+/*
+ * Generates the missing thumbnails of a directory tree ahead of time,
+ * e.g. from cron for shared photo directories:
+ *
+ *   thumbnail-warm --jobs=4 --state=~/.warm-photos /srv/photos
+ *
+ * Worker threads take files from a queue and, when it runs low, read
+ * more of the directory being scanned into it, so the crawl and the
+ * thumbnailing run in parallel while at most --queue-depth files wait
+ * for a worker, however large the directories are.
+ *
+ * With --state, every directory whose files are all done is recorded
+ * together with its mtime; an interrupted run started again skips those
+ * files as long as the directory didn't change. A run that completes
+ * removes the state, so the next one looks at every file again: files
+ * can change without changing the mtime of their directory.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mate-thumbnail.h"
+
+typedef struct {
+	char *path;
+	gint64 mtime;
+	GDir *gdir;		/* while it is being scanned */
+	int pending;		/* files queued or being processed */
+	gboolean scanned;
+	gboolean skip_files;	/* done in an earlier run */
+} Directory;
+
+typedef struct {
+	Directory *dir;
+	char *path;
+	time_t mtime;
+	goffset size;
+} QueuedFile;
+
+static MateThumbnailFactory *factory;
+
+static GMutex *lock;
+static GCond *cond;
+static GQueue dirs = G_QUEUE_INIT;
+static GQueue files = G_QUEUE_INIT;
+static int n_busy;
+
+static GHashTable *done_dirs;	/* path -> gint64 mtime, from --state */
+static FILE *state_file;
+
+/* Counters, protected by lock */
+static guint64 n_seen, n_fresh, n_skipped, n_generated, n_failed;
+static guint64 bytes_generated;
+
+static int n_jobs = 0;
+static int queue_depth = 256;
+static gboolean large;
+static gboolean include_hidden;
+static char *state_path;
+
+static GOptionEntry entries[] = {
+	{ "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs,
+	  "Number of worker threads (default: one per processor)", "N" },
+	{ "queue-depth", 'q', 0, G_OPTION_ARG_INT, &queue_depth,
+	  "Maximum number of files waiting for a worker", "N" },
+	{ "large", 'l', 0, G_OPTION_ARG_NONE, &large,
+	  "Generate large (256 pixel) thumbnails", NULL },
+	{ "hidden", 0, 0, G_OPTION_ARG_NONE, &include_hidden,
+	  "Descend into hidden files and directories", NULL },
+	{ "state", 's', 0, G_OPTION_ARG_FILENAME, &state_path,
+	  "Record progress in FILE to resume an interrupted run", "FILE" },
+	{ NULL }
+};
+
+static void
+load_state (void)
+{
+	char *contents, **lines, *path, *end;
+	gint64 *mtime;
+	int i;
+
+	done_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+	if (state_path == NULL)
+		return;
+
+	/* Each line is "<mtime> <escaped path>" */
+	if (g_file_get_contents (state_path, &contents, NULL, NULL)) {
+		lines = g_strsplit (contents, "\n", -1);
+		for (i = 0; lines[i] != NULL; i++) {
+			mtime = g_new (gint64, 1);
+			*mtime = g_ascii_strtoll (lines[i], &end, 10);
+			if (end == lines[i] || *end != ' ') {
+				g_free (mtime);
+				continue;
+			}
+			path = g_strcompress (end + 1);
+			g_hash_table_insert (done_dirs, path, mtime);
+		}
+		g_strfreev (lines);
+		g_free (contents);
+	}
+
+	state_file = g_fopen (state_path, "a");
+	if (state_file == NULL)
+		g_printerr ("Can't write %s: %s\n", state_path, g_strerror (errno));
+}
+
+/* Called with the lock held */
+static void
+directory_unref_file (Directory *dir)
+{
+	char *escaped;
+
+	dir->pending--;
+	if (dir->pending > 0 || !dir->scanned)
+		return;
+
+	if (state_file != NULL && !dir->skip_files) {
+		escaped = g_strescape (dir->path, NULL);
+		fprintf (state_file, "%" G_GINT64_FORMAT " %s\n", dir->mtime, escaped);
+		fflush (state_file);
+		g_free (escaped);
+	}
+
+	g_free (dir->path);
+	g_free (dir);
+}
+
+/* done_dirs doesn't change after load_state(), so this needs no lock */
+static Directory *
+directory_new (char *path, gint64 mtime)
+{
+	Directory *dir;
+	gint64 *done_mtime;
+
+	dir = g_new0 (Directory, 1);
+	dir->path = path;
+	dir->mtime = mtime;
+	/* Keeps the directory alive until it is scanned */
+	dir->pending = 1;
+	done_mtime = g_hash_table_lookup (done_dirs, path);
+	dir->skip_files = done_mtime != NULL && *done_mtime == mtime;
+
+	return dir;
+}
+
+/* Called without the lock; queues up to @room more files and puts
+ * @dir back in front to be continued if it has more entries. lstat()
+ * so symlinks can't make us loop */
+static void
+scan_directory (Directory *dir, int room)
+{
+	GQueue new_files = G_QUEUE_INIT;
+	GQueue new_dirs = G_QUEUE_INIT;
+	const char *name;
+	QueuedFile *file;
+	Directory *subdir;
+	struct stat st;
+	char *path;
+	gboolean at_end;
+
+	if (dir->gdir == NULL)
+		dir->gdir = g_dir_open (dir->path, 0, NULL);
+
+	at_end = dir->gdir == NULL;
+	while (!at_end && (int) g_queue_get_length (&new_files) < room) {
+		name = g_dir_read_name (dir->gdir);
+		if (name == NULL) {
+			at_end = TRUE;
+			break;
+		}
+
+		if (name[0] == '.' && !include_hidden)
+			continue;
+
+		path = g_build_filename (dir->path, name, NULL);
+		if (g_lstat (path, &st) != 0) {
+			g_free (path);
+			continue;
+		}
+
+		if (S_ISDIR (st.st_mode) && strcmp (name, ".thumbnails") != 0) {
+			g_queue_push_tail (&new_dirs, directory_new (path, st.st_mtime));
+		} else if (S_ISREG (st.st_mode) && !dir->skip_files) {
+			file = g_new0 (QueuedFile, 1);
+			file->dir = dir;
+			file->path = path;
+			file->mtime = st.st_mtime;
+			file->size = st.st_size;
+			g_queue_push_tail (&new_files, file);
+		} else {
+			g_free (path);
+		}
+	}
+
+	if (at_end && dir->gdir != NULL) {
+		g_dir_close (dir->gdir);
+		dir->gdir = NULL;
+	}
+
+	g_mutex_lock (lock);
+
+	while ((subdir = g_queue_pop_head (&new_dirs)) != NULL)
+		g_queue_push_tail (&dirs, subdir);
+
+	while ((file = g_queue_pop_head (&new_files)) != NULL) {
+		dir->pending++;
+		g_queue_push_tail (&files, file);
+	}
+
+	/* Finishing it first keeps few directories open */
+	if (!at_end) {
+		g_queue_push_head (&dirs, dir);
+	} else {
+		dir->scanned = TRUE;
+		directory_unref_file (dir);
+	}
+
+	g_mutex_unlock (lock);
+}
+
+static void
+process_file (QueuedFile *file)
+{
+	GdkPixbuf *pixbuf;
+	char *uri, *thumbnail, *mime_type;
+	gboolean uncertain;
+	guint64 *counter;
+
+	counter = &n_skipped;
+	uri = g_filename_to_uri (file->path, NULL, NULL);
+	if (uri == NULL)
+		goto out;
+
+	thumbnail = mate_thumbnail_factory_lookup (factory, uri, file->mtime);
+	if (thumbnail != NULL) {
+		g_free (thumbnail);
+		counter = &n_fresh;
+		goto out;
+	}
+
+	/* Guessing from the name only keeps the crawl from reading every
+	 * file that can't be thumbnailed anyway. Content types are mime
+	 * types on Unix. */
+	mime_type = g_content_type_guess (file->path, NULL, 0, &uncertain);
+
+	if (mime_type != NULL &&
+	    mate_thumbnail_factory_can_thumbnail (factory, uri, mime_type, file->mtime)) {
+		pixbuf = mate_thumbnail_factory_generate_thumbnail (factory, uri, mime_type);
+		if (pixbuf != NULL) {
+			mate_thumbnail_factory_save_thumbnail (factory, pixbuf, uri, file->mtime);
+			g_object_unref (pixbuf);
+			counter = &n_generated;
+		} else {
+			mate_thumbnail_factory_create_failed_thumbnail (factory, uri, file->mtime);
+			counter = &n_failed;
+		}
+	}
+	g_free (mime_type);
+
+ out:
+	g_free (uri);
+
+	g_mutex_lock (lock);
+	(*counter)++;
+	if (counter == &n_generated)
+		bytes_generated += file->size;
+	n_seen++;
+	directory_unref_file (file->dir);
+	g_mutex_unlock (lock);
+
+	g_free (file->path);
+	g_free (file);
+}
+
+static gpointer
+worker (gpointer data)
+{
+	QueuedFile *file;
+	Directory *dir;
+	int room;
+
+	g_mutex_lock (lock);
+
+	for (;;) {
+		/* Keep up to queue_depth files ahead of the workers */
+		if (!g_queue_is_empty (&dirs) &&
+		    (int) g_queue_get_length (&files) < queue_depth) {
+			dir = g_queue_pop_head (&dirs);
+			room = queue_depth - (int) g_queue_get_length (&files);
+			n_busy++;
+			g_mutex_unlock (lock);
+
+			scan_directory (dir, room);
+		} else if ((file = g_queue_pop_head (&files)) != NULL) {
+			n_busy++;
+			g_mutex_unlock (lock);
+
+			process_file (file);
+		} else if (n_busy == 0 && g_queue_is_empty (&dirs)) {
+			break;
+		} else {
+			g_cond_wait (cond, lock);
+			continue;
+		}
+
+		g_mutex_lock (lock);
+		n_busy--;
+		g_cond_broadcast (cond);
+	}
+
+	g_cond_broadcast (cond);
+	g_mutex_unlock (lock);
+
+	return NULL;
+}
+
+static void
+print_progress (GTimer *timer, gboolean final)
+{
+	double elapsed;
+
+	elapsed = MAX (g_timer_elapsed (timer, NULL), 0.001);
+
+	g_printerr ("%s%" G_GUINT64_FORMAT " files: %" G_GUINT64_FORMAT " generated, %"
+		    G_GUINT64_FORMAT " up to date, %" G_GUINT64_FORMAT " failed, %"
+		    G_GUINT64_FORMAT " skipped; %.1f files/s, %.2f MB/s%s",
+		    final ? "" : "\r",
+		    n_seen, n_generated, n_fresh, n_failed, n_skipped,
+		    n_seen / elapsed,
+		    bytes_generated / elapsed / (1024 * 1024),
+		    final ? "\n" : "  ");
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GThread **threads;
+	GTimer *timer;
+	GTimeVal now, next_report;
+	struct stat st;
+	GFile *file;
+	char *path;
+	int i, n_running;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+	g_type_init ();
+
+	context = g_option_context_new ("DIRECTORY... - create missing thumbnails");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	if (argc < 2) {
+		g_printerr ("No directory given\n");
+		return 1;
+	}
+
+	if (n_jobs <= 0)
+		n_jobs = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+	queue_depth = MAX (queue_depth, 1);
+
+	lock = g_mutex_new ();
+	cond = g_cond_new ();
+	load_state ();
+
+	factory = mate_thumbnail_factory_new (large ? MATE_THUMBNAIL_SIZE_LARGE :
+					      MATE_THUMBNAIL_SIZE_NORMAL);
+
+	/* Thumbnails are keyed by URI and the state by path, both of
+	 * which need to be absolute */
+	for (i = 1; i < argc; i++) {
+		file = g_file_new_for_commandline_arg (argv[i]);
+		path = g_file_get_path (file);
+		g_object_unref (file);
+
+		if (path == NULL || g_stat (path, &st) != 0 || !S_ISDIR (st.st_mode)) {
+			g_printerr ("%s is not a directory\n", argv[i]);
+			g_free (path);
+			continue;
+		}
+		g_queue_push_tail (&dirs, directory_new (path, st.st_mtime));
+	}
+
+	timer = g_timer_new ();
+
+	threads = g_new (GThread *, n_jobs);
+	n_running = 0;
+	for (i = 0; i < n_jobs; i++) {
+		threads[n_running] = g_thread_create (worker, NULL, TRUE, NULL);
+		if (threads[n_running] != NULL)
+			n_running++;
+	}
+	if (n_running == 0)
+		worker (NULL);
+
+	/* Report once a second until the workers are done */
+	g_get_current_time (&next_report);
+	g_time_val_add (&next_report, G_USEC_PER_SEC);
+
+	g_mutex_lock (lock);
+	while (n_busy > 0 || !g_queue_is_empty (&dirs) || !g_queue_is_empty (&files)) {
+		g_cond_timed_wait (cond, lock, &next_report);
+
+		g_get_current_time (&now);
+		if (now.tv_sec > next_report.tv_sec ||
+		    (now.tv_sec == next_report.tv_sec && now.tv_usec >= next_report.tv_usec)) {
+			print_progress (timer, FALSE);
+			next_report = now;
+			g_time_val_add (&next_report, G_USEC_PER_SEC);
+		}
+	}
+	g_mutex_unlock (lock);
+
+	for (i = 0; i < n_running; i++)
+		g_thread_join (threads[i]);
+	g_free (threads);
+
+	print_progress (timer, TRUE);
+
+	g_timer_destroy (timer);
+	if (state_file != NULL) {
+		fclose (state_file);
+		g_unlink (state_path);
+	}
+	g_hash_table_destroy (done_dirs);
+	g_object_unref (factory);
+
+	return 0;
+}